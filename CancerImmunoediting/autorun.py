@@ -2,27 +2,18 @@
 # -*- coding: utf-8 -*-
 
 import os
+import multiprocessing
 
-# 自動化する処理を作成する。
-def auto(n):
-    match = 'const ENERGY CELL_DIVISION_THRESHOLD_ENERGY ='
-    distr = '%s %f; //: 細胞分裂エネルギー閾値' % (match, n)
-    filepass = 'src/main.cpp'
-    command='sed -i -e "/%s/c %s" %s' % (match, distr, filepass)
-    os.system(command)
-    os.system('make all')
-    os.system('make pack')
- 
-def autorun(function, n):
-    for i in n:
-        function(i)
-
-data = []
-for i in range(200):
-    data.append((i+1)*0.5)
+# 細胞分裂エネルギー閾値を 0.5 から 100 まで 0.5 刻みで変えて実行する。
+# 実行は sweep.py の作業キューに任せるので、途中で止めても
+# もう一度実行すれば、終わっていないジョブから再開する。
+# ジョブは１スレッドで実行するので、ワーカーはコアの数だけ起動する。
+NAME = 'autorun'
+SWEEP = 'CELL_DIVISION_THRESHOLD_ENERGY=0.5:100:0.5'
 
 # Main routine
 if __name__ == '__main__':
-    print '---> has started AutoRun system'
-    autorun(auto, data)
-
+    print('---> has started AutoRun system')
+    if not os.path.exists(os.path.join('sweep', NAME)):
+        os.system('python sweep.py init %s %s' % (NAME, SWEEP))
+    os.system('python sweep.py work %s -n %d' % (NAME, multiprocessing.cpu_count()))
@@ -0,0 +1,132 @@
+#! /usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# master/ に保存した実行結果の索引を作る。
+#
+# 各実行の要約（パラメータ、乱数の種、実行時間、最終値と集計値）を
+# master/catalog.tsv の１行にまとめる。索引は追加された実行の分だけ更新するので、
+# 実行結果を比較するときは、この１ファイルだけを読めばよい。
+#
+# 使い方:
+#   python catalog.py build
+#   python catalog.py query CELL_DIVISION_THRESHOLD_ENERGY=10 'final_cancer_size>100'
+#   python catalog.py query -f run,CELL_DIVISION_THRESHOLD_ENERGY,final_cancer_size
+#   python catalog.py fields
+
+import os
+import sys
+
+MASTER_DIR = 'master'
+CATALOG_FNAME = os.path.join(MASTER_DIR, 'catalog.tsv')
+SUMMARY_FNAME = 'bin/summary.txt'
+SOURCE_FNAME = 'src/main.cpp'
+
+# 設定パラメータを表す文字列
+CONST_STRING = '//:'
+
+def read_parameters(fname):
+    """ ソースファイルから定数パラメータを抜き出す """
+    params = []
+    if not os.path.exists(fname): return params
+    for line in open(fname):
+        if CONST_STRING not in line: continue
+        line = line.split()
+        if len(line) < 5 or line[3] != '=': continue
+        params.append((line[2], line[4].rstrip(';')))
+    return params
+
+def read_summary(fname):
+    """ summary.txt を読む """
+    summary = []
+    if not os.path.exists(fname): return summary
+    for line in open(fname):
+        line = line.split()
+        if len(line) == 2: summary.append((line[0], line[1]))
+    return summary
+
+def run_record(run):
+    record = [('run', run)]
+    record += read_parameters(os.path.join(MASTER_DIR, run, SOURCE_FNAME))
+    record += read_summary(os.path.join(MASTER_DIR, run, SUMMARY_FNAME))
+    return record
+
+def load():
+    """ 索引を読んで、列名と行の配列を返す """
+    if not os.path.exists(CATALOG_FNAME): return [], []
+    lines = open(CATALOG_FNAME).read().splitlines()
+    if not lines: return [], []
+    fields = lines[0].split('\t')
+    rows = [dict(zip(fields, line.split('\t'))) for line in lines[1:] if line]
+    return fields, rows
+
+def save(fields, rows):
+    tmp = CATALOG_FNAME + '.tmp'
+    f = open(tmp, 'w')
+    f.write('\t'.join(fields) + '\n')
+    for row in rows:
+        f.write('\t'.join([row.get(field, '') for field in fields]) + '\n')
+    f.close()
+    os.rename(tmp, CATALOG_FNAME)
+
+def build():
+    """ 索引にない実行だけを加える """
+    fields, rows = load()
+    known = set([row['run'] for row in rows])
+    added = 0
+    for run in sorted(os.listdir(MASTER_DIR)):
+        if not 'result' in run or run in known: continue
+        if not os.path.isdir(os.path.join(MASTER_DIR, run)): continue
+        record = run_record(run)
+        for field, value in record:
+            if field not in fields: fields.append(field)
+        rows.append(dict(record))
+        added += 1
+    save(fields, rows)
+    print('==> %d runs added, %d runs in %s' % (added, len(rows), CATALOG_FNAME))
+
+OPERATORS = ['<=', '>=', '!=', '=', '<', '>']
+
+def parse_condition(condition):
+    for op in OPERATORS:
+        if op in condition:
+            field, value = condition.split(op, 1)
+            return field, op, value
+    raise ValueError('invalid condition: %s' % condition)
+
+def compare(a, op, b):
+    try:
+        a, b = float(a), float(b)
+    except ValueError:
+        pass
+    if op == '=': return a == b
+    if op == '!=': return a != b
+    if op == '<': return a < b
+    if op == '>': return a > b
+    if op == '<=': return a <= b
+    if op == '>=': return a >= b
+
+def query(args):
+    fields, rows = load()
+    show = fields
+    conditions = []
+    i = 0
+    while i < len(args):
+        if args[i] == '-f':
+            show = args[i+1].split(',')
+            i += 2
+            continue
+        conditions.append(parse_condition(args[i]))
+        i += 1
+    print('\t'.join(show))
+    for row in rows:
+        if all([field in row and compare(row[field], op, value)
+                for field, op, value in conditions]):
+            print('\t'.join([row.get(field, '') for field in show]))
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2 or sys.argv[1] == 'build':
+        build()
+    elif sys.argv[1] == 'query':
+        query(sys.argv[2:])
+    elif sys.argv[1] == 'fields':
+        print('\n'.join(load()[0]))
@@ -0,0 +1,395 @@
+#! /usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# 感度解析のための標本設計
+#
+# パラメータの範囲を宣言すると、範囲を一様に埋める標本点を作り、
+# 乱数の種を変えた反復と組にして sweep.py のジョブにする。
+#
+#   lhs       ラテン超方格。各パラメータの範囲を N 等分して、どの区間にも１点ずつ置く
+#   saltelli  Sobol 列から行列 A, B と、A の第 i 列を B の第 i 列に替えた AB_i を作る（N(k+2) 点）
+#
+# 実行は sweep.py work に任せる。analyze は各実行の summary.txt を読み、
+# 反復の平均を各点の出力として感度指標を計算する。
+# saltelli では一次の指標（Saltelli 2010）と全効果の指標（Jansen）を、
+# lhs では一次の指標だけを、パラメータの値で区切った条件付き平均の分散から求める。
+# 信頼区間は標本点のブートストラップでとる。
+# refine は、lhs では近傍との出力の差が大きい点のまわりに点を加え、
+# saltelli では Sobol 列の続きをとって N を倍にする。
+#
+# 範囲は NAME=low:high、対数尺度なら NAME=low:high:log と書く。int のパラメータは整数にする。
+# 反復 r（0 から）は RANDOM_SEED=r+1 で実行するので、どの点も同じ種の組で比べる。
+#
+# 使い方:
+#   python design.py init sa saltelli 64 TCELL_SIZE=100:3000:log CELL_MUTATION_RATE=1:10 --replicates 3
+#   python design.py init scan lhs 50 CELL_DIVISION_THRESHOLD_ENERGY=0.5:100 --set MAX_STEP=3000
+#   python sweep.py work sa -n 8
+#   python design.py analyze sa [OUTPUT ...]
+#   python design.py refine scan 20 [OUTPUT]
+
+import os
+import re
+import sys
+import json
+import math
+import random
+
+import sweep
+import catalog
+
+DESIGN_FNAME = 'design.json'
+SEED_PARAM = 'RANDOM_SEED'
+OUTPUTS = ['final_cancer_size', 'final_hidden_cancer_size', 'max_cancer_size',
+           'first_cancer_step', 'total_killed']
+LHS_CANDIDATES = 10     # 最小距離が最大になるものを選ぶ、ラテン超方格の候補数
+REFINE_CANDIDATES = 30  # 加える点ごとの候補数
+BOOTSTRAP = 200         # ブートストラップの反復数
+
+# ---------------------------------------------------------------- Sobol 列
+
+# Joe, Kuo (2008) の方向数。２次元目から (s, a, m_1 ... m_s)
+DIRECTIONS = [
+    (1, 0, [1]),
+    (2, 1, [1, 3]),
+    (3, 1, [1, 3, 1]),
+    (3, 2, [1, 1, 1]),
+    (4, 1, [1, 1, 3, 3]),
+    (4, 4, [1, 3, 5, 13]),
+    (5, 2, [1, 1, 5, 5, 17]),
+    (5, 4, [1, 1, 5, 5, 5]),
+    (5, 7, [1, 1, 7, 11, 19]),
+    (5, 11, [1, 1, 5, 1, 1]),
+    (5, 13, [1, 1, 1, 3, 11]),
+    (5, 14, [1, 3, 5, 5, 31]),
+    (6, 1, [1, 3, 3, 9, 7, 49]),
+    (6, 13, [1, 1, 1, 15, 21, 21]),
+    (6, 16, [1, 3, 1, 13, 27, 49]),
+    (6, 19, [1, 1, 1, 15, 7, 5]),
+    (6, 22, [1, 3, 1, 15, 13, 25]),
+    (6, 25, [1, 1, 5, 5, 19, 61]),
+    (7, 1, [1, 3, 7, 11, 23, 15, 103]),
+    (7, 4, [1, 3, 7, 13, 13, 15, 69]),
+    (7, 7, [1, 1, 3, 13, 7, 35, 63]),
+    (7, 8, [1, 3, 5, 9, 1, 25, 53]),
+    (7, 14, [1, 3, 1, 13, 9, 35, 107]),
+    (7, 19, [1, 3, 1, 5, 27, 61, 31]),
+    (7, 21, [1, 1, 5, 11, 19, 41, 61]),
+    (7, 28, [1, 3, 5, 3, 3, 13, 69]),
+    (7, 31, [1, 1, 7, 13, 1, 19, 1]),
+    (7, 32, [1, 3, 7, 5, 13, 19, 59]),
+    (7, 37, [1, 1, 3, 9, 25, 29, 41]),
+    (7, 41, [1, 3, 5, 13, 23, 1, 55]),
+    (7, 42, [1, 3, 7, 3, 13, 59, 17]),
+    (7, 50, [1, 3, 1, 3, 5, 53, 69]),
+    (7, 55, [1, 1, 5, 5, 23, 33, 13]),
+    (7, 56, [1, 1, 7, 7, 1, 61, 123]),
+    (7, 59, [1, 1, 7, 9, 13, 61, 49]),
+    (7, 62, [1, 3, 3, 5, 3, 55, 33]),
+    (8, 14, [1, 3, 1, 15, 31, 13, 49, 245]),
+    (8, 21, [1, 3, 5, 15, 31, 59, 63, 97]),
+    (8, 22, [1, 3, 1, 11, 11, 11, 77, 249]),
+]
+BITS = 30
+
+def sobol_directions(dims):
+    """ 次元ごとの方向数 V[0..BITS-1] """
+    if dims > len(DIRECTIONS) + 1:
+        raise ValueError('sobol sequence supports up to %d dimensions' % (len(DIRECTIONS) + 1))
+    table = [[1 << (BITS - 1 - i) for i in range(BITS)]]
+    for s, a, m in DIRECTIONS[:dims-1]:
+        v = [m[i] << (BITS - 1 - i) for i in range(s)]
+        for i in range(s, BITS):
+            x = v[i-s] ^ (v[i-s] >> s)
+            for k in range(1, s):
+                if a >> (s - 1 - k) & 1: x ^= v[i-k]
+            v.append(x)
+        table.append(v)
+    return table
+
+def sobol(dims, first, count):
+    """ Sobol 列の first 番目から count 点。グレイコードの順に並べる """
+    table = sobol_directions(dims)
+    points = []
+    for n in range(first, first + count):
+        gray = n ^ (n >> 1)
+        point = []
+        for v in table:
+            x, bit = 0, 0
+            while gray >> bit:
+                if gray >> bit & 1: x ^= v[bit]
+                bit += 1
+            point.append(x/float(1 << BITS))
+        points.append(point)
+    return points
+
+# ---------------------------------------------------------------- 標本点
+
+def distance2(p, q):
+    return sum([(a - b)**2 for a, b in zip(p, q)])
+
+def min_distance2(points):
+    best = float('inf')
+    for i in range(len(points)):
+        for j in range(i):
+            best = min(best, distance2(points[i], points[j]))
+    return best
+
+def latin_hypercube(n, k, rng):
+    """ 候補の中から、点どうしの最小距離が最大のものを選ぶ """
+    best, best_score = None, -1.0
+    for c in range(LHS_CANDIDATES):
+        columns = []
+        for i in range(k):
+            strata = list(range(n))
+            rng.shuffle(strata)
+            columns.append([(s + rng.random())/n for s in strata])
+        points = [list(point) for point in zip(*columns)]
+        score = min_distance2(points)
+        if score > best_score: best, best_score = points, score
+    return best
+
+def saltelli_blocks(k, first, n):
+    """ Sobol 列の 2k 次元の点を A と B に分け、A, B, AB_1 ... AB_k の順に並べる """
+    points = []
+    for row in sobol(2*k, first, n):
+        a, b = row[:k], row[k:]
+        points.append(a)
+        points.append(b)
+        for i in range(k):
+            points.append(a[:i] + [b[i]] + a[i+1:])
+    return points
+
+# ---------------------------------------------------------------- パラメータ
+
+def parameter_type(source, param):
+    m = re.search(r'^const\s+(\S+)\s+%s\s*=' % re.escape(param), source, re.M)
+    if m is None: raise ValueError('unknown parameter: %s' % param)
+    return m.group(1)
+
+def parse_range(source, text):
+    """ NAME=low:high[:log] """
+    param, text = text.split('=', 1)
+    fields = text.split(':')
+    if len(fields) not in (2, 3) or (len(fields) == 3 and fields[2] != 'log'):
+        raise ValueError('invalid range: %s' % text)
+    low, high = float(fields[0]), float(fields[1])
+    kind = parameter_type(source, param)
+    if kind == 'bool' or param == SEED_PARAM:
+        raise ValueError('cannot sample %s' % param)
+    log = len(fields) == 3
+    if high <= low or (log and low <= 0): raise ValueError('invalid range: %s' % text)
+    return {'name': param, 'low': low, 'high': high, 'log': log, 'int': kind == 'int'}
+
+def value_of(param, u):
+    """ 単位区間の u をパラメータの値の文字列にする """
+    low, high = param['low'], param['high']
+    if param['log']:
+        value = low*math.exp(u*math.log(high/low))
+        if param['int']: return '%d' % min(max(int(round(value)), int(low)), int(high))
+    elif param['int']:
+        # どの整数も同じ幅をもつように区切る
+        return '%d' % min(int(math.floor(low + u*(high - low + 1))), int(high))
+    else:
+        value = low + u*(high - low)
+    return '%.6g' % value
+
+def jobs_of(design, points):
+    """ 点ごとに反復の数だけジョブを作る。ジョブ番号は 点*反復数 + 反復 """
+    jobs = []
+    for u in points:
+        params = [(p['name'], value_of(p, x)) for p, x in zip(design['params'], u)]
+        for r in range(design['replicates']):
+            jobs.append(params + [tuple(f) for f in design['fixed']] + [(SEED_PARAM, str(r + 1))])
+    return jobs
+
+def load_design(name):
+    return json.load(open(sweep.sweep_path(name, DESIGN_FNAME)))
+
+def save_design(name, design):
+    sweep.write_atomic(sweep.sweep_path(name, DESIGN_FNAME), json.dumps(design, indent=1) + '\n')
+
+# ---------------------------------------------------------------- 実行
+
+def init(name, method, n, args):
+    source = open(sweep.SOURCE_FNAME).read()
+    params, fixed = [], []
+    replicates, seed, retries = 1, 1, 1
+    i = 0
+    while i < len(args):
+        if args[i] == '--replicates': replicates = int(args[i+1])
+        elif args[i] == '--seed': seed = int(args[i+1])
+        elif args[i] == '--retries': retries = int(args[i+1])
+        elif args[i] == '--set': fixed.append(tuple(args[i+1].split('=', 1)))
+        else:
+            params.append(parse_range(source, args[i]))
+            i += 1
+            continue
+        i += 2
+    if not params: raise ValueError('no parameter ranges')
+    k = len(params)
+    if method == 'lhs':
+        points = latin_hypercube(n, k, random.Random(seed))
+    elif method == 'saltelli':
+        # 原点は全ての次元で 0 なので飛ばす
+        points = saltelli_blocks(k, 1, n)
+    else:
+        raise ValueError('unknown method: %s' % method)
+    design = {'method': method, 'params': params, 'fixed': fixed, 'replicates': replicates,
+              'seed': seed, 'points': points, 'sobol_next': 1 + n}
+    if not sweep.create(name, jobs_of(design, points), retries): return
+    save_design(name, design)
+    print('==> %s: %d points x %d replicates' % (method, len(points), replicates))
+
+def refine(name, m, output):
+    design = load_design(name)
+    k = len(design['params'])
+    if design['method'] == 'saltelli':
+        n = design['sobol_next'] - 1
+        points = saltelli_blocks(k, design['sobol_next'], n)
+        design['sobol_next'] += n
+        print('==> saltelli: N %d -> %d' % (n, 2*n))
+    else:
+        points = refine_points(design, point_outputs(name, design, output), m)
+    sweep.add_jobs(name, jobs_of(design, points))
+    design['points'] += points
+    save_design(name, design)
+
+def refine_points(design, outputs, m):
+    """ 近傍との出力の差が大きい点のまわりで、既存の点から最も離れた候補を加える """
+    known = [(u, y) for u, y in zip(design['points'], outputs) if y is not None]
+    if len(known) < 2: raise ValueError('not enough results to refine')
+    k = len(design['params'])
+    neighbors = min(k + 1, len(known) - 1)
+    scores, radius = [], []
+    for u, y in known:
+        near = sorted([(distance2(u, v), w) for v, w in known if v is not u])[:neighbors]
+        scores.append(sum([abs(y - w) for d, w in near])/neighbors)
+        radius.append(math.sqrt(near[0][0]))
+    rng = random.Random(design['seed'] + len(design['points']))
+    existing = list(design['points'])
+    added = []
+    for n in range(m):
+        best = max(range(len(known)), key=lambda i: scores[i])
+        center = known[best][0]
+        candidates = [[min(max(x + rng.uniform(-1, 1)*radius[best], 0.0), 1.0) for x in center]
+                      for c in range(REFINE_CANDIDATES)]
+        point = max(candidates, key=lambda p: min([distance2(p, q) for q in existing]))
+        existing.append(point)
+        added.append(point)
+        # 同じ点のまわりにばかり集まらないように、選んだ点の重みを下げる。
+        scores[best] /= 2
+    return added
+
+# ---------------------------------------------------------------- 解析
+
+def point_outputs(name, design, output):
+    """ 点ごとに、反復の出力の平均。結果がなければ None """
+    replicates = design['replicates']
+    values = []
+    for p in range(len(design['points'])):
+        samples = []
+        for r in range(replicates):
+            run = 'result-%s-%05d' % (name, p*replicates + r)
+            summary = dict(catalog.read_summary(os.path.join(sweep.MASTER_DIR, run,
+                                                             catalog.SUMMARY_FNAME)))
+            if output in summary: samples.append(float(summary[output]))
+        values.append(sum(samples)/len(samples) if samples else None)
+    return values
+
+def variance(values):
+    mean = sum(values)/len(values)
+    return sum([(v - mean)**2 for v in values])/len(values)
+
+def saltelli_indices(blocks, k):
+    """ 各ブロックは (f(A), f(B), f(AB_1) ... f(AB_k))。一次と全効果の指標を返す """
+    n = float(len(blocks))
+    total = variance([b[0] for b in blocks] + [b[1] for b in blocks])
+    if total == 0: return [float('nan')]*k, [float('nan')]*k
+    # 平均を引いておくと、一次の指標の推定の分散が小さくなる。
+    mean = sum([b[0] + b[1] for b in blocks])/(2*n)
+    blocks = [[f - mean for f in b] for b in blocks]
+    first = [sum([b[1]*(b[2+i] - b[0]) for b in blocks])/n/total for i in range(k)]
+    whole = [sum([(b[0] - b[2+i])**2 for b in blocks])/(2*n)/total for i in range(k)]
+    return first, whole
+
+def binned_indices(rows, k):
+    """ 各行は (u, y)。パラメータの値で √n 個に区切った、条件付き平均の分散の割合 """
+    total = variance([y for u, y in rows])
+    if total == 0: return [float('nan')]*k, None
+    bins = max(2, int(math.sqrt(len(rows))))
+    # 区間の平均は標本の揺らぎの分だけばらつくので、その期待値を差し引く。
+    bias = (bins - 1)/float(len(rows) - 1)
+    first = []
+    for i in range(k):
+        ordered = sorted(rows, key=lambda row: row[0][i])
+        means = []
+        for b in range(bins):
+            ys = [y for u, y in ordered[b*len(rows)//bins:(b + 1)*len(rows)//bins]]
+            means.append((len(ys), sum(ys)/len(ys)))
+        mean = sum([y for u, y in rows])/len(rows)
+        ratio = sum([c*(y - mean)**2 for c, y in means])/len(rows)/total
+        first.append((ratio - bias)/(1 - bias))
+    return first, None
+
+def percentile(values, q):
+    values = sorted([v for v in values if v == v])
+    if not values: return float('nan')
+    return values[min(int(q*len(values)), len(values) - 1)]
+
+def bootstrap(rows, estimate, k, rng):
+    """ 行を復元抽出して、各指標の 95% 信頼区間をとる """
+    samples = [estimate([rows[rng.randrange(len(rows))] for r in rows], k) for b in range(BOOTSTRAP)]
+    intervals = []
+    for which in range(2):
+        if samples[0][which] is None:
+            intervals.append(None)
+            continue
+        intervals.append([(percentile([s[which][i] for s in samples], 0.025),
+                           percentile([s[which][i] for s in samples], 0.975)) for i in range(k)])
+    return intervals
+
+def analyze(name, outputs):
+    design = load_design(name)
+    params = design['params']
+    k = len(params)
+    rng = random.Random(design['seed'])
+    for output in outputs:
+        values = point_outputs(name, design, output)
+        if design['method'] == 'saltelli':
+            blocks = [values[j:j + k + 2] for j in range(0, len(values), k + 2)]
+            rows = [b for b in blocks if None not in b]
+            estimate = saltelli_indices
+            size = len(blocks)
+        else:
+            rows = [(u, y) for u, y in zip(design['points'], values) if y is not None]
+            estimate = binned_indices
+            size = len(values)
+        print('# %s: %d of %d samples, %d replicates' % (output, len(rows), size, design['replicates']))
+        if len(rows) < 2: continue
+        first, whole = estimate(rows, k)
+        first_ci, whole_ci = bootstrap(rows, estimate, k, rng)
+        print('# param S1 S1_low S1_high ST ST_low ST_high')
+        for i, param in enumerate(params):
+            line = [param['name'], '%.4f' % first[i], '%.4f' % first_ci[i][0], '%.4f' % first_ci[i][1]]
+            if whole is None: line += ['-', '-', '-']
+            else: line += ['%.4f' % whole[i], '%.4f' % whole_ci[i][0], '%.4f' % whole_ci[i][1]]
+            print(' '.join(line))
+
+def usage():
+    print('usage: design.py init NAME lhs|saltelli N PARAM=low:high[:log] ... '
+          '[--replicates R] [--seed S] [--set PARAM=VALUE] [--retries K]')
+    print('       design.py analyze NAME [OUTPUT ...]')
+    print('       design.py refine NAME M [OUTPUT]')
+    sys.exit(1)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3: usage()
+    command, name = sys.argv[1], sys.argv[2]
+    if command == 'init' and len(sys.argv) >= 6:
+        init(name, sys.argv[3], int(sys.argv[4]), sys.argv[5:])
+    elif command == 'analyze':
+        analyze(name, sys.argv[3:] or OUTPUTS)
+    elif command == 'refine' and len(sys.argv) in (4, 5):
+        refine(name, int(sys.argv[3]), sys.argv[4] if len(sys.argv) == 5 else OUTPUTS[0])
+    else:
+        usage()
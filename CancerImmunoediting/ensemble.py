@@ -0,0 +1,200 @@
+#! /usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# 複製実行のアンサンブル統計
+#
+# 複製実行の時系列（"step value" の行）を１本ずつ取り込んで、ステップごとに
+# 平均と分散（Welford法）、最小値と最大値、分位点（P2法）を逐次更新する。
+# 保存するのは集計だけなので、メモリとディスクの使用量は複製の数によらない。
+#
+# 複数のワーカーが同時に取り込んでもよいように、取り込みはロックファイルで
+# 排他する。取り込んだ実行は <集計ディレクトリ>/runs/<実行ID> の印で覚えておき、
+# 同じ実行を２回取り込んでも、２回目は無視する。集計の状態には実行の一覧を持たず、
+# 最後に取り込んだ実行だけを持つ。
+#
+# 集計は <集計ディレクトリ>/<系列名>-ensemble.txt に書き出す。列は
+#   step n mean variance min max q05 q25 q50 q75 q95
+# 早く停止した実行はその先のステップに寄与しないので、n はステップごとに違うことがある。
+#
+# 使い方:
+#   python ensemble.py add <集計ディレクトリ> <実行ID> <binディレクトリ> cancercell-size mutantcancer-size
+#   python ensemble.py show <集計ディレクトリ> cancercell-size
+
+import os
+import sys
+import json
+import fcntl
+
+QUANTILES = [0.05, 0.25, 0.5, 0.75, 0.95]
+STATE_FNAME = 'state.json'
+LOCK_FNAME = 'lock'
+RUNS_DIR = 'runs'
+
+# ---------------------------------------------------------------- 分位点
+
+def p2_new():
+    """ P2法の状態。最初の５個は値をそのまま持つ """
+    return {'n': 0, 'q': [], 'pos': [], 'desired': []}
+
+def p2_add(sketch, p, x):
+    """ P2法（Jain & Chlamtac）で、分位点 p の推定に x を加える """
+    q = sketch['q']
+    sketch['n'] += 1
+    if sketch['n'] <= 5:
+        q.append(x)
+        q.sort()
+        if sketch['n'] == 5:
+            sketch['pos'] = [1, 2, 3, 4, 5]
+            sketch['desired'] = [1, 1 + 2*p, 1 + 4*p, 3 + 2*p, 5]
+        return
+    pos, desired = sketch['pos'], sketch['desired']
+    if x < q[0]:
+        q[0] = x
+        k = 0
+    elif x >= q[4]:
+        q[4] = x
+        k = 3
+    else:
+        k = 0
+        while x >= q[k+1]: k += 1
+    for i in range(k+1, 5): pos[i] += 1
+    increments = [0, p/2, p, (1+p)/2, 1]
+    for i in range(5): desired[i] += increments[i]
+    # 中間の３つの目印を、望ましい位置に近づける。
+    for i in range(1, 4):
+        d = desired[i] - pos[i]
+        if (d >= 1 and pos[i+1] - pos[i] > 1) or (d <= -1 and pos[i-1] - pos[i] < -1):
+            d = 1 if d > 0 else -1
+            parabolic = q[i] + d/float(pos[i+1] - pos[i-1]) * (
+                (pos[i] - pos[i-1] + d)*(q[i+1] - q[i])/float(pos[i+1] - pos[i]) +
+                (pos[i+1] - pos[i] - d)*(q[i] - q[i-1])/float(pos[i] - pos[i-1]))
+            if q[i-1] < parabolic < q[i+1]:
+                q[i] = parabolic
+            else:
+                q[i] = q[i] + d*(q[i+d] - q[i])/float(pos[i+d] - pos[i])
+            pos[i] += d
+
+def p2_value(sketch, p):
+    q = sketch['q']
+    if sketch['n'] == 0: return float('nan')
+    if sketch['n'] < 5:
+        s = sorted(q)
+        return s[min(int(p*len(s)), len(s)-1)]
+    return q[2]
+
+# ---------------------------------------------------------------- 統計
+
+def stat_new():
+    return {'n': 0, 'mean': 0.0, 'm2': 0.0, 'min': None, 'max': None,
+            'quantiles': [p2_new() for p in QUANTILES]}
+
+def stat_add(stat, x):
+    """ Welford法で平均と分散を更新する """
+    stat['n'] += 1
+    delta = x - stat['mean']
+    stat['mean'] += delta/stat['n']
+    stat['m2'] += delta*(x - stat['mean'])
+    stat['min'] = x if stat['min'] is None else min(stat['min'], x)
+    stat['max'] = x if stat['max'] is None else max(stat['max'], x)
+    for p, sketch in zip(QUANTILES, stat['quantiles']):
+        p2_add(sketch, p, x)
+
+def stat_variance(stat):
+    if stat['n'] < 2: return 0.0
+    return stat['m2']/(stat['n'] - 1)
+
+# ---------------------------------------------------------------- 集計
+
+def load_state(directory):
+    fname = os.path.join(directory, STATE_FNAME)
+    if not os.path.exists(fname): return {'series': {}}
+    state = json.load(open(fname))
+    # 実行の一覧を状態に持っていた頃の集計は、印に移す。
+    for run in state.pop('runs', []):
+        mark_run(directory, run)
+    # 集計を保存してから印を付けるまでの間に落ちていたら、ここで印を付ける。
+    if state.get('last_run') is not None:
+        mark_run(directory, state['last_run'])
+    return state
+
+def save_state(directory, state):
+    fname = os.path.join(directory, STATE_FNAME)
+    tmp = '%s.%d.tmp' % (fname, os.getpid())
+    f = open(tmp, 'w')
+    json.dump(state, f)
+    f.close()
+    os.rename(tmp, fname)
+
+def run_marker(directory, run):
+    return os.path.join(directory, RUNS_DIR, run)
+
+def mark_run(directory, run):
+    """ 取り込んだ実行の印を作る。既にあれば偽を返す """
+    if not os.path.exists(os.path.join(directory, RUNS_DIR)):
+        os.makedirs(os.path.join(directory, RUNS_DIR))
+    try:
+        os.close(os.open(run_marker(directory, run), os.O_CREAT | os.O_EXCL | os.O_WRONLY))
+    except OSError:
+        return False
+    return True
+
+def read_series(fname):
+    values = []
+    for line in open(fname):
+        line = line.split()
+        if len(line) == 2: values.append((int(line[0]), float(line[1])))
+    return values
+
+def output(directory, state, name):
+    fname = os.path.join(directory, '%s-ensemble.txt' % name)
+    tmp = '%s.%d.tmp' % (fname, os.getpid())
+    f = open(tmp, 'w')
+    f.write('# step n mean variance min max %s\n'
+            % ' '.join(['q%02d' % int(round(100*p)) for p in QUANTILES]))
+    series = state['series'][name]
+    for step in sorted(series, key=int):
+        stat = series[step]
+        row = [step, stat['n'], stat['mean'], stat_variance(stat), stat['min'], stat['max']]
+        row += [p2_value(sketch, p) for p, sketch in zip(QUANTILES, stat['quantiles'])]
+        f.write(' '.join([str(v) for v in row]) + '\n')
+    f.close()
+    os.rename(tmp, fname)
+
+def add(directory, run, bin_dir, names):
+    """ 実行の時系列を集計に加える """
+    if not os.path.exists(directory): os.makedirs(directory)
+    lock = open(os.path.join(directory, LOCK_FNAME), 'a')
+    fcntl.flock(lock, fcntl.LOCK_EX)
+    try:
+        state = load_state(directory)
+        if os.path.exists(run_marker(directory, run)): return False
+        for name in names:
+            fname = os.path.join(bin_dir, '%s.txt' % name)
+            if not os.path.exists(fname): continue
+            series = state['series'].setdefault(name, {})
+            for step, value in read_series(fname):
+                stat_add(series.setdefault(str(step), stat_new()), value)
+        # 最後に加えた実行は状態にも残すので、印を付ける前に落ちても２回は加えない。
+        state['last_run'] = run
+        save_state(directory, state)
+        mark_run(directory, run)
+        for name in names:
+            if name in state['series']: output(directory, state, name)
+        return True
+    finally:
+        fcntl.flock(lock, fcntl.LOCK_UN)
+        lock.close()
+
+def show(directory, name):
+    fname = os.path.join(directory, '%s-ensemble.txt' % name)
+    sys.stdout.write(open(fname).read())
+
+if __name__ == '__main__':
+    if len(sys.argv) >= 6 and sys.argv[1] == 'add':
+        add(sys.argv[2], sys.argv[3], sys.argv[4], sys.argv[5:])
+    elif len(sys.argv) == 4 and sys.argv[1] == 'show':
+        show(sys.argv[2], sys.argv[3])
+    else:
+        print('usage: ensemble.py add DIR RUN BIN_DIR SERIES...')
+        print('       ensemble.py show DIR SERIES')
+        sys.exit(1)
@@ -10,6 +10,15 @@ html_file = open(HTML_FNAME, 'w')
 
 dirs = os.listdir('./master')
 
+# 索引があれば、最終がん細胞数を表示する
+summary = {}
+if os.path.exists('master/catalog.tsv'):
+    catalog = open('master/catalog.tsv').read().splitlines()
+    fields = catalog[0].split('\t')
+    for line in catalog[1:]:
+        row = dict(zip(fields, line.split('\t')))
+        summary[row['run']] = row.get('final_cancer_size', '') or 'none'
+
 lines = []
 lines += '<html>'
 lines += '<meta http-equiv="Content-Type" content="text/html; charset=utf-8"> '
@@ -19,7 +28,7 @@ lines += '<h1># INDEX</h1>'
 lines += '<table border="5px">'
 for d in reversed(dirs):
     if not 'result' in d: continue
-    lines += '<tr><td><a href="master/%s/stat/index.html">%s</a></td><td>none</td></tr>\n' % (d, d)
+    lines += '<tr><td><a href="master/%s/stat/index.html">%s</a></td><td>%s</td></tr>\n' % (d, d, summary.get(d, 'none'))
 
 for line in lines:
     html_file.write(line)
@@ -0,0 +1,383 @@
+#! /usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# 統計的同等性と性能の回帰検査
+#
+# 高速化（乱数、データ配置、並列化など）で軌道が厳密に一致しなくなっても、
+# 力学が変わっていないことを確かめる。構成ごとに次の３つを検査する。
+#
+#   アンサンブル  複数の種で実行した観測量の分布を、保存した参照と比べる。
+#                 連続量は２標本KS検定、停止理由はカイ二乗検定を使う。
+#   黄金軌道      固定した種の時系列が、保存した参照とビット単位で一致するか。
+#                 乱数の使い方を意図して変えた場合は、記録し直す。
+#   実行時間      実行時間の中央値が、予算（参照の BUDGET_FACTOR 倍）を超えないか。
+#                 アンサンブルは -n で並列に実行するが、実行時間は黄金軌道の種を
+#                 TIMING_RUNS 回、１つずつ実行して測る。
+#
+# 観測量は summary.txt から読む。参照は regress/<構成>.json に保存する。
+#
+# 使い方:
+#   python regress.py record [構成 ...]   参照を記録する
+#   python regress.py check [構成 ...]    参照と比べる。失敗があれば終了コード 1
+#   python regress.py list
+
+import os
+import sys
+import json
+import math
+import shutil
+import hashlib
+import subprocess
+import multiprocessing
+
+from sweep import set_parameters, SOURCE_FNAME, COMPILE, LIBS, EXE_NAME
+
+REGRESS_DIR = 'regress'
+WORK_DIR = os.path.join(REGRESS_DIR, 'work')
+
+ALPHA = 0.01          # 検定全体の有意水準（検定の数で割る）
+BUDGET_FACTOR = 1.5   # 実行時間の予算は、参照の中央値の何倍か
+TIMING_RUNS = 3       # 実行時間を測る回数
+
+# 全構成に共通する設定。出力は時系列と summary.txt だけにする。
+# 実行時間がコアの数によらないように、スレッド数も固定する。
+COMMON = [('MAP_TEXT_OUTPUT', 'false'), ('NATIVE_RENDER', 'false'), ('THREAD_SIZE', '1')]
+
+# 性能を測る大きな格子。100ステップでがんが現れるように、突然変異は最初から起こす。
+LARGE = [('MAX_STEP', '100'), ('WIDTH', '256'), ('HEIGHT', '256'),
+         ('CELL_SIZE', '10000'), ('TCELL_SIZE', '30000'), ('MUTATION_START_STEP', '1')]
+
+# 構成ごとの設定
+#   params   書き換えるパラメータ
+#   seeds    アンサンブルの種。空なら検定しない
+#   golden   黄金軌道の種。None なら比べない
+#   series   黄金軌道として比べる時系列
+#   against  アンサンブルを比べる参照の構成（省略すると自分の参照と比べる）
+CONFIGS = {
+    'reference': {
+        'params': [('MAX_STEP', '2000')],
+        'seeds': range(1, 21),
+        'golden': 7,
+        'series': ['normalcell-size', 'cancercell-size', 'mutantcancer-size',
+                   'tcell-size', 'genevalue-ave', 'cell-energy-average'],
+    },
+    'ctl': {
+        # 殺傷に時間のかかるT細胞（CTL_KILLING_RATE > 0）。殺傷中のT細胞を寿命リングから外す
+        'params': [('MAX_STEP', '2000'), ('CTL_KILLING_RATE', '0.3')],
+        'seeds': range(1, 21),
+        'golden': 7,
+        'series': ['normalcell-size', 'cancercell-size', 'mutantcancer-size',
+                   'tcell-size', 'genevalue-ave', 'cell-energy-average'],
+    },
+    'population': {
+        # 集約表現（POPULATION_MODE=1）が、エージェント表現と同じ分布になるか
+        'params': [('MAX_STEP', '2000'), ('POPULATION_MODE', '1')],
+        'seeds': range(1, 21),
+        'golden': 7,
+        'series': ['normalcell-size', 'cancercell-size', 'mutantcancer-size',
+                   'tcell-size', 'genevalue-ave', 'cell-energy-average'],
+        'against': 'reference',
+    },
+    'bench-large': {
+        'params': LARGE,
+        'seeds': [],
+        'golden': 1,
+        'series': ['normalcell-size', 'cancercell-size'],
+    },
+    'bench-walk': {
+        # 細胞の移動（RandomWalkKernel::moveCells）が大半を占める構成
+        'params': [('MAX_STEP', '100'), ('WIDTH', '256'), ('HEIGHT', '256'),
+                   ('CELL_SIZE', '100000'), ('TCELL_SIZE', '1000')],
+        'seeds': [],
+        'golden': 1,
+        'series': ['normalcell-size', 'cell-energy-average'],
+    },
+    'bench-3d': {
+        'params': [('MAX_STEP', '100'), ('DIMENSION', '3'), ('WIDTH', '64'), ('HEIGHT', '64'),
+                   ('DEPTH', '64'), ('CELL_SIZE', '10000'), ('TCELL_SIZE', '30000'),
+                   ('MUTATION_START_STEP', '1'),
+                   ('MOTILITY_WEIGHT', '0.6666667')],  # 移動のコストの期待値を平面と揃える
+        'seeds': [],
+        'golden': 1,
+        'series': ['normalcell-size', 'cancercell-size'],
+    },
+    # 既定では使わない機能ごとに、bench-large に機能を加えた構成
+    'bench-chemotaxis': {
+        'params': LARGE + [('CHEMOTAXIS', 'true')],
+        'seeds': [],
+        'golden': 1,
+        'series': ['cancercell-size', 'tcell-size'],
+    },
+    'bench-ctl': {
+        'params': LARGE + [('CTL_KILLING_RATE', '0.3')],
+        'seeds': [],
+        'golden': 1,
+        'series': ['cancercell-size', 'tcell-size'],
+    },
+    'bench-population': {
+        'params': LARGE + [('POPULATION_MODE', '1')],
+        'seeds': [],
+        'golden': 1,
+        'series': ['normalcell-size', 'cancercell-size'],
+    },
+}
+
+# 分布を比べる観測量（summary.txt の項目、または派生量）
+CONTINUOUS = ['final_cancer_size', 'hidden_cancer_fraction', 'extinction_step',
+              'final_genevalue_ave', 'max_cancer_size']
+CATEGORICAL = ['stop_reason']
+
+# ---------------------------------------------------------------- 実行
+
+def read_summary(fname):
+    summary = {}
+    for line in open(fname):
+        line = line.split()
+        if len(line) != 2: continue
+        try:
+            summary[line[0]] = float(line[1])
+        except ValueError:
+            summary[line[0]] = line[1]
+    return summary
+
+def observables(summary):
+    """ summary.txt から比べる観測量を作る """
+    values = dict(summary)
+    cancer = summary.get('final_cancer_size', 0)
+    hidden = summary.get('final_hidden_cancer_size', 0)
+    values['hidden_cancer_fraction'] = hidden/cancer if cancer > 0 else 0.0
+    # 消滅で止まらなかった実行は、最大ステップで打ち切ったとみなす。
+    values['extinction_step'] = summary.get('stop_step', 0)
+    return values
+
+def run(args):
+    """ １つの種でビルドして実行し、(観測量, 時系列のハッシュと内容) を返す """
+    name, seed, params, series = args
+    work = os.path.join(WORK_DIR, '%s-%d' % (name, seed))
+    if os.path.exists(work): shutil.rmtree(work)
+    os.makedirs(os.path.join(work, 'bin'))
+    source = set_parameters(open(SOURCE_FNAME).read(),
+                            COMMON + params + [('RANDOM_SEED', str(seed))])
+    open(os.path.join(work, 'main.cpp'), 'w').write(source)
+    log = open(os.path.join(work, 'bin', 'regress.log'), 'w')
+    try:
+        if subprocess.call(COMPILE + [os.path.join(work, 'main.cpp'), '-o',
+                                      os.path.join(work, 'bin', EXE_NAME)] + LIBS,
+                           stdout=log, stderr=log) != 0:
+            raise RuntimeError('%s seed %d: build failed (see %s)' % (name, seed, log.name))
+        if subprocess.call(['./' + EXE_NAME], cwd=os.path.join(work, 'bin'),
+                           stdout=log, stderr=log) != 0:
+            raise RuntimeError('%s seed %d: run failed (see %s)' % (name, seed, log.name))
+    finally:
+        log.close()
+    values = observables(read_summary(os.path.join(work, 'bin', 'summary.txt')))
+    trajectories = {}
+    for s in series:
+        text = open(os.path.join(work, 'bin', '%s.txt' % s)).read()
+        trajectories[s] = {'sha1': hashlib.sha1(text.encode('utf-8')).hexdigest(),
+                           'lines': text.splitlines()}
+    shutil.rmtree(work)
+    return seed, values, trajectories
+
+def run_config(name, workers):
+    """ アンサンブルを並列に実行してから、黄金軌道の種を１つずつ実行して時間を測る """
+    config = CONFIGS[name]
+    seeds = list(config['seeds'])
+    jobs = [(name, seed, config['params'], []) for seed in seeds]
+    if workers > 1 and jobs:
+        pool = multiprocessing.Pool(workers)
+        results = pool.map(run, jobs)
+        pool.close()
+    else:
+        results = [run(job) for job in jobs]
+    ensemble = [values for seed, values, t in results]
+
+    timed = config['golden'] if config['golden'] is not None else seeds[0]
+    series = config['series'] if config['golden'] is not None else []
+    golden = {}
+    times = []
+    for n in range(TIMING_RUNS):
+        seed, values, trajectories = run((name, timed, config['params'], series))
+        if n == 0: golden = trajectories
+        times.append(values['wall_time'])
+    return ensemble, golden, median(times)
+
+# ---------------------------------------------------------------- 検定
+
+def median(values):
+    s = sorted(values)
+    n = len(s)
+    if n == 0: return float('nan')
+    return s[n//2] if n % 2 else 0.5*(s[n//2 - 1] + s[n//2])
+
+def ks_test(a, b):
+    """ ２標本KS検定。(D, p値) を返す """
+    a, b = sorted(a), sorted(b)
+    n, m = len(a), len(b)
+    i = j = 0
+    d = 0.0
+    while i < n and j < m:
+        x = min(a[i], b[j])
+        while i < n and a[i] <= x: i += 1
+        while j < m and b[j] <= x: j += 1
+        d = max(d, abs(float(i)/n - float(j)/m))
+    ne = float(n*m)/(n + m)
+    lam = (math.sqrt(ne) + 0.12 + 0.11/math.sqrt(ne))*d
+    return d, kolmogorov_q(lam)
+
+def kolmogorov_q(lam):
+    """ コルモゴロフ分布の上側確率 """
+    if lam < 1e-3: return 1.0
+    total = 0.0
+    for k in range(1, 101):
+        term = 2*(-1)**(k-1)*math.exp(-2*k*k*lam*lam)
+        total += term
+        if abs(term) < 1e-10: break
+    return max(0.0, min(1.0, total))
+
+def chi2_test(a, b):
+    """ ２標本の分類の度数を比べるカイ二乗検定。(統計量, p値) を返す """
+    categories = sorted(set(a) | set(b))
+    if len(categories) < 2: return 0.0, 1.0
+    n, m = float(len(a)), float(len(b))
+    x2 = 0.0
+    for c in categories:
+        oa, ob = a.count(c), b.count(c)
+        total = oa + ob
+        ea, eb = total*n/(n + m), total*m/(n + m)
+        x2 += (oa - ea)**2/ea + (ob - eb)**2/eb
+    return x2, gamma_q(0.5*(len(categories) - 1), 0.5*x2)
+
+def gamma_q(a, x):
+    """ 正則化不完全ガンマ関数 Q(a, x)（カイ二乗分布の上側確率） """
+    if x <= 0: return 1.0
+    gln = math.lgamma(a)
+    if x < a + 1:
+        # 級数展開
+        term = total = 1.0/a
+        ap = a
+        for n in range(1000):
+            ap += 1
+            term *= x/ap
+            total += term
+            if abs(term) < abs(total)*1e-12: break
+        return 1.0 - total*math.exp(-x + a*math.log(x) - gln)
+    # 連分数展開
+    b = x + 1 - a
+    c = 1e300
+    d = 1.0/b
+    h = d
+    for i in range(1, 1000):
+        an = -i*(i - a)
+        b += 2
+        d = an*d + b
+        if abs(d) < 1e-300: d = 1e-300
+        c = b + an/c
+        if abs(c) < 1e-300: c = 1e-300
+        d = 1.0/d
+        delta = d*c
+        h *= delta
+        if abs(delta - 1) < 1e-12: break
+    return math.exp(-x + a*math.log(x) - gln)*h
+
+# ---------------------------------------------------------------- 記録と検査
+
+def reference_fname(name):
+    return os.path.join(REGRESS_DIR, '%s.json' % name)
+
+def record(name, workers):
+    ensemble, golden, wall_time = run_config(name, workers)
+    reference = {
+        'ensemble': dict([(key, [values[key] for values in ensemble])
+                          for key in CONTINUOUS + CATEGORICAL]),
+        'golden': golden,
+        'wall_time': wall_time,
+        'budget': wall_time*BUDGET_FACTOR,
+    }
+    if not os.path.exists(REGRESS_DIR): os.makedirs(REGRESS_DIR)
+    f = open(reference_fname(name), 'w')
+    json.dump(reference, f, indent=1, sort_keys=True)
+    f.close()
+    print('==> %s: recorded %d runs, wall time %.3f s' % (name, len(ensemble), wall_time))
+
+def first_difference(expected, actual):
+    for k in range(max(len(expected), len(actual))):
+        e = expected[k] if k < len(expected) else '<end>'
+        a = actual[k] if k < len(actual) else '<end>'
+        if e != a: return '%s != %s' % (a, e)
+    return ''
+
+def check(name, workers):
+    """ 参照と比べて、失敗した項目の数を返す """
+    if not os.path.exists(reference_fname(name)):
+        print('==> %s: no reference (run: python regress.py record %s)' % (name, name))
+        return 1
+    reference = json.load(open(reference_fname(name)))
+    against = CONFIGS[name].get('against', name)
+    if not os.path.exists(reference_fname(against)):
+        print('==> %s: no reference (run: python regress.py record %s)' % (name, against))
+        return 1
+    expected_ensemble = json.load(open(reference_fname(against)))['ensemble']
+    ensemble, golden, wall_time = run_config(name, workers)
+    failures = 0
+
+    tests = len(CONTINUOUS) + len(CATEGORICAL) if ensemble else 0
+    for key in CONTINUOUS + CATEGORICAL:
+        if not ensemble: break
+        actual = [values[key] for values in ensemble]
+        expected = expected_ensemble[key]
+        if key in CONTINUOUS:
+            statistic, p = ks_test(actual, expected)
+            kind = 'KS D'
+        else:
+            statistic, p = chi2_test(actual, expected)
+            kind = 'chi2'
+        ok = p >= ALPHA/tests
+        failures += 0 if ok else 1
+        print('%s %s: %s=%.4g p=%.4g' % ('ok  ' if ok else 'FAIL', key, kind, statistic, p))
+
+    for s, expected in sorted(reference['golden'].items()):
+        actual = golden.get(s)
+        ok = actual is not None and actual['sha1'] == expected['sha1']
+        failures += 0 if ok else 1
+        detail = '' if ok else ' (%s)' % first_difference(expected['lines'],
+                                                           actual['lines'] if actual else [])
+        print('%s golden %s%s' % ('ok  ' if ok else 'FAIL', s, detail))
+
+    ok = wall_time <= reference['budget']
+    failures += 0 if ok else 1
+    print('%s wall time %.3f s (reference %.3f s, budget %.3f s)'
+          % ('ok  ' if ok else 'FAIL', wall_time, reference['wall_time'], reference['budget']))
+    print('==> %s: %s' % (name, 'passed' if failures == 0 else '%d failed' % failures))
+    return failures
+
+def usage():
+    print('usage: regress.py record [CONFIG ...] [-n WORKERS]')
+    print('       regress.py check [CONFIG ...] [-n WORKERS]')
+    print('       regress.py list')
+    sys.exit(1)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2: usage()
+    command, args = sys.argv[1], sys.argv[2:]
+    workers = 1
+    if '-n' in args:
+        workers = int(args[args.index('-n') + 1])
+        del args[args.index('-n'):args.index('-n') + 2]
+    names = args or sorted(CONFIGS)
+    for name in names:
+        if name not in CONFIGS:
+            print('unknown config: %s' % name)
+            usage()
+    if command == 'record':
+        for name in names: record(name, workers)
+    elif command == 'check':
+        failures = sum([check(name, workers) for name in names])
+        sys.exit(1 if failures else 0)
+    elif command == 'list':
+        for name in sorted(CONFIGS):
+            config = CONFIGS[name]
+            print('%s: %s, %d seeds, golden %s' % (name, ' '.join(['%s=%s' % (p, v)
+                  for p, v in config['params']]), len(list(config['seeds'])), config['golden']))
+    else:
+        usage()
@@ -0,0 +1,74 @@
+#! /usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# 系統の記録（LINEAGE_TRACKING）を読む。
+#
+#   lineage.bin     計算終了時に生きている系統樹
+#   clone-size.bin  LINEAGE_INTERVAL ごとのクローンの大きさ
+#
+# 使い方:
+#   python script/lineage.py tree bin/lineage.bin
+#   python script/lineage.py sizes bin/clone-size.bin [クローン番号 ...]
+
+import struct
+import sys
+
+def read_tree(fname):
+    """ ノードを (id, parent, born_step, size, births, gene) の配列で返す """
+    data = open(fname, 'rb').read()
+    if data[:4] != b'LNG1': raise ValueError('not a lineage file: %s' % fname)
+    gene_length, count = struct.unpack_from('<iI', data, 4)
+    gene_bytes = (gene_length + 7)//8
+    offset = 12
+    nodes = []
+    for n in range(count):
+        node_id, parent, born_step, size, births = struct.unpack_from('<IIiii', data, offset)
+        offset += 20
+        packed = bytearray(data[offset:offset + gene_bytes])
+        offset += gene_bytes
+        gene = ''.join(['1' if packed[k//8] >> (k%8) & 1 else '0' for k in range(gene_length)])
+        if parent == 0xffffffff: parent = None
+        nodes.append((node_id, parent, born_step, size, births, gene))
+    return nodes
+
+def read_sizes(fname):
+    """ (step, {id: size}) の配列を返す """
+    data = open(fname, 'rb').read()
+    offset = 0
+    series = []
+    while offset < len(data):
+        step, count = struct.unpack_from('<iI', data, offset)
+        offset += 8
+        values = struct.unpack_from('<%di' % (2*count), data, offset)
+        offset += 8*count
+        series.append((step, dict(zip(values[0::2], values[1::2]))))
+    return series
+
+def show_tree(fname):
+    nodes = read_tree(fname)
+    children = {}
+    for node in nodes: children.setdefault(node[1], []).append(node)
+    def show(node, depth):
+        node_id, parent, born_step, size, births, gene = node
+        print('%s%d %s born=%d size=%d births=%d' % ('  '*depth, node_id, gene, born_step, size, births))
+        for child in children.get(node_id, []): show(child, depth + 1)
+    for root in children.get(None, []): show(root, 0)
+
+def show_sizes(fname, ids):
+    series = read_sizes(fname)
+    if not ids:
+        for step, sizes in series:
+            print('%d %d %d' % (step, len(sizes), sum(sizes.values())))
+        return
+    for step, sizes in series:
+        print('%d %s' % (step, ' '.join([str(sizes.get(i, 0)) for i in ids])))
+
+if __name__ == '__main__':
+    if len(sys.argv) >= 3 and sys.argv[1] == 'tree':
+        show_tree(sys.argv[2])
+    elif len(sys.argv) >= 3 and sys.argv[1] == 'sizes':
+        show_sizes(sys.argv[2], [int(i) for i in sys.argv[3:]])
+    else:
+        print('usage: lineage.py tree LINEAGE_BIN')
+        print('       lineage.py sizes CLONE_SIZE_BIN [ID ...]')
+        sys.exit(1)
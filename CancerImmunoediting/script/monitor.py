@@ -0,0 +1,139 @@
+#! /usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# 実行中のシミュレーションのテレメトリを表示する。
+#
+# シミュレーションが共有メモリ（/dev/shm/cancer-immunoediting-<pid>）に
+# 書き込むリングバッファを読むだけなので、いつでも接続・切断できる。
+#
+# 使い方:
+#   python script/monitor.py          # 実行中の一覧
+#   python script/monitor.py <pid>    # 指定した実行を追跡する
+#   python script/monitor.py <pid> -m # マップも表示する
+
+import glob
+import mmap
+import os
+import struct
+import sys
+import time
+
+SHM_DIR = '/dev/shm'
+SHM_PREFIX = 'cancer-immunoediting-'
+
+MAGIC = 0x544d4943
+HEADER_FORMAT = '<8IQii'
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+RECORD_HEAD_FORMAT = '<Q8i4d'
+RECORD_HEAD_SIZE = struct.calcsize(RECORD_HEAD_FORMAT)
+
+# 停滞とみなす秒数
+STALL_SECONDS = 30
+
+class Run:
+    """ 共有メモリ上の１つの実行 """
+    def __init__(self, path):
+        self.path = path
+        f = open(path, 'rb')
+        self.memory = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        f.close()
+        header = self.header()
+        if header['magic'] != MAGIC:
+            raise ValueError('not ready: %s' % path)
+        self.map_size = header['map_width'] * header['map_height']
+
+    def header(self):
+        values = struct.unpack_from(HEADER_FORMAT, self.memory, 0)
+        keys = ('magic', 'version', 'slot_size', 'record_size',
+                'map_width', 'map_height', 'pid', 'max_step',
+                'published', 'finished')
+        return dict(zip(keys, values[:10]))
+
+    def record(self, n):
+        """ n番目のレコードを読む。上書き中なら None """
+        header = self.header()
+        offset = HEADER_SIZE + (n % header['slot_size']) * header['record_size']
+        for retry in range(10):
+            before = struct.unpack_from('<Q', self.memory, offset)[0]
+            values = struct.unpack_from(RECORD_HEAD_FORMAT, self.memory, offset)
+            maps = self.memory[offset + RECORD_HEAD_SIZE:
+                               offset + RECORD_HEAD_SIZE + 3 * self.map_size]
+            after = struct.unpack_from('<Q', self.memory, offset)[0]
+            if before == after and before == 2 * n + 2:
+                keys = ('sequence', 'step', 'normal', 'cancer', 'hidden',
+                        'standard', 'tcell', 'killed', 'mutation',
+                        'genevalue_ave', 'energy_ave', 'normal_energy_ave',
+                        'cancer_energy_ave')
+                record = dict(zip(keys, values))
+                m = self.map_size
+                record['maps'] = (bytearray(maps[0:m]), bytearray(maps[m:2*m]),
+                                  bytearray(maps[2*m:3*m]))
+                return record
+        return None
+
+    def latest(self):
+        published = self.header()['published']
+        if published == 0: return None
+        return self.record(published - 1)
+
+def runs():
+    return sorted(glob.glob(os.path.join(SHM_DIR, SHM_PREFIX + '*')))
+
+def status_line(record, max_step):
+    return 'step %6d/%d  normal %6d  cancer %6d (hidden %6d)  tcell %5d  killed %4d  gene %.3f' % (
+        record['step'], max_step, record['normal'], record['cancer'],
+        record['hidden'], record['tcell'], record['killed'],
+        record['genevalue_ave'])
+
+def print_map(record, width):
+    """ がん細胞(#)・正常細胞(o)・T細胞(.)の縮小マップ """
+    normal, cancer, tcell = record['maps']
+    for i in range(len(cancer) // width):
+        line = ''
+        for j in range(width):
+            k = i * width + j
+            if cancer[k] > 0: line += '#'
+            elif normal[k] > 0: line += 'o'
+            elif tcell[k] > 0: line += '.'
+            else: line += ' '
+        print('|' + line + '|')
+
+def list_runs():
+    for path in runs():
+        try:
+            run = Run(path)
+        except (ValueError, IOError, OSError):
+            continue
+        record = run.latest()
+        if record is None: continue
+        print('%6d  %s' % (run.header()['pid'], status_line(record, run.header()['max_step'])))
+
+def follow(pid, show_map):
+    run = Run(os.path.join(SHM_DIR, SHM_PREFIX + str(pid)))
+    header = run.header()
+    last_step = -1
+    last_change = time.time()
+    while True:
+        header = run.header()
+        record = run.latest()
+        if record is not None and record['step'] != last_step:
+            last_step = record['step']
+            last_change = time.time()
+            print(status_line(record, header['max_step']))
+            if show_map: print_map(record, header['map_width'])
+        if header['finished']:
+            print('==> finished')
+            return
+        if time.time() - last_change > STALL_SECONDS:
+            print('==> STALLED: no progress for %d s' % STALL_SECONDS)
+            last_change = time.time()
+        time.sleep(0.5)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        list_runs()
+    else:
+        try:
+            follow(int(sys.argv[1]), '-m' in sys.argv)
+        except KeyboardInterrupt:
+            pass
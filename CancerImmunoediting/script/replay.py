@@ -0,0 +1,247 @@
+#! /usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# イベントログ（EVENT_LOG）を読んで、集団を再構成する。
+#
+#   events.bin  ヘッダのあとに、16 バイトの固定長レコードが並ぶ
+#               [type:u8][aux:u8][step_delta:u16][id_delta:i32][other:i32][x:i16][y:i16]
+#
+# ステップとIDは直前のレコードとの差。ステップ０と EVENT_CHECKPOINT_INTERVAL ごとに、
+# 全ての細胞とT細胞の状態をチェックポイントとして記録している。
+# 指定したステップの直前のチェックポイントから、各ステップの移動を
+# カウンタ方式の乱数列（RandomStream）で計算し直して、イベントを適用する。
+# エネルギーは記録していないので、再構成するのは位置と遺伝子とT細胞の年齢。
+# 走化性（CHEMOTAXIS）で偏らせた移動は計算し直せないので、T細胞の位置は合わない。
+# 殺傷に時間がかかる場合（CTL_KILLING_RATE > 0）、殺傷中のT細胞は移動せず、
+# 寿命を過ぎても殺傷を終えるまで残る。殺傷の始まりと終わりも記録している。
+#
+# 使い方:
+#   python script/replay.py count bin/events.bin
+#   python script/replay.py state bin/events.bin 1500
+#   python script/replay.py kills bin/events.bin [FROM TO]
+
+import struct
+import sys
+
+CHECKPOINT, CELL, TCELL, DIVISION, MUTATION, DEATH, KILL, TCELL_BORN, TCELL_CLONE, STEP, \
+    ENGAGE, RELEASE = range(1, 13)
+NAMES = {CHECKPOINT: 'checkpoint', CELL: 'cell', TCELL: 'tcell', DIVISION: 'division',
+         MUTATION: 'mutation', DEATH: 'death', KILL: 'kill', TCELL_BORN: 'tcell-born',
+         TCELL_CLONE: 'tcell-clone', STEP: 'step', ENGAGE: 'engage', RELEASE: 'release'}
+HEADER = struct.Struct('<4s8i')
+RECORD = struct.Struct('<BBHiihh')
+CHUNK = 65536
+
+MASK = 0xffffffffffffffff
+GOLDEN = 0x9e3779b97f4a7c15
+MOVE = 1
+
+def mix(z):
+    """ splitmix64 の撹拌関数（RandomStream::mix） """
+    z = (z + GOLDEN) & MASK
+    z = ((z ^ (z >> 30))*0xbf58476d1ce4e5b9) & MASK
+    z = ((z ^ (z >> 27))*0x94d049bb133111eb) & MASK
+    return z ^ (z >> 31)
+
+class EventLog:
+    def __init__(self, fname):
+        self.f = open(fname, 'rb')
+        magic, size, seed, width, height, boundary, gene_length, lifespan, interval = \
+            HEADER.unpack(self.f.read(HEADER.size))
+        if magic != b'EVL1' or size != RECORD.size:
+            raise ValueError('not an event log: %s' % fname)
+        self.seed = seed & 0xffffffff
+        self.width, self.height, self.periodic = width, height, boundary == 1
+        self.gene_length, self.lifespan, self.interval = gene_length, lifespan, interval
+
+    def records(self):
+        """ (type, aux, step, id, other, x, y) を順に返す。差は絶対値に戻す """
+        step, last_id = 0, 0
+        while True:
+            data = self.f.read(RECORD.size*CHUNK)
+            if not data: return
+            for k in range(len(data)//RECORD.size):
+                kind, aux, step_delta, id_delta, other, x, y = RECORD.unpack_from(data, k*RECORD.size)
+                if kind == STEP:
+                    step = other
+                    continue
+                step += step_delta
+                last_id += id_delta
+                yield kind, aux, step, last_id, other, x, y
+
+    def gene(self, bits):
+        return ''.join(['1' if bits >> k & 1 else '0' for k in range(self.gene_length)])
+
+    def walk(self, agents, step, resting=()):
+        """ RandomWalkKernel と同じ規則で、ステップ step の移動をさせる。resting のIDは動かない """
+        key = mix(mix(self.seed) ^ step)
+        w, h = self.width, self.height
+        for agent_id, agent in agents.items():
+            if agent_id in resting: continue
+            bits = mix((mix(key ^ (agent_id & MASK)) ^ MOVE) + GOLDEN) & 0xf
+            dx = (bits & 1)*(1 - 2*(bits >> 1 & 1))
+            dy = (bits >> 2 & 1)*(1 - 2*(bits >> 3 & 1))
+            x, y = agent[0] + dx, agent[1] + dy
+            if self.periodic:
+                agent[0], agent[1] = x % w, y % h
+            elif 0 <= x < w and 0 <= y < h:
+                agent[0], agent[1] = x, y
+
+class Population:
+    """ 細胞 {id: [x, y, gene]} と T細胞 {id: [x, y, gene, born_step]} """
+
+    def __init__(self, log, walking):
+        self.log = log
+        self.walking = walking  # 位置を追うかどうか
+        self.cells, self.tcells = {}, {}
+        self.born = {}          # 誕生ステップごとのT細胞のID
+        self.engaged = set()    # 殺傷中のT細胞のID
+        self.retired = {}       # このステップに殺傷を終えて除いたT細胞（クローンの遺伝子に使う）
+        self.step = None        # 再構成しているステップ
+        self.finished = False   # ステップの終わりの処理をしたかどうか
+        self.mismatches = 0     # 記録した位置と、計算し直した位置が違った回数
+
+    def add_tcell(self, tcell_id, x, y, gene, born):
+        self.tcells[tcell_id] = [x, y, gene, born]
+        self.born.setdefault(born, []).append(tcell_id)
+
+    def finish(self):
+        """ ステップの終わりに、寿命を迎えたT細胞を除く """
+        if self.finished: return
+        # 殺傷中のT細胞は、殺傷を終えたときに除くか戻すかが記録されている。
+        for tcell_id in self.born.pop(self.step - self.log.lifespan, []):
+            if tcell_id not in self.engaged: self.tcells.pop(tcell_id, None)
+        self.retired = {}
+        self.finished = True
+
+    def advance(self, step):
+        while self.step < step:
+            self.finish()
+            self.step += 1
+            self.finished = False
+            if self.walking:
+                self.log.walk(self.cells, self.step)
+                self.log.walk(self.tcells, self.step, self.engaged)
+
+    def check(self, agent, x, y):
+        if self.walking and (agent[0], agent[1]) != (x, y): self.mismatches += 1
+
+    def apply(self, kind, aux, step, agent_id, other, x, y):
+        """ レコードを適用する。除去したがん細胞とT細胞を返す """
+        if step > self.step: self.advance(step)
+        if kind == DIVISION:
+            parent = self.cells[agent_id + other]
+            self.check(parent, x, y)
+            self.cells[agent_id] = [x, y, parent[2]]
+        elif kind == MUTATION:
+            cell = self.cells[agent_id]
+            cell[2] = cell[2][:aux] + '1' + cell[2][aux+1:]
+        elif kind == DEATH:
+            self.check(self.cells.pop(agent_id), x, y)
+        elif kind == KILL:
+            cell, tcell = self.cells.pop(agent_id), self.tcells[agent_id + other]
+            # 殺傷中にも細胞は動くので、記録した位置はT細胞の位置になる。
+            if agent_id + other not in self.engaged: self.check(cell, x, y)
+            self.check(tcell, x, y)
+            return cell, agent_id + other, tcell
+        elif kind == TCELL_BORN:
+            self.add_tcell(agent_id, x, y, self.log.gene(other), step)
+        elif kind == TCELL_CLONE:
+            killer = self.tcells.get(agent_id + other) or self.retired[agent_id + other]
+            self.add_tcell(agent_id, x, y, killer[2], step)
+        elif kind == ENGAGE:
+            self.check(self.tcells[agent_id], x, y)
+            self.engaged.add(agent_id)
+        elif kind == RELEASE:
+            # aux が 1 なら、疲弊したか寿命を過ぎたので除く。
+            self.engaged.discard(agent_id)
+            if aux == 1: self.retired[agent_id] = self.tcells.pop(agent_id)
+        return None
+
+    def load(self, step, records):
+        """ チェックポイントから状態を読み込む """
+        self.cells, self.tcells, self.born = {}, {}, {}
+        self.engaged, self.retired = set(), {}
+        for kind, aux, s, agent_id, other, x, y in records:
+            if kind == CELL:
+                self.cells[agent_id] = [x, y, self.log.gene(other)]
+            elif kind == ENGAGE:
+                self.engaged.add(agent_id)  # 直前の TCELL が殺傷中
+            else:
+                self.add_tcell(agent_id, x, y, self.log.gene(other), step - aux)
+        self.step = step
+        self.finished = True
+
+def replay(log, until, walking, on_kill=None):
+    """ ステップ until（None なら最後）まで再構成する。until より前のチェックポイントまでは読み飛ばす """
+    start = until//log.interval*log.interval if walking else 0
+    population = Population(log, walking)
+    records = log.records()
+    last = None
+    for record in records:
+        kind, aux, step, agent_id, other, x, y = record
+        if until is not None and step > until: break
+        last = step
+        if kind == CHECKPOINT:
+            snapshot = [next(records) for n in range(other)]
+            if step <= start: population.load(step, snapshot)
+            continue
+        # チェックポイントより前のイベントは、チェックポイントに含まれている。
+        if step <= start: continue
+        killed = population.apply(kind, aux, step, agent_id, other, x, y)
+        if killed and on_kill: on_kill(step, agent_id, killed[0], killed[1], killed[2], x, y)
+    if until is None: until = last
+    if population.step is None or last < until:
+        raise ValueError('the log does not reach step %d' % until)
+    population.advance(until)
+    population.finish()
+    return population
+
+def count(fname):
+    log = EventLog(fname)
+    counts, last = {}, 0
+    for kind, aux, step, agent_id, other, x, y in log.records():
+        counts[kind] = counts.get(kind, 0) + 1
+        last = step
+    print('# steps %d, %d records' % (last, sum(counts.values())))
+    for kind in sorted(counts):
+        print('%s %d' % (NAMES[kind], counts[kind]))
+
+def state(fname, until):
+    log = EventLog(fname)
+    population = replay(log, until, True)
+    cancer = len([1 for cell in population.cells.values() if '1' in cell[2]])
+    print('# step %d cells %d (normal %d, cancer %d) tcells %d'
+          % (population.step, len(population.cells), len(population.cells) - cancer, cancer,
+             len(population.tcells)))
+    for cell_id in sorted(population.cells):
+        x, y, gene = population.cells[cell_id]
+        print('cell %d %d %d %s' % (cell_id, x, y, gene))
+    for tcell_id in sorted(population.tcells):
+        x, y, gene, born = population.tcells[tcell_id]
+        print('tcell %d %d %d %s %d' % (tcell_id, x, y, gene, population.step - born))
+    if population.mismatches > 0:
+        sys.stderr.write('==> %d positions differ from the log\n' % population.mismatches)
+
+def kills(fname, first, last):
+    """ どの遺伝子のT細胞が、どのがん細胞を、どこで除去したか """
+    log = EventLog(fname)
+    print('# step x y cell_id cell_gene tcell_id tcell_gene')
+    def on_kill(step, cell_id, cell, tcell_id, tcell, x, y):
+        if step >= first:
+            print('%d %d %d %d %s %d %s' % (step, x, y, cell_id, cell[2], tcell_id, tcell[2]))
+    replay(log, last, False, on_kill)
+
+if __name__ == '__main__':
+    if len(sys.argv) == 3 and sys.argv[1] == 'count':
+        count(sys.argv[2])
+    elif len(sys.argv) == 4 and sys.argv[1] == 'state':
+        state(sys.argv[2], int(sys.argv[3]))
+    elif len(sys.argv) in (3, 5) and sys.argv[1] == 'kills':
+        first, last = (int(sys.argv[3]), int(sys.argv[4])) if len(sys.argv) == 5 else (0, None)
+        kills(sys.argv[2], first, last)
+    else:
+        print('usage: replay.py count EVENTS_BIN')
+        print('       replay.py state EVENTS_BIN STEP')
+        print('       replay.py kills EVENTS_BIN [FROM TO]')
+        sys.exit(1)
@@ -9,6 +9,10 @@ import datetime
 ANIM_MAX_STEP = 100
 MAX_STEP = 0
 
+# 格子の次元と奥行き（立体では、中央の層のマップを描く）
+DIMENSION = 2
+DEPTH = 1
+
 SOURCE_FNAME = '../src/main.cpp'
 
 # 設定パラメータを表す文字列
@@ -33,6 +37,8 @@ for line in source_file:
             paramline = '%s = %s' % (line[2], line[4][:-1])
         print paramline
         if line[2] == 'MAX_STEP': MAX_STEP = line[4][:-1]
+        if line[2] == 'DIMENSION': DIMENSION = int(line[4][:-1])
+        if line[2] == 'DEPTH': DEPTH = int(line[4][:-1])
         config_line.append(paramline)
 
 ###############################################################################
@@ -47,6 +53,12 @@ auto_plot_line = []
 # -----------------------------------------------
 auto_plot_line += 'set terminal png size 800,150;'
 
+def map_splot():
+    """ マップを描く splot の文字列を返す。立体では層の番号の列を飛ばす """
+    if DIMENSION == 3:
+        return 'splot file(n) index %d using 2:3:4 w pm3d;' % (DEPTH//2)
+    return 'splot file(n) w pm3d;'
+
 def graph_lines(fname, xlabel, ylabel):
     """ グラフ用の文字列を返す """
     lines = []
@@ -167,7 +179,7 @@ def animation( title, anim_title ):
     frame_plot_line += 'set view map;'
     frame_plot_line += 'set cbrange[0:10];'
     frame_plot_line += 'set xlabel "%s";' % anim_title
-    frame_plot_line += 'splot file(n) w pm3d;'
+    frame_plot_line += map_splot()
     frame_plot_line += 'if(n<%d) n=n+1; reread;' % ANIM_MAX_STEP
     # -----------------------------------------------
     for line in frame_plot_line:
@@ -197,7 +209,7 @@ def animation( title, anim_title ):
     frame_plot_line += 'set view map;'
     frame_plot_line += 'set cbrange[0:10];'
     frame_plot_line += 'set xlabel "LAST %s";' % anim_title
-    frame_plot_line += 'splot file(n) w pm3d;'
+    frame_plot_line += map_splot()
     frame_plot_line += 'if(n<%d) n=n+1; reread;' % int(MAX_STEP)
     # -----------------------------------------------
     for line in frame_plot_line:
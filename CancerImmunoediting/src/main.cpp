@@ -23,7 +23,20 @@
 #include <fstream>
 #include <vector>
 #include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <random>
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include <cassert>
+#include <ctime>
 
 // ===========================================================================
 /*
@@ -101,6 +114,15 @@ typedef double PROBABILITY;
 const int WIDTH  = 30; //: 幅
 const int HEIGHT = 30; //: 高さ
 
+// 格子の次元を設定する。（2: 平面, 3: 立体）
+// 立体では、幅×高さの層を奥行きの数だけ重ねる。平面では奥行きは使わない。
+const int DIMENSION = 2; //: 格子の次元
+const int DEPTH = 16; //: 奥行き
+const int LAYERS = DIMENSION == 3 ? DEPTH : 1;  // 層の数
+
+// 境界条件を設定する。（0: 壁, 1: 周期境界）
+const int BOUNDARY_CONDITION = 0; //: 境界条件
+
 /* グルコース, 酸素の再生量 /1step */
 const MATERIAL GLUCOSE_GENERATE = 1; //: グルコース再生量
 const MATERIAL OXYGEN_GENERATE = 1; //: 酸素再生量
@@ -110,11 +132,41 @@ const MATERIAL MAX_OXYGEN = 20; //: 最大酸素量
 // 最大計算期間を設定する。
 const int MAX_STEP = 15000; //: 最大ステップ数
 
+// 停止条件を設定する。（false, 0なら使わない）
+// 定常状態は、直近の窓と１つ前の窓で、正常細胞数とがん細胞数の平均の差が
+// 許容幅（平均に対する割合）に収まったときとする。
+const bool STOP_ON_EXTINCTION = false; //: 全細胞消滅で停止
+const bool STOP_ON_CANCER_EXTINCTION = false; //: がん細胞消滅で停止
+const int STOP_CELL_SIZE_CAP = 0; //: 停止する細胞数の上限
+const int STEADY_STATE_WINDOW = 0; //: 定常判定の窓幅
+const double STEADY_STATE_TOLERANCE = 0.01; //: 定常判定の許容幅
+
+// 乱数の種を設定する。（0なら時刻から決める）
+const int RANDOM_SEED = 0; //: 乱数の種
+
 // 細胞数を設定する。
 const int CELL_SIZE = 100; //: 初期総細胞数
 const int TCELL_SIZE = 3000; //: T初期総細胞数
 const int TCELL_LIFESPAN = 10; //: T細胞の寿命
 
+// T細胞の走化性を設定する。
+// がん細胞がケモカインを分泌し、ケモカインは格子上で拡散して減衰する。
+// T細胞は、ケモカインの勾配の向きに偏って移動する。（動く確率は変わらない）
+// 勾配 g の向きに動く確率は 1/2 + CHEMOTAXIS_BIAS/2 * g/(|g| + CHEMOTAXIS_SATURATION)。
+const bool CHEMOTAXIS = false; //: T細胞の走化性
+const double CHEMOKINE_SECRETION = 1.0; //: がん細胞１つあたりの分泌量 /1step
+const double CHEMOKINE_DIFFUSION = 0.5; //: 拡散の割合 /1step
+const double CHEMOKINE_DECAY = 0.1; //: 減衰率 /1step
+const double CHEMOKINE_CUTOFF = 0.001; //: ０とみなす濃度
+const double CHEMOTAXIS_BIAS = 0.8; //: 勾配の向きへの偏りの強さ
+const double CHEMOTAXIS_SATURATION = 0.5; //: 偏りが半分になる勾配
+
+// T細胞の殺傷を設定する。（0 なら、認識したステップで即座に除去する）
+// 正なら、認識したT細胞はその場に止まり、１ステップあたり CTL_KILLING_RATE の確率で殺傷を終える。
+// 殺傷を CTL_MAX_KILLS 回終えたT細胞は疲弊して除かれる。（集約表現では即座に除去する）
+const double CTL_KILLING_RATE = 0; //: 殺傷の速さ μ /1step
+const int CTL_MAX_KILLS = 5; //: 疲弊するまでの殺傷数
+
 // 使用量
 const MATERIAL NORMALCELL_METABOLIZE_GLUCOSE = 1; //: 正常細胞代謝時グルコース使用量
 const MATERIAL NORMALCELL_METABOLIZE_OXYGEN = 1; //: 正常細胞代謝時酸素使用量
@@ -135,6 +187,7 @@ const ENERGY CELL_DIVISION_THRESHOLD_ENERGY = 10; //: 細胞分裂エネルギ
 const int MAX_CELL_DIVISION_COUNT = 10; //: 通常細胞の最大分裂回数
 
 const PROBABILITY CELL_MUTATION_RATE = 5; //: 細胞突然変異確率
+const int MUTATION_START_STEP = 1000; //: 突然変異の開始ステップ
 
 const int CELL_GENE_LENGTH = 8; //: 遺伝子の長さ
 
@@ -146,6 +199,60 @@ const PROBABILITY CANCERCELL_DIVISION_PROB = 60; //: がん細胞分裂確率
 // const PROBABILITY MOTILITY_PROB
 const double MOTILITY_WEIGHT = 1; //: 移動にかかるコストの重み
 
+// 逐次更新した統計を、毎ステップ全数で検算するかどうか。
+const bool STATISTICS_VERIFICATION = false; //: 統計の全数検算
+
+// 実行中の統計を共有メモリに公開するかどうか。
+const bool TELEMETRY = false; //: テレメトリ出力
+const int TELEMETRY_INTERVAL = 1; //: テレメトリ間隔
+
+// マップの出力方法を設定する。
+const bool MAP_TEXT_OUTPUT = true; //: マップのテキスト出力
+const bool NATIVE_RENDER = true; //: アニメーションの直接出力
+const int ANIMATION_FRAME_SIZE = 100; //: アニメーションのフレーム数
+// 一辺が SNAPSHOT_SIZE を超える格子は、マップとアニメーションを縮小する。
+// 縮小した位置には、元の位置の平均を入れる。
+const int SNAPSHOT_SIZE = 200; //: マップの出力の一辺の上限
+const int SNAPSHOT_SHRINK = ( ( WIDTH > HEIGHT ? WIDTH : HEIGHT ) + SNAPSHOT_SIZE - 1 )/SNAPSHOT_SIZE;  // 縮小率
+const int SNAPSHOT_WIDTH = ( WIDTH + SNAPSHOT_SHRINK - 1 )/SNAPSHOT_SHRINK;    // 縮小した幅
+const int SNAPSHOT_HEIGHT = ( HEIGHT + SNAPSHOT_SHRINK - 1 )/SNAPSHOT_SHRINK;  // 縮小した高さ
+
+const int THREAD_SIZE = 4; //: スレッド数
+
+// 細胞集団の表現を設定する。
+// （0: 細胞ごとのエージェント, 1: (位置, 遺伝子, エネルギー, 分裂回数) ごとの細胞数）
+const int POPULATION_MODE = 0; //: 細胞集団の表現
+
+// 系統を記録するかどうか。（エージェント表現のみ）クローンの大きさは指定した間隔で書き出す。
+const bool LINEAGE_TRACKING = false; //: 系統の記録
+const int LINEAGE_INTERVAL = 100; //: クローンの大きさの出力間隔
+
+// 個々のイベント（分裂、突然変異、死亡、排除、T細胞の増殖）を events.bin に記録する。
+// （エージェント表現の平面のみ。遺伝子の長さは 32 まで）
+// 全エージェントの位置と遺伝子を、指定した間隔でチェックポイントとして書き出す。
+// （CHEMOTAXIS のときはT細胞の位置を再構成できない）
+const bool EVENT_LOG = false; //: イベントの記録
+const int EVENT_CHECKPOINT_INTERVAL = 500; //: チェックポイントの間隔
+
+// 疎な格子のタイルの幅を設定する。
+const int TILE_SIZE = 16; //: タイルの幅
+
+// 細胞とT細胞の配列を、空間充填曲線の順に並べ直す。
+// 間隔ごと、または隣り合う細胞の順の乱れの割合が閾値を超えたときに並べ直す。（0 なら使わない）
+// （0: Morton順, 1: Hilbert順）
+const int REORDER_INTERVAL = 0; //: 空間順に並べ直す間隔
+const double REORDER_DISORDER = 0.3; //: 並べ直す順の乱れの閾値
+const int SPACE_FILLING_CURVE = 0; //: 空間充填曲線
+
+// 実行ごとのメモリの予算を設定する。（0 なら制限しない）
+// 使用量が予算の MEMORY_SOFT_LIMIT 倍を超えたら、対応を始める。
+// （0: 何もしない, 1: 集約表現に切り替える, 2: マップの出力を間引く）
+// 集約表現に切り替えたステップは summary.txt の coarsened_step に残る。
+// 次のステップで予算を超える見込みになったら、"escaped" として停止する。
+const int MEMORY_BUDGET = 4096; //: メモリの予算（MB）
+const int MEMORY_POLICY = 0; //: 予算に近づいたときの対応
+const double MEMORY_SOFT_LIMIT = 0.8; //: 対応を始める予算の割合
+
 /*
  * クラスを定義していく。
  */
@@ -177,9 +284,45 @@ class Random {
     }
     bool randomBool() { return probability(50) ? true : false; }
     int randomSign() { return probability(50) ? -1 : 1; }
+    unsigned int seed() const { return seed_; }
   private:
-    Random() { srand((unsigned)time(NULL)); }
+    Random() {
+      seed_ = RANDOM_SEED != 0 ? (unsigned)RANDOM_SEED : (unsigned)time(NULL);
+      srand( seed_ );
+    }
     ~Random() { }
+    unsigned int seed_;  // 乱数の種
+};
+
+/**
+ * @brief カウンタ方式の乱数列
+ *
+ * (乱数の種, ステップ, エージェントID, 処理の種類) だけで決まる乱数列。
+ * 状態を共有しないので、どのスレッドがどの順で計算しても同じ値になる。
+ */
+class RandomStream {
+  public:
+    // 処理の種類
+    enum Phase { MOVE = 1, DIVISION, MUTATION, METABOLISM, IMMUNE };
+
+    RandomStream( int step, long long id, int phase ) : counter_(0) {
+      key_ = mix( mix( mix( Random::Instance().seed() ) ^ step ) ^ id ) ^ phase;
+    }
+    unsigned long long next() { return mix( key_ + 0x9e3779b97f4a7c15ULL*(++counter_) ); }
+    double randomDouble() { return ( (next()>>11) + 0.5 )/9007199254740992.0; }
+    int uniformInt( int min, int max ) { return (int)( next()%( max - min + 1 ) ) + min; }
+    bool probability( double prob ) { return prob > 100*randomDouble(); }
+
+  private:
+    // splitmix64 の撹拌関数
+    static unsigned long long mix( unsigned long long z ) {
+      z += 0x9e3779b97f4a7c15ULL;
+      z = ( z ^ ( z>>30 ) )*0xbf58476d1ce4e5b9ULL;
+      z = ( z ^ ( z>>27 ) )*0x94d049bb133111ebULL;
+      return z ^ ( z>>31 );
+    }
+    unsigned long long key_;
+    unsigned long long counter_;
 };
 
 /**
@@ -189,20 +332,181 @@ class Random {
  */
 class __Landscape {
   public:
-    __Landscape() : width_(WIDTH), height_(HEIGHT) { }
+    __Landscape() : width_(WIDTH), height_(HEIGHT), depth_(LAYERS) { }
     ~__Landscape() { }
 
     int width() const;  // 幅を返す
     int height() const; // 高さを返す
+    int depth() const;  // 奥行き（層の数）を返す
 
     // ランドスケープ上に存在する点かどうかを評価する。
-    bool isExistingPoint( int x, int y );
+    bool isExistingPoint( int x, int y, int z = 0 );
   private:
-    int width_, height_;
+    int width_, height_, depth_;
 };
 
 int __Landscape::width() const { return width_; }
 int __Landscape::height() const { return height_; }
+int __Landscape::depth() const { return depth_; }
+
+/**
+ * @brief 疎なタイル格子
+ *
+ * 格子を TILE_SIZE×TILE_SIZE のタイルに分けて、使っているタイルだけを確保する。
+ * 立体では TILE_SIZE×TILE_SIZE×TILE_DEPTH のブロックにして、
+ * 上下の層の隣もなるべく同じブロックに入るようにする。
+ * タイルは最初に書き込むときに確保し、持ち主が空と判断したら解放する。
+ * 確保していない位置は、すべて背景値を持つものとする。
+ * メモリと走査の手間は、確保したタイルの数に比例する。
+ */
+template < typename T >
+class TiledGrid {
+  public:
+    static const int TILE_DEPTH = DIMENSION != 3 ? 1
+      : LAYERS < TILE_SIZE ? LAYERS : TILE_SIZE;                     // タイルの奥行き
+    static const int TILE_X = ( WIDTH + TILE_SIZE - 1 )/TILE_SIZE;   // 横のタイル数
+    static const int TILE_Y = ( HEIGHT + TILE_SIZE - 1 )/TILE_SIZE;  // 縦のタイル数
+    static const int TILE_Z = ( LAYERS + TILE_DEPTH - 1 )/TILE_DEPTH;  // 奥行きのタイル数
+    static const int TILE_SITE_SIZE = TILE_SIZE*TILE_SIZE*TILE_DEPTH;  // タイル内の位置数
+
+    TiledGrid( const T& background = T() )
+      : directory_( TILE_X*TILE_Y*TILE_Z, (T *)NULL ), slot_( TILE_X*TILE_Y*TILE_Z, -1 ),
+        background_( background ) { }
+    ~TiledGrid() { EACH( it_tile, active_ ) { delete[] directory_[*it_tile]; } }
+
+    /** 位置からタイル番号を返す（平面では z は常に 0） */
+    static int tileOf( int x, int y, int z = 0 ) {
+      return ( ( z/TILE_DEPTH )*TILE_Y + y/TILE_SIZE )*TILE_X + x/TILE_SIZE;
+    }
+    /** タイル内の位置番号を返す */
+    static int siteOf( int x, int y, int z = 0 ) {
+      return ( ( z%TILE_DEPTH )*TILE_SIZE + y%TILE_SIZE )*TILE_SIZE + x%TILE_SIZE;
+    }
+    /** タイルの左上（手前）の座標を返す */
+    static int originX( int tile ) { return ( tile%TILE_X )*TILE_SIZE; }
+    static int originY( int tile ) { return ( tile/TILE_X%TILE_Y )*TILE_SIZE; }
+    static int originZ( int tile ) { return tile/( TILE_X*TILE_Y )*TILE_DEPTH; }
+
+    /** 値を返す。確保していなければ背景値を返す */
+    const T& at( int x, int y, int z = 0 ) const {
+      const T *tile = directory_[ tileOf( x, y, z ) ];
+      return tile != NULL ? tile[ siteOf( x, y, z ) ] : background_;
+    }
+
+    /** 書き込み用に値を返す。タイルがなければ確保する */
+    T& ref( int x, int y, int z = 0 ) { return allocate( tileOf( x, y, z ) )[ siteOf( x, y, z ) ]; }
+
+    /** タイルを確保して返す。確保済みならそのまま返す */
+    T *allocate( int tile ) {
+      if( directory_[tile] == NULL ) {
+        directory_[tile] = new T[TILE_SITE_SIZE];
+        FOR( k, TILE_SITE_SIZE ) { directory_[tile][k] = background_; }
+        slot_[tile] = active_.size();
+        active_.push_back( tile );
+      }
+      return directory_[tile];
+    }
+
+    /** タイルを解放する */
+    void release( int tile ) {
+      if( directory_[tile] == NULL ) return;
+      delete[] directory_[tile];
+      directory_[tile] = NULL;
+      // 最後のタイルを空いた場所に移す。
+      int last = active_.back();
+      active_[ slot_[tile] ] = last;
+      slot_[last] = slot_[tile];
+      active_.pop_back();
+      slot_[tile] = -1;
+    }
+
+    /** タイルの中身を返す。確保していなければ NULL を返す */
+    T *tile( int tile ) { return directory_[tile]; }
+    const T *tile( int tile ) const { return directory_[tile]; }
+
+    /** 確保しているタイル番号の配列を返す */
+    const VECTOR(int)& activeTiles() const { return active_; }
+
+    const T& background() const { return background_; }
+    void setBackground( const T& background ) { background_ = background; }
+
+    /** タイルとして確保しているバイト数を返す */
+    size_t allocatedBytes() const { return active_.size()*TILE_SITE_SIZE*sizeof(T); }
+
+  private:
+    VECTOR(T *) directory_;  // タイルの目録
+    VECTOR(int) slot_;       // 目録から active_ への添字
+    VECTOR(int) active_;     // 確保しているタイル番号
+    T background_;           // 確保していない位置の値
+};
+
+/** 縮小した位置（SNAPSHOT_WIDTH*SNAPSHOT_HEIGHT の添字）にまとめた、元の位置の数を返す */
+inline int snapshot_area( int f ) {
+  int fx = f%SNAPSHOT_WIDTH, fy = f/SNAPSHOT_WIDTH%SNAPSHOT_HEIGHT;
+  return std::min( SNAPSHOT_SHRINK, WIDTH - fx*SNAPSHOT_SHRINK )
+    * std::min( SNAPSHOT_SHRINK, HEIGHT - fy*SNAPSHOT_SHRINK );
+}
+
+/**
+ * タイル格子を SNAPSHOT_WIDTH×SNAPSHOT_HEIGHT に縮小して、縮小した位置ごとの平均を values に入れる。
+ * 確保しているタイルだけを読み、確保していない位置は背景値として数える。
+ * layered なら層ごとに縮小し、そうでなければ層を重ねた和を縮小する。
+ */
+template < typename T >
+void shrink_tiled_map( const TiledGrid<T>& grid, VECTOR(double)& values, bool layered ) {
+  const int size = SNAPSHOT_WIDTH*SNAPSHOT_HEIGHT;
+  VECTOR(int) covered( size*( layered ? LAYERS : 1 ), 0 );  // タイルから読んだ位置の数
+  values.assign( covered.size(), 0 );
+  EACH( it_tile, grid.activeTiles() ) {
+    const T *tile = grid.tile( *it_tile );
+    int x0 = TiledGrid<T>::originX( *it_tile );
+    int y0 = TiledGrid<T>::originY( *it_tile );
+    int z0 = TiledGrid<T>::originZ( *it_tile );
+    for( int z = z0; z < std::min( z0 + TiledGrid<T>::TILE_DEPTH, LAYERS ); z++ ) {
+      for( int y = y0; y < std::min( y0 + TILE_SIZE, HEIGHT ); y++ ) {
+        const T *row = tile + TiledGrid<T>::siteOf( x0, y, z );
+        int f = ( ( layered ? z : 0 )*SNAPSHOT_HEIGHT + y/SNAPSHOT_SHRINK )*SNAPSHOT_WIDTH;
+        for( int x = x0; x < std::min( x0 + TILE_SIZE, WIDTH ); x++ ) {
+          values[ f + x/SNAPSHOT_SHRINK ] += row[ x - x0 ];
+          covered[ f + x/SNAPSHOT_SHRINK ]++;
+        }
+      }
+    }
+  }
+  FOR( f, (int)values.size() ) {
+    int area = snapshot_area( f );
+    int sites = layered ? area : area*LAYERS;
+    values[f] = ( values[f] + (double)grid.background()*( sites - covered[f] ) )/area;
+  }
+}
+
+/**
+ * タイル格子の値を、縮小した位置ごとに１行ずつ書き出す。行と列は元の格子の座標にする。
+ * gnuplot の splot で読めるように、行の間に空行を入れる。
+ * 立体では行の先頭に層の番号を付けて、層の間に空行を２つ入れる（gnuplot の index）。
+ */
+template < typename T >
+void output_tiled_map( const char *file_name, const TiledGrid<T>& grid ) {
+  VECTOR(double) values;
+  shrink_tiled_map( grid, values, true );
+  std::ofstream ofs( file_name );
+  const double *value = &values[0];
+  FOR( k, LAYERS ) {
+    FOR( i, SNAPSHOT_HEIGHT ) {
+      FOR( j, SNAPSHOT_WIDTH ) {
+        if( DIMENSION == 3 ) ofs << k << SEPARATOR;
+        ofs << i*SNAPSHOT_SHRINK << SEPARATOR;
+        ofs << j*SNAPSHOT_SHRINK << SEPARATOR;
+        // 縮小しないときは元の型で書く（整数を浮動小数点数として書くと遅い）。
+        if( SNAPSHOT_SHRINK == 1 ) ofs << (T)*value++;
+        else ofs << *value++;
+        ofs << std::endl;
+      }
+      ofs << std::endl;
+    }
+    if( DIMENSION == 3 ) ofs << std::endl;
+  }
+}
 
 /**
  * @brief シュガースケープのインターフェイス
@@ -212,7 +516,7 @@ int __Landscape::height() const { return height_; }
 class __SugarScape : public __Landscape {
   public:
     virtual void generate() = 0;  // シュガーを再生する
-    virtual MATERIAL material(int x, int y) const = 0;  // シュガーの量を返す
+    virtual MATERIAL material(int x, int y, int z = 0) const = 0;  // シュガーの量を返す
   private:
 };
 
@@ -224,11 +528,14 @@ class GlucoseScape : public __SugarScape {
     GlucoseScape();
 
     virtual void generate();              // 再生する
-    MATERIAL glucose(int x, int y) const; // グルコースの量を返す
-    virtual MATERIAL material(int x, int y) const;  // グルコースの量を返す
-    void setGlucose(int x, int y, MATERIAL value);  // グルコースの量を設定する
+    MATERIAL glucose(int x, int y, int z = 0) const; // グルコースの量を返す
+    virtual MATERIAL material(int x, int y, int z = 0) const;  // グルコースの量を返す
+    void setGlucose(int x, int y, int z, MATERIAL value);  // グルコースの量を設定する
+    void prepare(int x, int y, int z = 0) { glucose_map_.ref(x, y, z); }  // 書き込む位置のタイルを確保する
+    size_t allocatedBytes() const { return glucose_map_.allocatedBytes(); }
+    const TiledGrid<MATERIAL>& map() const { return glucose_map_; }  // マップを返す（出力用）
   private:
-    MATERIAL glucose_map_[HEIGHT][WIDTH];  // グルコースマップ配列
+    TiledGrid<MATERIAL> glucose_map_;  // グルコースマップ
 };
 /**
  * @brief 酸素のクラスを作成する。
@@ -237,12 +544,15 @@ class OxygenScape : public __SugarScape {
   public:
     OxygenScape();
 
-    MATERIAL oxygen(int x, int y) const;  // 酸素の量を返す
-    virtual MATERIAL material(int x, int y) const;  // 酸素の量を返す
-    void setOxygen(int x, int y, MATERIAL value);   // 酸素の量を設定する
+    MATERIAL oxygen(int x, int y, int z = 0) const;  // 酸素の量を返す
+    virtual MATERIAL material(int x, int y, int z = 0) const;  // 酸素の量を返す
+    void setOxygen(int x, int y, int z, MATERIAL value);   // 酸素の量を設定する
     virtual void generate();                        // 再生する
+    void prepare(int x, int y, int z = 0) { oxygen_map_.ref(x, y, z); }  // 書き込む位置のタイルを確保する
+    size_t allocatedBytes() const { return oxygen_map_.allocatedBytes(); }
+    const TiledGrid<MATERIAL>& map() const { return oxygen_map_; }  // マップを返す（出力用）
   private:
-    MATERIAL oxygen_map_[HEIGHT][WIDTH];  // 酸素マップ配列
+    TiledGrid<MATERIAL> oxygen_map_;  // 酸素マップ
 };
 
 /**
@@ -253,23 +563,27 @@ class OxygenScape : public __SugarScape {
  */
 class __Location {
   public:
-    __Location() { }
+    __Location() : z_(0) { }
     ~__Location() { }
 
     int x() const { return x_; }
     int y() const { return y_; }
+    // 平面では定数の 0 を返すので、z を使う計算はコンパイル時に消える。
+    int z() const { return DIMENSION == 3 ? z_ : 0; }
     void setX(int x) { x_ = x; }
     void setY(int y) { y_ = y; }
-    void setLocation(int x, int y) { setX(x); setY(y); }
+    void setZ(int z) { if( DIMENSION == 3 ) z_ = z; }
+    void setLocation(int x, int y, int z = 0) { setX(x); setY(y); setZ(z); }
 
     // スケープ上にランダムに配置する。
     void randomSetLocation() {
       setX(Random::Instance().uniformInt(0, WIDTH-1));
       setY(Random::Instance().uniformInt(0, HEIGHT-1));
+      if( DIMENSION == 3 ) setZ(Random::Instance().uniformInt(0, DEPTH-1));
     }
 
   private:
-    int x_, y_;
+    int x_, y_, z_;
 };
 
 /**
@@ -277,9 +591,15 @@ class __Location {
  */
 class __Mobile : public __Location {
   public:
-    __Mobile() { }
+    __Mobile() : id_(-1) { }
     virtual ~__Mobile() { }
 
+    /** エージェントIDを返す。乱数列の鍵になる */
+    long long id() const { return id_; }
+
+    /** 新しいIDを振る。並列処理の外で、決まった順に呼ぶ */
+    void assignId() { static long long next_id = 0; id_ = next_id++; }
+
     /**
      * 移動する。
      *
@@ -294,12 +614,456 @@ class __Mobile : public __Location {
 
   private:
     int movement_distance_;  // 移動距離変数
+    long long id_;           // エージェントID
 };
 
 class __CellState;
 class NormalCellState;
 class CancerCellState;
 
+class Cell;
+class Tcell;
+class TcellRing;
+class TcellMap;
+class GlucoseScape;
+class OxygenScape;
+class ThreadPool;
+
+typedef TiledGrid<unsigned short> DirectionTable;  // 方向表（下位8ビットが +x に、上位8ビットが +y に動く確率 /256）
+typedef TiledGrid<unsigned char> DepthTable;       // 奥行きの方向表（+z に動く確率 /256）
+
+/**
+ * @brief ケモカインのクラス
+ *
+ * がん細胞の位置を湧き出しとして、拡散と減衰のステンシルで毎ステップ更新する。
+ * 値のある範囲の矩形（立体では直方体）だけを更新するので、がん細胞がいなければ手間はかからない。
+ * 更新のたびに、位置ごとに動く向きの確率を表にしておく。
+ * T細胞の移動は表を１回引くだけで済むので、偏りのない移動と同じ程度の手間になる。
+ * 立体では、層ごとに分けてスレッドで分担する。
+ *
+ * 濃度も方向表もタイル格子に置いて、更新する範囲のタイルだけを確保する。
+ * 濃度が０に戻ったタイルと、偏りのなくなった方向表のタイルは解放する。
+ */
+class ChemokineScape : public __Landscape {
+  public:
+    ChemokineScape();
+
+    void addSource( int x, int y, int z, double amount );  // 湧き出しを加える
+    void secrete( VECTOR(Cell *)& cells );          // がん細胞が分泌する
+    void update( ThreadPool& pool );                // 拡散・減衰させて、方向表を作り直す
+
+    double chemokine( int x, int y, int z = 0 ) const { return field_.at( x, y, z ); }  // 濃度を返す
+    const TiledGrid<float>& field() const { return field_; }  // 濃度のマップを返す（出力用）
+
+    /** 方向表を返す。偏りのない位置は、背景値（+x, +y とも 128/256）になる */
+    const DirectionTable *directionTable() const { return &table_; }
+
+    /** 奥行きの方向表を返す。平面では NULL */
+    const DepthTable *depthTable() const { return DIMENSION == 3 ? &depth_table_ : NULL; }
+
+    size_t allocatedBytes() const {
+      return field_.allocatedBytes() + next_.allocatedBytes() + table_.allocatedBytes()
+        + depth_table_.allocatedBytes() + zeros_.capacity()*sizeof(float) + layer_box_.capacity()*sizeof(int);
+    }
+
+  private:
+    struct SlabTask;
+    typedef TiledGrid<float> Field;
+
+    /** 位置 (x, y, z) から、タイルの行の終わりまでの濃度を返す。タイルがなければ０の行を返す */
+    const float *row( const Field& field, int x, int y, int z ) const;
+
+    /** [x0, x1]×[y0, y1]×[z0, z1] のタイルを確保する。スレッドで書き込む前に呼ぶ */
+    template <class T>
+    static void allocate( TiledGrid<T>& grid, int x0, int x1, int y0, int y1, int z0, int z1 );
+
+    /** 全ての位置が背景値に戻ったタイルを解放する */
+    template <class T>
+    static void releaseBackground( TiledGrid<T>& grid );
+
+    /** 境界条件に従って、隣の位置の濃度を返す（壁では自分の濃度） */
+    float neighbor( int x, int y, int z, int dx, int dy, int dz ) const;
+
+    /** 位置 (x, y, z) のステンシルを境界条件に従って計算する */
+    float stencil( int x, int y, int z, float keep, float spread ) const;
+
+    /** 層 z の [x0, x1]×[y0, y1] を拡散・減衰させる */
+    void diffuse( int x0, int x1, int y0, int y1, int z );
+
+    /** 層 z の [x0, x1]×[y0, y1] を書き戻して、層の中で値のある範囲を layer_box_ に入れる */
+    void store( int x0, int x1, int y0, int y1, int z );
+
+    /** 層 z の [x0, x1]×[y0, y1] の方向表を作り直す */
+    void rebuildTable( int x0, int x1, int y0, int y1, int z );
+
+    Field field_, next_;            // 濃度（next_ は拡散の書き込み先）
+    DirectionTable table_;          // 方向表
+    DepthTable depth_table_;        // 奥行きの方向表（立体のみ）
+    VECTOR(float) zeros_;           // タイルのない行の代わりに読む０の行
+    VECTOR(int) layer_box_;         // 層ごとの値のある範囲 { x0, x1, y0, y1 }
+    int x0_, x1_, y0_, y1_, z0_, z1_;  // 値のある範囲（空なら x0_ > x1_）
+    int tx0_, tx1_, ty0_, ty1_, tz0_, tz1_;  // 方向表が偏っている範囲
+};
+
+/**
+ * @brief 並列処理する仕事のインターフェイス
+ */
+class ParallelTask {
+  public:
+    virtual ~ParallelTask() { }
+
+    /**
+     * [begin, end) の範囲を処理する。
+     *
+     * @param thread スレッド番号（0 〜 THREAD_SIZE-1）
+     */
+    virtual void run( int begin, int end, int thread ) = 0;
+};
+
+/**
+ * @brief スレッドプール
+ *
+ * THREAD_SIZE 個のスレッドを使い回して、範囲を等分して処理させる。
+ * 呼び出したスレッドも0番として働く。
+ */
+class ThreadPool {
+  public:
+    ThreadPool();
+    ~ThreadPool();
+
+    /**
+     * [0, n) を分担して処理する。全て終わるまで戻らない
+     *
+     * @param grain n がこれより小さければ分担しない（１つあたりの仕事が大きければ小さくする）
+     */
+    void run( ParallelTask& task, int n, int grain = 256 );
+
+    /** 現在のスレッド番号を返す */
+    static int threadId();
+
+  private:
+    struct Worker { ThreadPool *pool; int id; };
+    static void *work( void *arg );
+
+    pthread_t threads_[THREAD_SIZE];
+    Worker workers_[THREAD_SIZE];
+    pthread_mutex_t mutex_;
+    pthread_cond_t start_, done_;
+    ParallelTask *task_;
+    int size_;        // 処理する範囲
+    int generation_;  // 仕事の通し番号
+    int running_;     // 処理中のスレッド数
+    bool quit_;
+};
+
+/**
+ * @brief 遺伝子操作のカーネル
+ *
+ * 遺伝子の長さをテンプレート引数にして、ループを展開させる。
+ * LENGTH が 0 のときは、実行時の長さを使う汎用版になる。
+ */
+template < int LENGTH >
+struct GeneKernel {
+  /** '1' の数を返す */
+  static int value( const char *gene, int length ) {
+    const int n = LENGTH > 0 ? LENGTH : length;
+    int ret = 0;
+    FOR( i, n ) { ret += ( gene[i] == '1' ); }
+    return ret;
+  }
+  /** 同一の配列かどうかを返す */
+  static bool match( const char *a, const char *b, int length ) {
+    return memcmp( a, b, LENGTH > 0 ? LENGTH : length ) == 0;
+  }
+  /** 遺伝子の値から免疫原性を返す（Cell::immunogenicity と同じ） */
+  static double immunogenicity( int value, int length ) {
+    const int n = LENGTH > 0 ? LENGTH : length;
+    if( value == n ) return 10;  // 隠れがん細胞
+    return 100*value/n;
+  }
+};
+
+/**
+ * @brief 格子上の移動のカーネル
+ *
+ * 格子の幅と高さ、境界条件をテンプレート引数にする。
+ * 幅と高さが 0 のときは、実行時の大きさを使う汎用版になる。
+ * 周期境界で大きさが２のべき乗なら、折り返しはビットマスクになる。
+ */
+template < int W, int H, bool PERIODIC >
+struct WalkKernel {
+  static void walk( int *xs, int *ys, const long long *ids, int *distances,
+      int begin, int end, int step, int w, int h ) {
+    const int width = W > 0 ? W : w;
+    const int height = H > 0 ? H : h;
+    const bool pow2 = W > 0 && H > 0 && ( W&(W-1) ) == 0 && ( H&(H-1) ) == 0;
+
+    for( int i = begin; i < end; i++ ) {
+      unsigned int bits = RandomStream( step, ids[i], RandomStream::MOVE ).next();
+      // bit0: x方向に動くか, bit1: x方向の符号
+      // bit2: y方向に動くか, bit3: y方向の符号
+      int mx = bits&1; int sx = (bits>>1)&1;
+      int my = (bits>>2)&1; int sy = (bits>>3)&1;
+
+      int dx = mx*(1 - 2*sx);
+      int dy = my*(1 - 2*sy);
+      int to_x = xs[i] + dx;
+      int to_y = ys[i] + dy;
+      if( PERIODIC ) {
+        if( pow2 ) {
+          to_x &= width - 1;
+          to_y &= height - 1;
+        } else {
+          to_x += width & -(to_x < 0);
+          to_x -= width & -(to_x >= width);
+          to_y += height & -(to_y < 0);
+          to_y -= height & -(to_y >= height);
+        }
+        xs[i] = to_x; ys[i] = to_y;
+        distances[i] = mx + my;
+      } else {
+        // 壁の外に出る場合は移動しない。
+        int inside = ((unsigned)to_x < (unsigned)width) & ((unsigned)to_y < (unsigned)height);
+        xs[i] += inside*dx;
+        ys[i] += inside*dy;
+        distances[i] = inside*(mx + my);
+      }
+    }
+  }
+
+  /**
+   * 立体の座標配列を移動させる。
+   * x, y方向は walk と同じビットを使い、z方向は bit4, bit5 で決める。
+   */
+  static void walkSpace( int *xs, int *ys, int *zs, const long long *ids, int *distances,
+      int begin, int end, int step, int w, int h, int d ) {
+    const int width = W > 0 ? W : w;
+    const int height = H > 0 ? H : h;
+    for( int i = begin; i < end; i++ ) {
+      unsigned int bits = RandomStream( step, ids[i], RandomStream::MOVE ).next();
+      // bit0-3: 平面と同じ
+      // bit4: z方向に動くか, bit5: z方向の符号
+      int mx = bits&1; int sx = (bits>>1)&1;
+      int my = (bits>>2)&1; int sy = (bits>>3)&1;
+      int mz = (bits>>4)&1; int sz = (bits>>5)&1;
+      int dx = mx*(1 - 2*sx);
+      int dy = my*(1 - 2*sy);
+      int dz = mz*(1 - 2*sz);
+      int to_x = xs[i] + dx;
+      int to_y = ys[i] + dy;
+      int to_z = zs[i] + dz;
+      if( PERIODIC ) {
+        to_x += width & -(to_x < 0);
+        to_x -= width & -(to_x >= width);
+        to_y += height & -(to_y < 0);
+        to_y -= height & -(to_y >= height);
+        to_z += d & -(to_z < 0);
+        to_z -= d & -(to_z >= d);
+        xs[i] = to_x; ys[i] = to_y; zs[i] = to_z;
+        distances[i] = mx + my + mz;
+      } else {
+        // 壁の外に出る場合は移動しない。
+        int inside = ((unsigned)to_x < (unsigned)width) & ((unsigned)to_y < (unsigned)height)
+          & ((unsigned)to_z < (unsigned)d);
+        xs[i] += inside*dx;
+        ys[i] += inside*dy;
+        zs[i] += inside*dz;
+        distances[i] = inside*(mx + my + mz);
+      }
+    }
+  }
+
+  /**
+   * 方向表に従って、向きの偏った移動をさせる。
+   * 各軸で動く確率は walk と同じで、向きだけを位置ごとの表で決める。
+   * 立体では zs と奥行きの方向表も使う（平面では NULL）。
+   */
+  static void walkBiased( int *xs, int *ys, int *zs, const long long *ids, int *distances,
+      int begin, int end, int step, int w, int h, int d,
+      const DirectionTable *directions, const DepthTable *depth_directions ) {
+    const int width = W > 0 ? W : w;
+    const int height = H > 0 ? H : h;
+    for( int i = begin; i < end; i++ ) {
+      unsigned int bits = RandomStream( step, ids[i], RandomStream::MOVE ).next();
+      // bit0: x方向に動くか, bit2: y方向に動くか, bit4: z方向に動くか（立体のみ）
+      // bit8-15, bit16-23, bit24-31: 方向表の確率と比べて向きを決める
+      int z = DIMENSION == 3 ? zs[i] : 0;
+      unsigned int dir = directions->at( xs[i], ys[i], z );
+      int mx = bits&1; int px = ( ( bits>>8 )&0xff ) < ( dir&0xff );
+      int my = (bits>>2)&1; int py = ( ( bits>>16 )&0xff ) < ( dir>>8 );
+      int dx = mx*(2*px - 1);
+      int dy = my*(2*py - 1);
+      int mz = 0, dz = 0;
+      if( DIMENSION == 3 ) {
+        int pz = ( bits>>24 ) < depth_directions->at( xs[i], ys[i], z );
+        mz = (bits>>4)&1;
+        dz = mz*(2*pz - 1);
+      }
+      int to_x = xs[i] + dx;
+      int to_y = ys[i] + dy;
+      if( PERIODIC ) {
+        to_x += width & -(to_x < 0);
+        to_x -= width & -(to_x >= width);
+        to_y += height & -(to_y < 0);
+        to_y -= height & -(to_y >= height);
+        xs[i] = to_x; ys[i] = to_y;
+        if( DIMENSION == 3 ) {
+          int to_z = zs[i] + dz;
+          to_z += d & -(to_z < 0);
+          to_z -= d & -(to_z >= d);
+          zs[i] = to_z;
+        }
+        distances[i] = mx + my + mz;
+      } else {
+        int inside = ((unsigned)to_x < (unsigned)width) & ((unsigned)to_y < (unsigned)height);
+        if( DIMENSION == 3 ) inside &= (unsigned)( zs[i] + dz ) < (unsigned)d;
+        xs[i] += inside*dx;
+        ys[i] += inside*dy;
+        if( DIMENSION == 3 ) zs[i] += inside*dz;
+        distances[i] = inside*(mx + my + mz);
+      }
+    }
+  }
+};
+
+/**
+ * @brief 特殊化したカーネルの表
+ *
+ * よく使う設定（遺伝子の長さ 8/16/32/64、２のべき乗の格子、
+ * 現在の WIDTH×HEIGHT）で実体化したカーネルを表にしておき、
+ * 実行時の設定に合うものを選ぶ。合うものがなければ汎用版を使う。
+ * 表に置くのはエージェントの範囲を回すループなので、選ぶのはループごとに１回で、
+ * ループの中の遺伝子操作や折り返しは展開されて定数に畳み込まれる。
+ * 個々の細胞の遺伝子操作（__Life）は、GeneKernel<CELL_GENE_LENGTH> を直接呼ぶ。
+ */
+class ModelKernels {
+  public:
+    static ModelKernels& Instance();
+
+    typedef void (*ImmuneFunc)( Cell **cells, Tcell **killers, TcellMap& tcellmap,
+        int begin, int end, int step, int gene_length );
+    typedef void (*WalkFunc)( int *xs, int *ys, const long long *ids, int *distances,
+        int begin, int end, int step, int w, int h );
+    typedef void (*WalkSpaceFunc)( int *xs, int *ys, int *zs, const long long *ids, int *distances,
+        int begin, int end, int step, int w, int h, int d );
+    typedef void (*WalkBiasedFunc)( int *xs, int *ys, int *zs, const long long *ids, int *distances,
+        int begin, int end, int step, int w, int h, int d,
+        const DirectionTable *directions, const DepthTable *depth_directions );
+
+    /** 設定に合うカーネルを選ぶ */
+    void select( int gene_length, int width, int height, int boundary );
+
+    ImmuneFunc immune;          // 免疫の認識の判定
+    WalkFunc walk;              // 平面の移動
+    WalkSpaceFunc walkSpace;    // 立体の移動
+    WalkBiasedFunc walkBiased;  // 走化性で偏らせた移動
+
+    const char *geneKernelName() const { return gene_name_; }
+    const char *walkKernelName() const { return walk_name_; }
+
+  private:
+    ModelKernels() { select( CELL_GENE_LENGTH, WIDTH, HEIGHT, BOUNDARY_CONDITION ); }
+
+    const char *gene_name_;
+    const char *walk_name_;
+};
+
+/**
+ * @brief 一括ランダムウォークのカーネル
+ *
+ * 集団の座標をまとめて配列に取り出して、一度に移動させる。
+ * 方向ビットはエージェントごとの乱数列から取り出すので、
+ * スレッドで分担しても結果は変わらない。
+ * 境界の判定は分岐なしで行う。
+ * 各軸の移動の分布は、__Mobile::move と同じ。
+ * 立体では z座標の配列も取り出して、z方向にも同じ分布で動かす。
+ * 細胞のエネルギーも配列に取り出して、移動のコストを charge でまとめて引く。
+ */
+class RandomWalkKernel {
+public:
+  RandomWalkKernel() { }
+  ~RandomWalkKernel() { }
+
+  /**
+   * 座標配列を移動させる。
+   *
+   * @param xs x座標配列
+   * @param ys y座標配列
+   * @param ids エージェントID配列
+   * @param distances 移動した距離（マンハッタン距離）を格納する配列
+   * @param begin, end 移動させる範囲
+   * @param landscape スケープ
+   */
+  static void walk( int *xs, int *ys, const long long *ids, int *distances,
+      int begin, int end, const __Landscape& landscape );
+
+  /**
+   * 立体の座標配列を移動させる。
+   * x, y方向は walk と同じビットを使い、z方向は bit4, bit5 で決める。
+   */
+  static void walkSpace( int *xs, int *ys, int *zs, const long long *ids, int *distances,
+      int begin, int end );
+
+  /** 細胞を移動させて、移動距離分のエネルギーを消費させる */
+  void moveCells( VECTOR(Cell *)& cells, const __Landscape& landscape, ThreadPool& pool );
+
+  /**
+   * 移動距離分のエネルギーを引く。
+   * 回数の決まった CHARGE_BLOCK 個ずつの内側のループは、-O2 でもベクトル化される。
+   * （-O2 の費用モデルは、回数が実行時に決まるループをベクトル化しない）
+   */
+  static void charge( ENERGY *energies, const int *distances, int begin, int end ) {
+    int i = begin;
+    for( ; i + CHARGE_BLOCK <= end; i += CHARGE_BLOCK ) {
+      for( int k = 0; k < CHARGE_BLOCK; k++ ) energies[i+k] -= distances[i+k]*MOTILITY_WEIGHT;
+    }
+    for( ; i < end; i++ ) energies[i] -= distances[i]*MOTILITY_WEIGHT;
+  }
+  static const int CHARGE_BLOCK = 8;
+
+  /**
+   * 方向表に従って、向きの偏った移動をさせる。
+   * 各軸で動く確率は walk と同じで、向きだけを位置ごとの表で決める。
+   * 立体では zs と奥行きの方向表も使う（平面では NULL）。
+   */
+  static void walkBiased( int *xs, int *ys, int *zs, const long long *ids, int *distances,
+      int begin, int end, const DirectionTable *directions, const DepthTable *depth_directions );
+
+  /** T細胞を移動させる。方向表があれば、走化性で偏らせる */
+  void moveTcells( TcellRing& tcells, const __Landscape& landscape, ThreadPool& pool,
+      const DirectionTable *directions = NULL, const DepthTable *depth_directions = NULL );
+
+  /** 作業用の配列の容量を確保する */
+  void reserve( size_t n ) {
+    xs_.reserve( n ); ys_.reserve( n ); distances_.reserve( n ); ids_.reserve( n ); energies_.reserve( n );
+    if( DIMENSION == 3 ) zs_.reserve( n );
+  }
+
+  /** 作業用の配列を解放する */
+  void release() {
+    VECTOR(int)().swap( xs_ ); VECTOR(int)().swap( ys_ ); VECTOR(int)().swap( zs_ );
+    VECTOR(int)().swap( distances_ ); VECTOR(long long)().swap( ids_ ); VECTOR(ENERGY)().swap( energies_ );
+  }
+
+  /** 確保しているバイト数を返す */
+  size_t allocatedBytes() const {
+    return ( xs_.capacity() + ys_.capacity() + zs_.capacity() + distances_.capacity() )*sizeof(int)
+      + ids_.capacity()*sizeof(long long) + energies_.capacity()*sizeof(ENERGY);
+  }
+
+  /** エージェント１つあたりの作業用のバイト数 */
+  static size_t bytesPerAgent() {
+    return ( DIMENSION == 3 ? 4 : 3 )*sizeof(int) + sizeof(long long) + sizeof(ENERGY);
+  }
+
+private:
+  void resize( int n );
+
+  VECTOR(int) xs_, ys_, zs_, distances_;  // 作業用の座標配列（zs_ は立体のみ）
+  VECTOR(long long) ids_;
+  VECTOR(ENERGY) energies_;  // 細胞のエネルギー（moveCells のみ）
+};
+
 
 /**
  * @brief 生命クラス
@@ -309,12 +1073,12 @@ class CancerCellState;
 class __Life {
 public:
   /** 遺伝子配列を返す */
-  GENE gene();
+  const GENE& gene() const { return gene_; }
 
   void setGene( GENE gene ) { gene_ = gene; }
 
   /** 遺伝子の値を返す */
-  int geneValue();
+  int geneValue() const { return GeneKernel<CELL_GENE_LENGTH>::value( gene_.data(), CELL_GENE_LENGTH ); }
 
   /** 遺伝子配列を初期化する */
   void initiateGene( int length );
@@ -326,10 +1090,12 @@ public:
   void flip( int pos );
 
   /** 突然変異する */
-  bool mutateGene( double prob );
+  bool mutateGene( double prob, RandomStream& random );
 
   /** 遺伝子が同一の配列かどうかを判定する */
-  bool match( __Life& life );
+  bool match( const __Life& life ) const {
+    return GeneKernel<CELL_GENE_LENGTH>::match( gene_.data(), life.gene_.data(), CELL_GENE_LENGTH );
+  }
 
 private:
   GENE gene_;  // 遺伝子文字列
@@ -347,12 +1113,12 @@ class Cell : public __Mobile, public __Life {
   virtual ~Cell() { }
 
   ENERGY energy() const { return energy_; }
-  void setEnergy( ENERGY energy ) { energy_ = energy; }
+  void setEnergy( ENERGY energy );
   void consumeEnergy( ENERGY consume ) { setEnergy( energy() - consume ); }
   void gainEnergy( ENERGY gather ) { setEnergy( energy() + gather ); }
 
   /** 代謝する */
-  void metabolize( GlucoseScape& gs, OxygenScape& os );
+  void metabolize( GlucoseScape& gs, OxygenScape& os, RandomStream& random );
 
   /** がん細胞かどうかを返す */
   // 遺伝子の評価値が１以上ならば、がん細胞
@@ -361,7 +1127,7 @@ class Cell : public __Mobile, public __Life {
 
   void incrementDivisionCount() { cell_division_count_++; }
   int divisionCount() { return cell_division_count_; }
-  bool willDvision();
+  bool willDvision( RandomStream& random );
 
   /** スケープ上を移動する */
   virtual double move( __Landscape& landscape );
@@ -382,9 +1148,219 @@ class Cell : public __Mobile, public __Life {
   double immunogenicity();
   bool isHiddenCancer();
 
+  /** 統計に登録されているかどうか */
+  bool isCounted() const { return counted_; }
+  void setCounted( bool counted ) { counted_ = counted; }
+
+  /** 属するクローン（系統樹のノード番号）を返す */
+  int lineage() const { return lineage_; }
+  void setLineage( int lineage ) { lineage_ = lineage; }
+
+  /** T細胞に殺傷されている最中かどうか */
+  bool isEngaged() const { return engaged_; }
+  void setEngaged( bool engaged ) { engaged_ = engaged; }
+
  private:
   ENERGY energy_;
   int cell_division_count_;
+  bool counted_;  // 統計に登録済みかどうか
+  int lineage_;   // 属するクローン
+  bool engaged_;  // 殺傷されている最中かどうか
+};
+
+/**
+ * @brief 系統樹のクラス
+ *
+ * 同じ遺伝子配列を受け継ぐ細胞の集まりをクローンとして、クローンの親子関係を記録する。
+ * 分裂で遺伝子配列が変わったら、親クローンの子として新しいクローンを作る。
+ * ノードは配列（アリーナ）に置き、生きた細胞も生きた子孫も持たなくなったクローンは
+ * その場で解放して、空いたノードを使い回す。
+ * そのため、メモリは総誕生数ではなく、生きている系統の数に比例する。
+ */
+class LineageTracker {
+  public:
+    static LineageTracker& Instance();
+
+    void founded( Cell& cell );  // 初期細胞が新しい系統を作る
+    void born( Cell& cell );     // 分裂した細胞が加わる（系統は親のものを設定しておく）
+    void died( Cell& cell );     // 細胞が除かれる
+
+    /** 生きているクローンの大きさを追記する */
+    void outputCloneSizes( const char *fname );
+
+    /** 生きている系統樹を書き出す */
+    void outputTree( const char *fname );
+
+    int nodeSize() const { return node_size_; }
+
+    /** 確保しているバイト数を返す */
+    size_t allocatedBytes() const {
+      return nodes_.capacity()*sizeof(Node) + free_.capacity()*sizeof(int);
+    }
+
+  private:
+    LineageTracker() : next_id_(0), node_size_(0) { }
+
+    struct Node {
+      unsigned int id;   // クローンの通し番号
+      int parent;        // 親ノード（根なら -1）
+      int born_step;     // 現れたステップ
+      int size;          // 生きている細胞数
+      int children;      // 生きている子ノード数
+      int births;        // 分裂で生まれた細胞数
+      GENE gene;         // 遺伝子配列
+    };
+
+    int allocate( int parent, const GENE& gene );
+    void release( int node );
+
+    VECTOR(Node) nodes_;  // ノードのアリーナ
+    VECTOR(int) free_;    // 空いているノード
+    unsigned int next_id_;
+    int node_size_;       // 使っているノード数
+};
+
+/**
+ * @brief イベントログのクラス
+ *
+ * 個々の細胞とT細胞に起きたイベントを、固定長のレコードとして追記する。
+ * ステップとIDは直前のレコードとの差で持つので、値が小さくまとまる。
+ * レコードはバッファに貯めて、いっぱいになったらまとめて書き出す。
+ * 初期状態と一定間隔のチェックポイントから、イベントを順に適用すれば、
+ * 任意のステップの集団を再構成できる（script/replay.py）。
+ * 位置はチェックポイントとイベントにしか記録しないので、その間の移動は
+ * カウンタ方式の乱数列から計算し直す。
+ */
+class EventLog {
+  public:
+    static EventLog& Instance();
+
+    static const int BUFFER_SIZE = 4096;  // バッファのレコード数
+
+    // レコードの種類
+    enum Type {
+      CHECKPOINT = 1,  // チェックポイントの始まり（other: 続くレコード数）
+      CELL,            // チェックポイントの細胞（other: 遺伝子）
+      TCELL,           // チェックポイントのT細胞（aux: 年齢, other: 遺伝子）
+      DIVISION,        // 分裂（id: 娘細胞, other: 母細胞のIDとの差）
+      MUTATION,        // 突然変異（id: 娘細胞, aux: 変わった位置）
+      DEATH,           // 死亡
+      KILL,            // 免疫による除去（id: がん細胞, other: T細胞のIDとの差）
+      TCELL_BORN,      // T細胞の補充（other: 遺伝子）
+      TCELL_CLONE,     // T細胞の増殖（id: 新しいT細胞, other: 除去したT細胞のIDとの差）
+      STEP,            // ステップの差が収まらないときの区切り（other: ステップ）
+      ENGAGE,          // 殺傷の始まり（other: 標的のIDとの差）。チェックポイントでは直前のT細胞が殺傷中
+      RELEASE          // 殺傷の終わり（aux: 除いたら１）
+    };
+
+    struct Record {
+      unsigned char type;
+      unsigned char aux;
+      unsigned short step_delta;  // 直前のレコードとのステップの差
+      int id_delta;               // 直前のレコードとのIDの差
+      int other;
+      short x, y;
+    };
+
+    bool open( const char *fname );
+    void close();
+
+    /** 全ての細胞とT細胞の状態を書き出す */
+    void checkpoint( VECTOR(Cell *)& cells, TcellRing& tcells );
+
+    void divided( long long parent_id, Cell& cell );
+    void mutated( Cell& cell, int locus );
+    void died( Cell& cell );
+    void killed( long long cell_id, Tcell& tcell );
+    void tcellBorn( Tcell& tcell );    // 補充したT細胞（IDを振ったあと）
+    void tcellCloned( Tcell& tcell );  // 増殖したT細胞（除去した順に呼ぶ）
+    void engaged( Tcell& tcell );      // 殺傷を始めたT細胞
+    void released( Tcell& tcell, bool removed );  // 殺傷を終えたT細胞（除くなら removed）
+
+    /** 確保しているバイト数を返す */
+    size_t allocatedBytes() const {
+      return buffer_.capacity()*sizeof(Record) + killers_.capacity()*sizeof(long long);
+    }
+
+  private:
+    EventLog() : last_step_(0), last_id_(0), next_killer_(0) { }
+    ~EventLog() { close(); }
+
+    void write( int type, int aux, long long id, long long other, int x, int y );
+    void flush();
+    static int packGene( const GENE& gene );
+
+    std::ofstream ofs_;
+    VECTOR(Record) buffer_;
+    int last_step_;
+    long long last_id_;
+    VECTOR(long long) killers_;  // 増殖を待っている、除去したT細胞のID
+    size_t next_killer_;
+};
+
+/**
+ * @brief 細胞集団の統計クラス
+ *
+ * 誕生、死亡、突然変異、排除、エネルギー変化のイベントごとに更新して、
+ * 毎ステップ全細胞を数え直さずに済むようにする。
+ * どこからでも同じ統計を更新するために、シングルトンパターンを利用する。
+ */
+class CellStatistics {
+  public:
+    static CellStatistics& Instance();
+
+    void born( Cell& cell );    // 細胞が加わる
+    void died( Cell& cell );    // 細胞が除かれる
+    void killed( Cell& cell );  // 免疫で除去される
+    void mutated( Cell& cell, GENE old_gene );        // 遺伝子が変わる
+    void energyChanged( Cell& cell, ENERGY from, ENERGY to );  // エネルギーが変わる
+
+    /** ステップごとのカウンタをリセットする */
+    void resetStepCounters() { killed_size_ = 0; }
+
+    /** 細胞数とエネルギーを０にする（集約表現で数え直すとき） */
+    void clear();
+    /** 同じ分類の細胞をまとめて加える */
+    void addCells( Cell& cell, int count ) { add( cell, count ); }
+    /** 免疫で除去された細胞数を加える */
+    void killedCells( int count ) { killed_size_ += count; }
+
+    int size() const { return normal_size_ + cancer_size_; }
+    int normalSize() const { return normal_size_; }
+    int cancerSize() const { return cancer_size_; }
+    int hiddenCancerSize() const { return hidden_cancer_size_; }
+    int standardCancerSize() const { return cancer_size_ - hidden_cancer_size_; }
+    int geneValueSum() const { return gene_value_sum_; }
+    int killedSize() const { return killed_size_; }
+    ENERGY energySum() const { return normalEnergySum() + cancerEnergySum(); }
+    ENERGY normalEnergySum() const { return energySum( NORMAL ); }
+    ENERGY cancerEnergySum() const { return energySum( CANCER ); }
+
+    /**
+     * 全細胞を数え直して検算する。
+     *
+     * ずれていれば警告を出して、数え直した値に合わせる。
+     * @return ずれがなければ真
+     */
+    bool verify( VECTOR(Cell *)& cells );
+
+  private:
+    enum { NORMAL, CANCER };
+
+    CellStatistics();
+    void add( Cell& cell, int sign );
+    ENERGY energySum( int kind ) const;
+
+    // エネルギーは固定小数点で足し合わせて、
+    // スレッドの分担や足す順序によらず同じ和になるようにする。
+    static long long quantize( ENERGY energy ) { return llround( energy*1048576.0 ); }
+
+    int normal_size_;
+    int cancer_size_;
+    int hidden_cancer_size_;
+    int gene_value_sum_;
+    int killed_size_;
+    long long energy_sum_[THREAD_SIZE][2];  // スレッドごとのエネルギーの和
 };
 
 bool Cell::isHiddenCancer() {
@@ -395,12 +1371,8 @@ bool Cell::isHiddenCancer() {
   else return false;
 }
 double Cell::immunogenicity() {
-  int ret = 0;
-  if( isHiddenCancer() ) return 10;
-  // return 100;
-  // return 50;
-  ret = 100*geneValue()/CELL_GENE_LENGTH;
-  return ret;
+  // 隠れがん細胞なら 10、それ以外は遺伝子の値に比例する。
+  return GeneKernel<CELL_GENE_LENGTH>::immunogenicity( geneValue(), CELL_GENE_LENGTH );
 }
 
 class Tcell : public __Mobile, public __Life {
@@ -408,70 +1380,775 @@ public:
   Tcell();
   virtual ~Tcell() { }
 
+  // 年齢は誕生ステップから暗黙的に求める。
   int age();
-  void setAge( int age ) { age_ = age; }
-  void aging();
+  void setAge( int age );
   void initAge();
+  int bornStep() const { return born_step_; }
+
+  /** 殺傷している標的のID（殺傷していなければ -1） */
+  long long target() const { return target_; }
+  bool isEngaged() const { return target_ >= 0; }
+  void engage( long long target ) { target_ = target; }
+  void release() { target_ = -1; }
+
+  /** 殺傷を終えた回数 */
+  int kills() const { return kills_; }
+  void addKill() { kills_++; }
+
+  /** バケットの中の位置（TcellMap::resistTcells で記録する） */
+  int slot() const { return slot_; }
+  void setSlot( int slot ) { slot_ = slot; }
 
   Tcell& clone() {
     Tcell *newtcell = new Tcell();  // 新しいT細胞を作成する。
     newtcell->setGene( gene() );    // 遺伝子を設定して、
     newtcell->setX(x());            // 座標を
     newtcell->setY(y());            // 同じ位置にして、
+    newtcell->setZ(z());
     return *newtcell;               // 返す。
   }
 
 private:
-  int age_;
+  int born_step_;     // 誕生ステップ
+  long long target_;  // 殺傷している標的
+  int kills_;         // 殺傷を終えた回数
+  int slot_;          // バケットの中の位置
 };
 
-Tcell::Tcell() {
-  age_ = 0;
-}
-int Tcell::age() { return age_; }
-void Tcell::aging() {
-  age_ += 1;
-}
-void Tcell::initAge() { age_ = 0; }
-
 /**
- * @brief 細胞のマップクラス
+ * @brief T細胞の寿命リング
+ *
+ * T細胞を誕生ステップごとのバケットに分けて、
+ * TCELL_LIFESPAN 個のバケットのリングで管理する。
+ * 老化は暗黙的になり、寿命を迎えたT細胞の除去は
+ * バケットを１つ空にするだけで済む。
+ *
+ * 殺傷中のT細胞はバケットから外して、殺傷を終えるステップごとの
+ * タイマーホイールに置く（CTL_KILLING_RATE）。バケットには自由なT細胞だけが残るので、
+ * 移動とマップへの登録は殺傷中のT細胞を数えずに済む。
  */
-class TcellMap {
+class TcellRing {
 public:
-  TcellMap() { }
-  ~TcellMap();
+  static const int WHEEL_SIZE = 64;  // タイマーホイールのスロット数
 
-  /** マップをリセットする */
-  void resetMap() {
-    FOR( i, HEIGHT ) {
-      FOR( j, WIDTH ) {
-        tcell_map_[i][j].clear();
-      }
-    }
-  }
+  TcellRing() : size_(0), engaged_size_(0) { }
+  ~TcellRing() { }
 
-  /** T細胞の位置を登録する */
-  void resistTcells( VECTOR(Tcell *) tcells ) {
-    resetMap();
-    EACH( it_tcell, tcells ) {
-      Tcell &tcell = **it_tcell;
-      int i = tcell.y();
-      int j = tcell.x();
-      tcell_map_[i][j].push_back( &tcell );
-    }
-  }
+  /** T細胞を年齢に対応するバケットに加える */
+  void push( Tcell *tcell );
 
-  /** 指定した位置のT細胞配列を返す */
-  VECTOR(Tcell *)& tcellsAt( int i, int j ) {
-    return tcell_map_[i][j];
-  }
+  /** 現在のバケットの容量を確保する */
+  void reserveNewborn( int n );
 
-private:
-  VECTOR(Tcell *) tcell_map_[HEIGHT][WIDTH];
-};
+  /** 寿命を迎えたバケットを空にして、除去した数を返す */
+  int expire();
 
-/**
+  /** T細胞の総数を返す（殺傷中を含む） */
+  int size() const { return size_ + engaged_size_; }
+
+  /** 自由なT細胞（バケットにいるT細胞）の数を返す */
+  int freeSize() const { return size_; }
+
+  /**
+   * 殺傷を始めたT細胞を、終えるステップのスロットに置く。removeParked でバケットから外す。
+   * バケットの中の位置は、このステップの TcellMap::resistTcells で記録したものを使う。
+   */
+  void park( Tcell *tcell, int completion_step );
+  void removeParked();
+
+  /** 殺傷を終えるステップを迎えたT細胞を、標的のIDの順に取り出す */
+  void unpark( int step, VECTOR(Tcell *)& due );
+
+  /** 殺傷中のT細胞を全て殺傷をやめさせて、バケットに戻す */
+  void releaseAll();
+
+  /** 指定したバケットのT細胞配列を返す */
+  VECTOR(Tcell *)& bucket( int k ) { return buckets_[k]; }
+
+  /** 殺傷中のT細胞の数を返す */
+  int engagedSize() const { return engaged_size_; }
+
+  /** 殺傷中のT細胞を engaged に加える */
+  void collectEngaged( VECTOR(Tcell *)& engaged ) const;
+
+  /** 確保しているバイト数を返す */
+  size_t allocatedBytes() const;
+
+private:
+  int bucketOf( int born_step ) const;
+  static bool lessTarget( const Tcell *a, const Tcell *b ) { return a->target() < b->target(); }
+
+  VECTOR(Tcell *) buckets_[TCELL_LIFESPAN];
+  int size_;
+  typedef std::pair<int, Tcell *> Parked;  // (殺傷を終えるステップ, T細胞) の組
+  VECTOR(Parked) wheel_[WHEEL_SIZE];
+  int engaged_size_;
+  typedef std::pair<int, int> Slot;  // (バケット, バケットの中の位置) の組
+  VECTOR(Slot) leaving_;  // バケットから外していない殺傷中のT細胞の位置
+};
+
+/**
+ * @brief 細胞のマップクラス
+ */
+class TcellMap {
+public:
+  TcellMap() { }
+  ~TcellMap() { }
+
+  /** マップをリセットする */
+  void resetMap() {
+    EACH( it_tile, tcell_map_.activeTiles() ) {
+      VECTOR(Tcell *) *tile = tcell_map_.tile( *it_tile );
+      FOR( k, TiledGrid< VECTOR(Tcell *) >::TILE_SITE_SIZE ) { tile[k].clear(); }
+    }
+  }
+
+  /** T細胞の位置を登録する */
+  void resistTcells( TcellRing& tcells ) {
+    resetMap();
+    FOR( k, TCELL_LIFESPAN ) {
+      VECTOR(Tcell *)& bucket = tcells.bucket(k);
+      FOR( slot, (int)bucket.size() ) {
+        Tcell &tcell = *bucket[slot];
+        tcell.setSlot( slot );  // 殺傷を始めたら、この位置でバケットから外す
+        int i = tcell.y();
+        int j = tcell.x();
+        // 同じバケット（誕生ステップ）の中ではIDの順にする。
+        // バケットの配列順は、殺傷を始めたT細胞を外すと入れ替わる。
+        VECTOR(Tcell *)& site = tcell_map_.ref( j, i, tcell.z() );
+        site.push_back( &tcell );
+        for( int n = site.size() - 1; n > 0 and site[n-1]->bornStep() == tcell.bornStep()
+            and site[n-1]->id() > tcell.id(); n-- ) {
+          std::swap( site[n-1], site[n] );
+        }
+      }
+    }
+    // T細胞がいなくなったタイルを解放する。
+    const VECTOR(int)& tiles = tcell_map_.activeTiles();
+    for( int n = (int)tiles.size() - 1; n >= 0; n-- ) {
+      VECTOR(Tcell *) *tile = tcell_map_.tile( tiles[n] );
+      bool empty = true;
+      FOR( k, TiledGrid< VECTOR(Tcell *) >::TILE_SITE_SIZE ) { empty = empty && tile[k].empty(); }
+      if( empty ) tcell_map_.release( tiles[n] );
+    }
+  }
+
+  /** 指定した位置のT細胞配列を返す */
+  const VECTOR(Tcell *)& tcellsAt( int i, int j, int k = 0 ) const {
+    return tcell_map_.at( j, i, k );
+  }
+
+  /** 確保しているバイト数を返す（位置ごとの配列の中身は除く） */
+  size_t allocatedBytes() const { return tcell_map_.allocatedBytes(); }
+
+private:
+  TiledGrid< VECTOR(Tcell *) > tcell_map_;
+};
+
+/**
+ * @brief 空間充填曲線の順に並べ直す
+ *
+ * 分裂した細胞やクローンのT細胞は配列の末尾に加わるので、
+ * 配列の順と位置が無関係になって、スケープやマップへの参照が飛び飛びになる。
+ * 位置を Morton 順か Hilbert 順の鍵にして、基数ソートで並べ直す。
+ * 同じ位置のものの順は変えない（安定）。
+ * 細胞は１ステップに１つしか動かないので、並べ直した直後の配列はほぼ整列している。
+ * 桁がすべて同じになる回は飛ばし、整列済みなら並べ替えない。
+ */
+class SpatialOrder {
+  public:
+    SpatialOrder();
+    ~SpatialOrder() { }
+
+    /** 位置の鍵を返す。立体では Hilbert 順の代わりにも Morton 順を使う */
+    unsigned int key( int x, int y, int z = 0 ) const;
+
+    /** 並べ直す時期かを返す */
+    bool due( VECTOR(Cell *)& cells );
+
+    /**
+     * 隣り合う組のうち、タイルの順が逆になっている割合を返す。
+     * 細胞は毎ステップ隣に動くので、位置の順ではなくタイルの順で測る。
+     */
+    template <class T>
+    double disorder( const VECTOR(T *)& agents ) const {
+      if( agents.size() < 2 ) return 0;
+      int reversed = 0;
+      unsigned int last = key( agents[0]->x(), agents[0]->y(), agents[0]->z() )>>block_shift_;
+      for( size_t i = 1; i < agents.size(); i++ ) {
+        unsigned int k = key( agents[i]->x(), agents[i]->y(), agents[i]->z() )>>block_shift_;
+        if( k < last ) reversed++;
+        last = k;
+      }
+      return (double)reversed/( agents.size() - 1 );
+    }
+
+    /**
+     * 配列を並べ直す。
+     * ポインタの順だけを変えるとヒープ上の位置が飛び飛びになるので、
+     * 並べた順に複製し直して、メモリ上でも空間順に並ぶようにする。
+     */
+    template <class T>
+    void sort( VECTOR(T *)& agents ) {
+      int n = agents.size();
+      keys_.resize( n ); items_.resize( n );
+      FOR( i, n ) {
+        keys_[i] = key( agents[i]->x(), agents[i]->y(), agents[i]->z() );
+        items_[i] = agents[i];
+      }
+      if( radixSort() == false ) return;
+      FOR( i, n ) { agents[i] = new T( *static_cast<T *>( items_[i] ) ); }
+      FOR( i, n ) { delete static_cast<T *>( items_[i] ); }
+    }
+
+    /** T細胞をバケットごとに並べ直す */
+    void sort( TcellRing& tcells );
+
+    /** 配列は変えずに、空間順（同じ位置では配列順）に並べたものを返す */
+    void arrange( const VECTOR(Cell *)& cells, VECTOR(Cell *)& sorted );
+
+    /** 作業用の配列の容量を確保する */
+    void reserve( size_t n ) {
+      keys_.reserve( n ); key_buffer_.reserve( n ); items_.reserve( n ); item_buffer_.reserve( n );
+    }
+
+    /** 作業用の配列を解放する */
+    void release() {
+      VECTOR(unsigned int)().swap( keys_ ); VECTOR(unsigned int)().swap( key_buffer_ );
+      VECTOR(void *)().swap( items_ ); VECTOR(void *)().swap( item_buffer_ );
+    }
+
+    /** 確保しているバイト数を返す */
+    size_t allocatedBytes() const {
+      return ( keys_.capacity() + key_buffer_.capacity() )*sizeof(unsigned int)
+        + ( items_.capacity() + item_buffer_.capacity() )*sizeof(void *);
+    }
+
+    /** 要素１つあたりの作業用のバイト数 */
+    static size_t bytesPerItem() { return 2*( sizeof(unsigned int) + sizeof(void *) ); }
+
+  private:
+    /** keys_ の順に items_ を安定に並べ替える。整列済みなら偽を返す */
+    bool radixSort();
+
+    int side_;      // 曲線の一辺（２のべき乗）
+    int key_bits_;  // 鍵の有効なビット数
+    int block_shift_;  // 鍵からタイルの番号にするシフト量
+    VECTOR(unsigned int) keys_, key_buffer_;
+    VECTOR(void *) items_, item_buffer_;
+};
+
+/**
+ * @brief 並列ステップエンジン
+ *
+ * 細胞分裂、代謝、免疫による除去を、スレッドで分担して行う。
+ * 乱数はエージェントごとの乱数列（RandomStream）から取り出し、
+ * 結果を元の配列順に結合するので、スレッド数によらず同じ結果になる。
+ *
+ * 同じ位置で競合する書き込みは、決まった順で解決する。
+ *   - 代謝: 位置ごとに担当スレッドを決め、位置の中ではIDの順に消費する。
+ *   - 免疫: 位置にいるT細胞を登録順に判定し、最初に一致したT細胞が除去する。
+ *
+ * 新しいIDも母細胞や除去された細胞のIDの順に振るので、
+ * 配列を空間順に並べ直しても（SpatialOrder）結果は変わらない。
+ */
+class ParallelStepEngine {
+  public:
+    ParallelStepEngine() { }
+    ~ParallelStepEngine() { }
+
+    ThreadPool& pool() { return pool_; }
+
+    /** 細胞分裂をする。分裂した細胞は配列の最後に加える */
+    void divide( VECTOR(Cell *)& cells, int& normaldivisioncount,
+        int& cancerdivisioncount, int& mutationcount );
+
+    /** 細胞が代謝する */
+    void metabolize( VECTOR(Cell *)& cells, GlucoseScape& gs, OxygenScape& os );
+
+    /** 死細胞を除去する */
+    void removeDeadCells( VECTOR(Cell *)& cells );
+
+    /**
+     * 免疫で除去して、除去したT細胞のクローンを返す。
+     * CTL_KILLING_RATE が正なら、認識したT細胞は殺傷中にして、
+     * 殺傷を終えるステップに除去する。
+     */
+    void removeByImmunity( VECTOR(Cell *)& cells, TcellMap& tcellmap,
+        VECTOR(Tcell *)& newtcells, TcellRing& tcells );
+
+    /** 時期が来ていれば、細胞とT細胞を空間順に並べ直す */
+    void reorder( VECTOR(Cell *)& cells, TcellRing& tcells );
+
+    /** 細胞 n 個分の作業用の配列の容量を確保する */
+    void reserve( size_t n ) { site_order_.reserve( n ); killers_.reserve( n ); order_.reserve( n ); }
+
+    /** 細胞の数に比例する作業用の配列を解放する（集約表現に切り替えたとき） */
+    void release();
+
+    /** 作業用に確保しているバイト数を返す */
+    size_t allocatedBytes() const;
+
+    /** 細胞１つあたりの作業用のバイト数 */
+    static size_t bytesPerCell() {
+      return sizeof(Cell *) + sizeof(Tcell *) + SpatialOrder::bytesPerItem();
+    }
+
+  private:
+    /** IDとの組をIDの順にする。既に整列していれば何もしない */
+    template <class PAIRS>
+    static void inIdOrder( PAIRS& pairs ) {
+      for( size_t i = 1; i < pairs.size(); i++ ) {
+        if( pairs[i-1].first > pairs[i].first ) {
+          std::stable_sort( pairs.begin(), pairs.end(), lessId<typename PAIRS::value_type> );
+          return;
+        }
+      }
+    }
+    template <class PAIR>
+    static bool lessId( const PAIR& a, const PAIR& b ) { return a.first < b.first; }
+
+    ThreadPool pool_;
+    SpatialOrder order_;
+    typedef std::pair<long long, Cell *> Birth;  // (母細胞のID, 娘細胞) の組
+    typedef std::pair<long long, Tcell *> Kill;  // (除去された細胞のID, 除去したT細胞) の組
+    typedef std::pair<long long, int> Mutation;  // (母細胞のID, 変わった位置) の組
+    typedef std::pair<Cell *, Tcell *> Conjugate;
+    typedef std::pair<long long, Conjugate> Contact;  // (認識された細胞のID, (細胞, T細胞)) の組
+    static bool lessTarget( const Tcell *tcell, long long id ) { return tcell->target() < id; }
+    VECTOR(Birth) births_;
+    VECTOR(Kill) kills_;
+    VECTOR(Mutation) mutations_;
+    VECTOR(Contact) contacts_;
+    VECTOR(Tcell *) due_;  // 殺傷を終えるT細胞（標的のIDの順）
+    VECTOR(Cell *) site_order_;  // 空間順に並べた細胞
+    VECTOR(int) site_start_;     // 細胞のいる位置ごとの先頭
+    VECTOR(Tcell *) killers_;    // 細胞を除去したT細胞
+};
+
+/**
+ * @brief 集約した細胞集団
+ *
+ * 位置、遺伝子配列、エネルギー、分裂回数が同じ細胞を１つの分類にまとめて、
+ * 分類ごとの細胞数だけを持つ。移動、分裂、代謝、死、免疫による除去は、
+ * 細胞ごとの試行を二項分布・多項分布からまとめて引いて、分類ごとに行う。
+ * 手間は細胞数ではなく、細胞のいる分類の数に比例する。
+ *
+ * 細胞ごとの確率はエージェント表現と同じにしてある。
+ * 同じ位置での代謝は、エージェント表現と同じく古い細胞から順に行う。
+ * 分類は生まれたステップを持ち、同じステップに生まれた細胞の間だけ無作為な順とする。
+ * 途中で集約表現に切り替えたときは、それまでの細胞を最初のステップに生まれたとみなす。
+ * T細胞は、エージェントのまま扱う。
+ */
+class CellPopulation {
+  public:
+    CellPopulation() { }
+    ~CellPopulation() { }
+
+    /** 細胞を分類に加えて、細胞は解放する */
+    void absorb( VECTOR(Cell *)& cells );
+
+    /**
+     * 細胞を集約したときに確保するバイト数を見積もる。
+     * 分類の数を数えて、移動で作り直す分の配列も含める。
+     */
+    static size_t estimateBytes( const VECTOR(Cell *)& cells );
+
+    /** 細胞を移動させる */
+    void move();
+
+    /** 細胞分裂をする */
+    void divide( int& normaldivisioncount, int& cancerdivisioncount, int& mutationcount );
+
+    /** 細胞が代謝する */
+    void metabolize( GlucoseScape& gs, OxygenScape& os );
+
+    /** 死細胞を除去する */
+    void removeDeadCells();
+
+    /** 免疫で除去して、除去したT細胞のクローンを返す */
+    void removeByImmunity( TcellMap& tcellmap, VECTOR(Tcell *)& newtcells );
+
+    /** 統計を数え直す */
+    void count( CellStatistics& statistics );
+
+    /** 位置ごとの細胞数を数える。細胞のいるタイルだけを確保する */
+    void siteCounts( TiledGrid<int>& all, TiledGrid<int>& normal, TiledGrid<int>& cancer );
+
+    /** がん細胞がケモカインを分泌する */
+    void secrete( ChemokineScape& chemokine );
+
+    /** 細胞の分布を出力する */
+    void outputMaps();
+
+    int classSize() const { return classes_.size(); }
+
+    /** 確保しているバイト数を返す */
+    size_t allocatedBytes() const { return classes_.capacity()*sizeof(CellClass); }
+
+  private:
+    struct CellClass {
+      int x, y, z;
+      GENE gene;
+      ENERGY energy;
+      int division;  // 分裂回数
+      int birth;     // 生まれたステップ（代謝の順番）
+      int count;     // 細胞数
+    };
+    static bool less( const CellClass& a, const CellClass& b );
+    static bool same( const CellClass& a, const CellClass& b );
+    static bool lessCell( Cell *a, Cell *b );
+
+    /** 同じ分類をまとめる。位置の順に並び、位置の中では古い順に並ぶ */
+    void merge( size_t sorted = 0 );
+
+    /** 分類の性質を調べるための細胞を設定する */
+    Cell& prototype( const CellClass& c );
+
+    /** 二項分布から引く */
+    int binomial( int n, double p );
+
+    VECTOR(CellClass) classes_;
+    Cell prototype_;
+    std::mt19937_64 engine_;
+};
+
+/**
+ * @brief テレメトリのクラス
+ *
+ * 毎ステップの統計と縮小したマップを、共有メモリ上のリングバッファに書き込む。
+ * 立体では、マップは z方向に投影した細胞数にする。
+ * 書き込みはシミュレーション側だけが行い、ロックは使わない。
+ * 読み手（script/monitor.py）は、いつでも接続・切断できる。
+ *
+ * 各レコードは通し番号を持ち、書き込み中は奇数、書き込み後は偶数にする。
+ * 読み手は読む前後で通し番号が同じ偶数であれば、一貫したレコードとみなす。
+ */
+class Telemetry {
+  public:
+    static const unsigned int MAGIC = 0x544d4943;  // "CIMT"
+    static const unsigned int VERSION = 1;
+    static const int SLOT_SIZE = 256;  // リングのレコード数
+    static const int MAP_SIZE = 16;    // 縮小マップの一辺
+
+    struct Header {
+      unsigned int magic;
+      unsigned int version;
+      unsigned int slot_size;
+      unsigned int record_size;
+      unsigned int map_width;
+      unsigned int map_height;
+      int pid;
+      int max_step;
+      volatile unsigned long long published;  // 書き込み済みレコード数
+      volatile int finished;                  // 計算が終了したかどうか
+      int reserved;
+    };
+
+    struct Record {
+      volatile unsigned long long sequence;  // 通し番号
+      int step;
+      int normal_size;
+      int cancer_size;
+      int hidden_cancer_size;
+      int standard_cancer_size;
+      int tcell_size;
+      int killed_size;
+      int mutation_count;
+      double genevalue_ave;
+      double energy_ave;
+      double normal_energy_ave;
+      double cancer_energy_ave;
+      unsigned char normal_map[MAP_SIZE*MAP_SIZE];  // 正常細胞数（255で飽和）
+      unsigned char cancer_map[MAP_SIZE*MAP_SIZE];  // がん細胞数
+      unsigned char tcell_map[MAP_SIZE*MAP_SIZE];   // T細胞数
+    };
+
+    Telemetry();
+    ~Telemetry();
+
+    /** 共有メモリを作成する。失敗したら偽を返す */
+    bool open();
+
+    /** 共有メモリを閉じて、削除する */
+    void close();
+
+    /** 現在のステップの統計を公開する */
+    void publish( CellStatistics& statistics, int mutationcount,
+        VECTOR(Cell *)& cells, TcellRing& tcells );
+    void publish( CellStatistics& statistics, int mutationcount,
+        CellPopulation& population, TcellRing& tcells );
+
+  private:
+    /** 縮小した細胞マップと一緒に、レコードを書き込む */
+    void publish( CellStatistics& statistics, int mutationcount,
+        const int *normal_map, const int *cancer_map, TcellRing& tcells );
+
+    char name_[64];  // 共有メモリの名前
+    Header *header_;
+    Record *records_;
+    size_t length_;
+};
+
+/**
+ * @brief 実行結果の要約クラス
+ *
+ * 毎ステップの統計から、最終値と期間全体の集計をとり、
+ * 計算の最後に summary.txt に書き出す。
+ * make pack で master/ に保存され、catalog.py が索引を作る。
+ */
+class RunSummary {
+  public:
+    RunSummary();
+    ~RunSummary() { }
+
+    /** 現在のステップの統計を加える */
+    void update( CellStatistics& statistics, int tcellsize, int mutationcount );
+
+    /** 停止した理由とステップを記録する */
+    void stopped( const char *reason, int step ) { stop_reason_ = reason; stop_step_ = step; }
+
+    /** 集約表現に切り替えたステップを記録する */
+    void coarsened( int step ) { coarsened_step_ = step; }
+
+    /** メモリ使用量の最大値を記録する */
+    void setPeakMemory( long long bytes ) { peak_memory_ = bytes; }
+
+    /** 要約を書き出す */
+    void output( const char *fname );
+
+  private:
+    double start_time_;
+    int steps_;
+    const char *stop_reason_;   // 停止した理由
+    int stop_step_;             // 停止したステップ
+    int coarsened_step_;        // 集約表現に切り替えたステップ（切り替えなければ -1）
+    long long peak_memory_;     // メモリ使用量の最大値（バイト）
+    int final_normal_size_;
+    int final_cancer_size_;
+    int final_hidden_cancer_size_;
+    int final_tcell_size_;
+    double final_genevalue_ave_;
+    int max_cancer_size_;
+    int max_cancer_step_;
+    int first_cancer_step_;     // がん細胞が初めて現れたステップ
+    int first_hidden_step_;     // 免疫から逃れるがん細胞が初めて現れたステップ
+    double normal_size_sum_;
+    double cancer_size_sum_;
+    double hidden_cancer_size_sum_;
+    long long killed_sum_;
+    long long mutation_sum_;
+};
+
+/**
+ * @brief 停止条件のクラス
+ *
+ * 毎ステップの統計から、計算を打ち切るかどうかを判定する。
+ * 全細胞の消滅、がん細胞の消滅、細胞数の上限、定常状態を判定する。
+ * がん細胞の消滅と定常状態は、突然変異が始まるまでは判定しない。
+ */
+class StopCondition {
+  public:
+    StopCondition();
+    ~StopCondition() { }
+
+    /** 停止するなら真を返す */
+    bool check( CellStatistics& statistics );
+
+    /** 停止した理由を返す */
+    const char *reason() const { return reason_; }
+
+  private:
+    /** 定常状態なら真を返す */
+    bool isSteady() const;
+
+    const char *reason_;
+    bool cancer_appeared_;            // がん細胞が現れたか
+    VECTOR(int) normal_, cancer_;     // 直近 2*窓幅 ステップの細胞数
+    long long normal_sum_[2];         // 窓ごとの和（0: １つ前, 1: 直近）
+    long long cancer_sum_[2];
+    int count_;                       // 記録したステップ数
+};
+
+/**
+ * @brief GIF画像の書き出しクラス
+ *
+ * 固定の256色パレットで、パレット番号の画像をLZW圧縮して書き出す。
+ * 圧縮はフレームごとに独立しているので、別々のスレッドで行える。
+ */
+class GifWriter {
+  public:
+    GifWriter();
+    ~GifWriter();
+
+    /** ファイルを開いて、ヘッダとパレットを書き出す */
+    bool open( const char *fname, int width, int height, int delay );
+
+    /** 圧縮済みのフレームを書き出す */
+    void writeFrame( const VECTOR(unsigned char)& compressed );
+
+    /** 終端を書き出して閉じる */
+    void close();
+
+    /**
+     * @brief LZWの辞書
+     *
+     * 辞書の木は 4096×256 の表（2MB）なので、スレッドごとに一度だけ確保して使い回す。
+     * 消去するときは、使った項目だけを０に戻す。
+     */
+    class Dictionary {
+      public:
+        Dictionary() : child_( 4096*256, 0 ) { used_.reserve( 4096 ); }
+        /** child(code, value) が次のコード（0なら無し） */
+        int child( int code, int value ) const { return child_[ code*256 + value ]; }
+        void add( int code, int value, int next ) {
+          child_[ code*256 + value ] = next;
+          used_.push_back( code*256 + value );
+        }
+        void clear() {
+          EACH( it_index, used_ ) { child_[ *it_index ] = 0; }
+          used_.clear();
+        }
+      private:
+        VECTOR(unsigned short) child_;
+        VECTOR(int) used_;  // 値を入れた項目
+    };
+
+    /**
+     * パレット番号の画像をLZW圧縮する。
+     *
+     * 出力はサブブロックに分けた画像データ（終端ブロックを含む）。
+     * 辞書は空の状態で渡し、空の状態で返す。
+     */
+    static void compress( const unsigned char *pixels, int size, Dictionary& dictionary,
+        VECTOR(unsigned char)& out );
+
+    /** パレットの色を返す（gnuplotの既定のpm3dパレット） */
+    static void color( int index, unsigned char rgb[3] );
+
+  private:
+    std::ofstream ofs_;
+    int width_, height_, delay_;
+};
+
+/**
+ * @brief アニメーションの描画クラス
+ *
+ * 各ステップのマップを、SNAPSHOT_WIDTH×SNAPSHOT_HEIGHT に縮小してパレット番号にして、
+ * 最初と最後のフレームだけ保存しておく。
+ * 計算の最後に、フレームを並列に圧縮して、GIFアニメーションと
+ * 最後のフレームのPPM画像を書き出す。
+ * 立体では z方向に投影する（細胞数は層の和、スケープは層の平均）。
+ */
+class AnimationRenderer {
+  public:
+    enum MapKind { CELL, NORMALCELL, CANCERCELL, TCELL, GLUCOSE, OXYGEN, MAP_KIND_SIZE };
+
+    AnimationRenderer();
+    ~AnimationRenderer() { }
+
+    /** 現在のステップのマップを保存する */
+    void recordCells( VECTOR(Cell *)& cells );
+    void recordCells( CellPopulation& population );
+    void recordTcells( TcellRing& tcells );
+    void recordScapes( GlucoseScape& gs, OxygenScape& os );
+
+    /** GIFアニメーションとPPM画像を書き出す */
+    void render();
+
+    /** フレームに確保しているバイト数を返す */
+    size_t allocatedBytes() const;
+
+  private:
+    static const int SITE_SIZE = SNAPSHOT_WIDTH*SNAPSHOT_HEIGHT;  // フレームの位置数
+    static const int MAX_VALUE = 10;  // 色の範囲（gnuplotのcbrange）
+
+    unsigned char *frame( MapKind kind );
+    void record( MapKind kind, const double *values );
+    /** 縮小した位置ごとの数を、元の位置あたりの平均にして保存する */
+    void recordCounts( MapKind kind, VECTOR(double)& counts );
+    void renderAnimation( MapKind kind, const char *prefix,
+        VECTOR(unsigned char)& frames, int size, int first );
+    void renderImage( MapKind kind, const unsigned char *grid );
+
+    // 最初のフレームと、最後のフレームのリング
+    VECTOR(unsigned char) first_[MAP_KIND_SIZE];
+    VECTOR(unsigned char) last_[MAP_KIND_SIZE];
+    int first_size_;  // 保存した最初のフレーム数
+    int last_size_;   // 保存した最後のフレーム数
+    int last_step_;   // 最後に保存したステップ
+    int scale_;       // 画像の拡大率
+};
+
+/**
+ * @brief メモリの予算を管理する
+ *
+ * 細胞集団、索引、出力用の配列が確保しているバイト数をステップごとに見積もる。
+ * がんが免疫から逃れると細胞数が指数的に増えるので、
+ * 分裂の前に増える見込みの分だけ配列の容量を先に確保しておき、
+ * 直近の増加率で次のステップも増えると予算を超える場合は、確保する前に停止させる。
+ * 予算に近づいたときの対応は MEMORY_POLICY で選ぶ。
+ */
+class MemoryGovernor {
+  public:
+    enum Action { NONE, COARSEN, THROTTLE, ESCAPE };
+
+    /** 確保したエージェント１つあたりのヒープの管理領域 */
+    static const int HEAP_OVERHEAD = 16;
+
+    MemoryGovernor();
+    ~MemoryGovernor() { }
+
+    /** エージェントの配列と本体が確保しているバイト数を返す */
+    template <class T>
+    static size_t agentBytes( const VECTOR(T *)& agents ) {
+      return agents.capacity()*sizeof(T *) + agents.size()*( sizeof(T) + HEAP_OVERHEAD );
+    }
+
+    /**
+     * 分裂の前に、増える見込みの分だけ細胞の配列と作業用の配列の容量を確保する。
+     * 確保すると予算を超える場合は、確保せずに偽を返す。
+     */
+    bool reserve( VECTOR(Cell *)& cells, ParallelStepEngine& engine, RandomWalkKernel& walker );
+
+    /**
+     * 現在の使用量を記録して、とるべき対応を返す。
+     * 見積もりに入らないヒープの断片化なども数えるため、集約表現に切り替えるまでは
+     * 常駐サイズの方が大きければそちらを使う。
+     */
+    Action check( size_t bytes );
+
+    /** プロセスの常駐サイズを返す（分からなければ 0） */
+    static long long residentBytes();
+
+    /** 集約表現の方が大きくなるので切り替えなかった。使用量がさらに１割増えたら、もう一度試す */
+    void declined() { acted_ = false; throttled_bytes_ = bytes_ + bytes_/10; }
+
+    /**
+     * 集約表現に切り替えた。使用量が不連続に減るので、増加率をならし直す。
+     * 解放した細胞の領域はヒープに散らばって常駐サイズから外れないので、以降は見積もりだけを使う。
+     */
+    void coarsened() { growth_ = 1; bytes_ = 0; resident_ = false; }
+
+    /** マップを出力するステップかを返す（間引いていなければ毎ステップ） */
+    bool isSnapshotStep( int step ) const { return step%snapshot_interval_ == 0; }
+
+    long long bytes() const { return bytes_; }
+    long long peakBytes() const { return peak_bytes_; }
+
+  private:
+    long long budget_;          // 予算（バイト、0 なら制限しない）
+    long long bytes_;           // 直近の使用量
+    long long peak_bytes_;      // 使用量の最大値
+    double growth_;             // 直近の１ステップの増加率
+    bool acted_;                // 予算に近づいたときの対応をしたか
+    bool resident_;             // 常駐サイズも使うかどうか
+    int snapshot_interval_;     // マップを出力する間隔
+    long long throttled_bytes_; // 次に出力を間引くか、集約表現を試す使用量
+};
+
+/**
  * @brief ステップ管理するクラス
  *
  * 時間を更新するクラスを作成する。
@@ -518,6 +2195,7 @@ template < typename T >
 void output_map_with_value( const char *fname, VECTOR(T *)& agents );
 void output_normalcell_map_with_value( const char *fname,  VECTOR(Cell *)& cells );
 void output_cancercell_map_with_value( const char *fname,  VECTOR(Cell *)& cells );
+void output_tcell_map_with_value( const char *fname,  TcellRing& tcells );
 
 /**
  * 細胞クラスの、スケープ上での2次元マップを出力する。
@@ -526,11 +2204,12 @@ void output_cancercell_map_with_value( const char *fname,  VECTOR(Cell *)& cells
 // void output_cell_map( VECTOR(Cell *)& cells );
 
 // 細胞クラスの平均エネルギーを出力する。
-void output_cell_energy_average( VECTOR(Cell *)& cells );
+void output_cell_energy_average( CellStatistics& statistics );
 
 // 現在のシュガースケープの分布を出力する。
 void output_glucose_map( GlucoseScape& gs );
 void output_oxygen_map( OxygenScape& os );
+void output_chemokine_map( ChemokineScape& chemokine );
 
 
 // ============================================================================
@@ -548,9 +2227,36 @@ int main() {
   // グルコース、酸素マップのインスタンスを作成する。
   GlucoseScape *gs = new GlucoseScape();
   OxygenScape *os = new OxygenScape();
+  ChemokineScape chemokine;  // ケモカインマップ（CHEMOTAXIS）
 
   TcellMap *tcellmap = new TcellMap();
 
+  // 細胞集団の統計
+  CellStatistics &statistics = CellStatistics::Instance();
+
+  RandomWalkKernel walker;  // 移動用のカーネル
+  ParallelStepEngine engine;  // 並列ステップエンジン
+  CellPopulation population;  // 集約した細胞集団（population_mode == 1）
+  int population_mode = POPULATION_MODE;  // メモリの予算によって集約表現に切り替わる
+  MemoryGovernor governor;  // メモリの予算
+
+  // アニメーションを描画する
+  AnimationRenderer renderer;
+
+  // 実行結果を要約する
+  RunSummary summary;
+  VALUE(Random::Instance().seed());
+  VALUE(ModelKernels::Instance().geneKernelName());
+  VALUE(ModelKernels::Instance().walkKernelName());
+  VALUE(DIMENSION);
+
+  // 計算を打ち切る条件
+  StopCondition stopcondition;
+
+  // 実行中の統計を公開する
+  Telemetry telemetry;
+  if( TELEMETRY ) { telemetry.open(); }
+
   // 細胞を初期化していく。
   // TODO: 普通の細胞は細胞土地のほうがいいかも
   VECTOR(Cell *) cells;
@@ -560,19 +2266,32 @@ int main() {
     // 遺伝子を初期化する
     // 配列に加える
     Cell *newcell = new Cell();
+    newcell->assignId();
     newcell->randomSetLocation();
     newcell->setEnergy( Random::Instance().uniformInt(0, INITIAL_CELL_ENERGY) );
     cells.push_back( newcell );
+    statistics.born( *newcell );
+    if( LINEAGE_TRACKING and population_mode == 0 ) { LineageTracker::Instance().founded( *newcell ); }
+  }
+  if( population_mode == 1 ) {
+    population.absorb( cells );
+    population.count( statistics );
   }
 
   // T細胞を初期化していく。
-  VECTOR(Tcell *) tcells;
+  // 年齢ごとに寿命リングのバケットに入る。
+  TcellRing *tcells = new TcellRing();
   FOR( i, TCELL_SIZE ) {
     Tcell *tc = new Tcell();
     tc->randomSetLocation();
     tc->randomSetGene( CELL_GENE_LENGTH );
     tc->setAge( Random::Instance().uniformInt(0, TCELL_LIFESPAN ));
-    tcells.push_back( tc );
+    tcells->push( tc );
+  }
+
+  // 個々のイベントを記録する
+  if( EVENT_LOG and population_mode == 0 and EventLog::Instance().open( "events.bin" ) ) {
+    EventLog::Instance().checkpoint( cells, *tcells );
   }
 
   // 計算を実行する ---------------------------------------
@@ -581,22 +2300,20 @@ int main() {
     if( stepKeeper.isInterval(100) ) {
       VALUE(stepKeeper.step());
     }
+    // 細胞とT細胞を、空間順に並べ直す。
+    engine.reorder( cells, *tcells );
     /*
      * 細胞、T細胞を移動させる。
+     *
+     * 集団ごとにまとめて移動させる。
      */
-    EACH( it_cell, cells )
-    {
-      Cell& cell = **it_cell;
-      cell.move( *gs );
-    }
-    EACH( it_tcell, tcells )
-    {
-      Tcell& tcell = **it_tcell;
-      tcell.move( *gs );
-    }
+    if( population_mode == 1 ) population.move();
+    else walker.moveCells( cells, *gs, engine.pool() );
+    walker.moveTcells( *tcells, *gs, engine.pool(), CHEMOTAXIS ? chemokine.directionTable() : NULL,
+        CHEMOTAXIS ? chemokine.depthTable() : NULL );
 
     // 細胞の位置などを登録する
-    tcellmap->resistTcells( tcells );
+    tcellmap->resistTcells( *tcells );
 
     /*
      * 細胞分裂をする。
@@ -608,68 +2325,25 @@ int main() {
     int normaldivisioncount = 0;
     int cancerdivisioncount = 0;
     int mutationcount = 0;
-    VECTOR(Cell *) new_cells;
-    EACH( it_cell, cells ) {
-      Cell& origincell = **it_cell;
-
-      // 分裂不可能ならスキップする。
-      if( origincell.willDvision() == false ) {
-        continue;
-      }
-
-      ENERGY origin_energy = origincell.energy();
-      if( origin_energy > CELL_DIVISION_THRESHOLD_ENERGY ) {
-        Cell *newcell = new Cell();
-
-        // 同じ位置に分裂する。
-        int newx = origincell.x(); int newy = origincell.y();
-        newcell->setLocation( newx, newy );
-
-        // 遺伝子配列を同じにする。
-        // がん細胞からはがん細胞が分裂する。
-        // 正常細胞からは、がん細胞が分裂する可能性がある
-        newcell->setGene( origincell.gene() );
-        ASSERT( origincell.match(*newcell) );
-        if( origincell.isNormalCell() ) {
-          normaldivisioncount++;
-        } else {
-          cancerdivisioncount++;
-        }
-
-        // 突然変異する
-        if( stepKeeper.step() >= 1000 ) {
-          if( newcell->mutateGene( CELL_MUTATION_RATE ) ) { mutationcount++; } // 突然変異をしたらカウントする
-        }
-
-        // 半分にエネルギーを分ける。
-        newcell->setEnergy( origin_energy / 2 );
-        origincell.setEnergy( origin_energy / 2 );
-
-        new_cells.push_back( newcell );
-        origincell.incrementDivisionCount();  // 分裂回数を増やす。
-      }
+    if( population_mode == 0 and governor.reserve( cells, engine, walker ) == false ) {
+      summary.stopped( "escaped", stepKeeper.step() );
+      ECHO( "escaped" );
+      break;
     }
-    cells.insert(cells.end(), new_cells.begin(), new_cells.end()); // 配列に加える。
-
+    if( population_mode == 1 ) population.divide( normaldivisioncount, cancerdivisioncount, mutationcount );
+    else engine.divide( cells, normaldivisioncount, cancerdivisioncount, mutationcount );
 
     /*
      * 細胞が代謝する
      */
-    EACH( it_cell, cells ) {
-      Cell& cell = **it_cell;
-      cell.metabolize( *gs, *os );
-    }
+    if( population_mode == 1 ) population.metabolize( *gs, *os );
+    else engine.metabolize( cells, *gs, *os );
 
     /*
      * 死細胞を除去する。
      */
-    FOREACH( it_cell, cells ) {
-      Cell& cell = **it_cell;
-      if( cell.willDie() ) {
-        SAFE_DELETE( *it_cell );
-        cells.erase( it_cell );
-      } else { it_cell++; }
-    }
+    if( population_mode == 1 ) population.removeDeadCells();
+    else engine.removeDeadCells( cells );
 
     /*
      * 免疫で除去する
@@ -678,41 +2352,20 @@ int main() {
      * がん細胞かつ認識するがん細胞がある場合、
      * そのがん細胞を細胞配列から除去する。
      */
-    int deletedcellssize = 0;
+    statistics.resetStepCounters();
     VECTOR(Tcell *) newtcells;
-    FOREACH( it_cell, cells )
-    {
-      Cell& cell = **it_cell;
-      int i = cell.y(); int j = cell.x();
-
-      // がん細胞であれば、
-      // T細胞によって排除されるか判定される
-      if( cell.isCancerCell() ) {
-        VECTOR(Tcell *) tcells = tcellmap->tcellsAt( i, j );
-        if( tcells.size() > 0 )
-        {
-          bool matching = false;
-          EACH( it_tcell, tcells )
-          {
-            Tcell& tcell = **it_tcell;
-
-            // 免疫原性の確率で、
-            // 遺伝子配列が一致していれば、
-            // 除去する。
-            if( Random::Instance().probability( cell.immunogenicity() ) and cell.match( tcell ) )
-            {
-              SAFE_DELETE( *it_cell );
-              cells.erase( it_cell );
-              deletedcellssize++;
-              matching = true;
-
-              newtcells.push_back( &tcell.clone() );
-              break;
-            }
-          }
-          if( matching == false ) it_cell++;
-        } else { it_cell++; }
-      } else { it_cell++; }
+    if( population_mode == 1 ) {
+      population.removeByImmunity( *tcellmap, newtcells );
+      population.count( statistics );
+    } else {
+      engine.removeByImmunity( cells, *tcellmap, newtcells, *tcells );
+    }
+
+    // がん細胞がケモカインを分泌して、ケモカインが拡散する。
+    if( CHEMOTAXIS ) {
+      if( population_mode == 1 ) population.secrete( chemokine );
+      else chemokine.secrete( cells );
+      chemokine.update( engine.pool() );
     }
 
     // グルコーススケープが再生する。
@@ -721,73 +2374,70 @@ int main() {
 
     /*
      * T細胞が老化する
+     *
+     * 寿命を迎えたバケットを丸ごと除去する。
      */
-    int tcellsize = 0;  // T細胞の総数をカウント
-    int inittcellsize = 0;  // T細胞が初期化された回数をカウント
-    VECTOR(Tcell *) newborntcells;
-    FOREACH( it_tcell, tcells )
-    {
-      Tcell &tcell = **it_tcell;
-      tcell.aging();
-
-      if( tcell.age() >= TCELL_LIFESPAN ) {
-        SAFE_DELETE( *it_tcell );
-        tcells.erase( it_tcell );
-        inittcellsize++;
-      } else {
-        it_tcell++; 
-        tcellsize++;
-      }        
-    }
+    int inittcellsize = tcells->expire();  // T細胞が初期化された回数をカウント
 
     /*
      * T細胞を補完する。
+     *
+     * 補完したT細胞とクローンは、現在のバケットにまとめて加える。
      */
-    int short_tcell_size = TCELL_SIZE - tcellsize;
-    FOR( i, std::max( 0, short_tcell_size ) ) {
+    int short_tcell_size = std::max( 0, TCELL_SIZE - tcells->size() );
+    tcells->reserveNewborn( short_tcell_size + newtcells.size() );
+    FOR( i, short_tcell_size ) {
       Tcell *tc = new Tcell();
       tc->randomSetLocation();  // 位置はランダム
       tc->randomSetGene( CELL_GENE_LENGTH );  // 遺伝子配列もランダム
-      tcells.push_back( tc );
-      tcellsize++;
+      tcells->push( tc );
+      if( EVENT_LOG ) { EventLog::Instance().tcellBorn( *tc ); }
+    }
+    EACH( it_tcell, newtcells ) {
+      tcells->push( *it_tcell ); // 配列に加える。
+      if( EVENT_LOG ) { EventLog::Instance().tcellCloned( **it_tcell ); }
+    }
+    if( EVENT_LOG and stepKeeper.isInterval( EVENT_CHECKPOINT_INTERVAL ) ) {
+      EventLog::Instance().checkpoint( cells, *tcells );
     }
-    tcells.insert(tcells.end(), newtcells.begin(), newtcells.end()); // 配列に加える。
-    tcells.insert(tcells.end(), newborntcells.begin(), newborntcells.end()); // 配列に加える。
 
     // -----------------------------------------------------------------------
     /* ファイルに出力する */
     // 細胞の分布を出力する
     //output_cell_map( cells );
-    output_map_with_value( "cell", cells );
-    output_normalcell_map_with_value( "normalcell", cells );
-    output_cancercell_map_with_value( "cancercell", cells );
-    output_map_with_value( "tcell", tcells );
+    bool snapshot = MAP_TEXT_OUTPUT and governor.isSnapshotStep( stepKeeper.step() );
+    if( snapshot ) {
+      if( population_mode == 1 ) {
+        population.outputMaps();
+      } else {
+        output_map_with_value( "cell", cells );
+        output_normalcell_map_with_value( "normalcell", cells );
+        output_cancercell_map_with_value( "cancercell", cells );
+      }
+      output_tcell_map_with_value( "tcell", *tcells );
+    }
+    if( NATIVE_RENDER ) {
+      if( population_mode == 1 ) renderer.recordCells( population );
+      else renderer.recordCells( cells );
+      renderer.recordTcells( *tcells );
+      renderer.recordScapes( *gs, *os );
+    }
+
+    // 逐次更新した統計を検算する。（集約表現では毎ステップ数え直している）
+    if( STATISTICS_VERIFICATION and population_mode == 0 ) {
+      statistics.verify( cells );
+    }
 
     // 細胞の平均エネルギーを出力する。
-    output_cell_energy_average( cells );
+    output_cell_energy_average( statistics );
 
     // 統計をとる
-    int normalsize = 0;
-    int cancersize = 0;
-    int hiddencancercellsize = 0;
-    int standardcancercellsize = 0;
+    int normalsize = statistics.normalSize();
+    int cancersize = statistics.cancerSize();
+    int hiddencancercellsize = statistics.hiddenCancerSize();
+    int standardcancercellsize = statistics.standardCancerSize();
     double genevalueave = 0;
-    int genevaluesum = 0;
-    EACH( it_cell, cells ) {
-      Cell& cell = **it_cell;
-      genevaluesum += cell.geneValue();
-      if( cell.isCancerCell() ) 
-      {
-        cancersize++;
-        if( cell.isHiddenCancer() ) { hiddencancercellsize++; }
-        else { standardcancercellsize++; }
-      }
-      if( cell.isNormalCell() ) 
-      {
-        normalsize++;
-      }
-    }
-    if(cancersize>0) { genevalueave = (double)genevaluesum/cancersize; }
+    if(cancersize>0) { genevalueave = (double)statistics.geneValueSum()/cancersize; }
     output_value_with_step("mutantcancer-size.txt", hiddencancercellsize);
     output_value_with_step("standardcancer-size.txt", standardcancercellsize);
     output_value_with_step("genevalue-ave.txt", genevalueave);
@@ -798,22 +2448,85 @@ int main() {
       VALUE(genevalueave);
     }
 
-    if( stepKeeper.isInterval(1)) {
+    if( snapshot and stepKeeper.isInterval(1)) {
       // グルコースマップを出力する。
       output_glucose_map( *gs );
       output_oxygen_map( *os );
+      if( CHEMOTAXIS ) output_chemokine_map( chemokine );
     }
 
     output_value_with_step("normalcell-size.txt", normalsize);
     output_value_with_step("cancercell-size.txt", cancersize);
-    output_value_with_step("deleted-cell-size.txt", deletedcellssize);
-    output_value_with_step("tcell-size.txt", tcells.size() );
+    output_value_with_step("deleted-cell-size.txt", statistics.killedSize());
+    output_value_with_step("tcell-size.txt", tcells->size() );
     output_value_with_step("init-tcell-size.txt", inittcellsize);
     output_value_with_step("mutation-count.txt", mutationcount);
     output_value_with_step("normal-division-count.txt", normaldivisioncount);
     output_value_with_step("cancer-division-count.txt", cancerdivisioncount);
+
+    summary.update( statistics, tcells->size(), mutationcount );
+
+    if( LINEAGE_TRACKING and population_mode == 0 and stepKeeper.isInterval( LINEAGE_INTERVAL ) ) {
+      LineageTracker::Instance().outputCloneSizes( "clone-size.bin" );
+      output_value_with_step( "lineage-size.txt", LineageTracker::Instance().nodeSize() );
+    }
+
+    if( TELEMETRY and stepKeeper.isInterval( TELEMETRY_INTERVAL ) ) {
+      if( population_mode == 1 ) telemetry.publish( statistics, mutationcount, population, *tcells );
+      else telemetry.publish( statistics, mutationcount, cells, *tcells );
+    }
+
+    if( stopcondition.check( statistics ) ) {
+      summary.stopped( stopcondition.reason(), stepKeeper.step() );
+      ECHO( stopcondition.reason() );
+      break;
+    }
+
+    // メモリの予算を確かめる。
+    size_t bytes = MemoryGovernor::agentBytes( cells ) + tcells->allocatedBytes()
+      + population.allocatedBytes() + engine.allocatedBytes() + walker.allocatedBytes()
+      + tcellmap->allocatedBytes() + gs->allocatedBytes() + os->allocatedBytes() + chemokine.allocatedBytes()
+      + renderer.allocatedBytes() + LineageTracker::Instance().allocatedBytes()
+      + EventLog::Instance().allocatedBytes();
+    MemoryGovernor::Action action = governor.check( bytes );
+    if( action == MemoryGovernor::ESCAPE ) {
+      summary.stopped( "escaped", stepKeeper.step() );
+      ECHO( "escaped" );
+      break;
+    }
+    if( action == MemoryGovernor::COARSEN and population_mode == 0
+        and CellPopulation::estimateBytes( cells ) >= MemoryGovernor::agentBytes( cells )
+          + engine.allocatedBytes() + walker.allocatedBytes() ) {
+      // 細胞ごとにエネルギーが違うと分類がまとまらず、集約表現の方が大きくなる。
+      governor.declined();
+    } else if( action == MemoryGovernor::COARSEN and population_mode == 0 ) {
+      // 細胞を集約表現に移す。以降、系統とイベントは記録しない。
+      ECHO( "switching to the aggregated population" );
+      if( EVENT_LOG ) { EventLog::Instance().close(); }
+      tcells->releaseAll();  // 集約表現では即座に殺傷する
+      population.absorb( cells );
+      VECTOR(Cell *)().swap( cells );  // 配列の容量も返す
+      population.count( statistics );
+      population_mode = 1;
+      summary.coarsened( stepKeeper.step() );
+      // 細胞の数に比例する作業用の配列も返して、空いたヒープをできるだけ OS に返す。
+      engine.release();
+      walker.release();
+      malloc_trim( 0 );
+      governor.coarsened();
+    }
   }
   // ------------------------------------------------------
+  telemetry.close();
+  summary.setPeakMemory( governor.peakBytes() );
+  summary.output( "summary.txt" );
+  if( LINEAGE_TRACKING and population_mode == 0 ) { LineageTracker::Instance().outputTree( "lineage.bin" ); }
+  if( EVENT_LOG ) { EventLog::Instance().close(); }
+
+  if( NATIVE_RENDER ) {
+    ECHO("Rendering animations");
+    renderer.render();
+  }
 
   return 0;
 }
@@ -840,96 +2553,68 @@ void output_map_with_value( const char *fname,  VECTOR(T *)& agents ) {
   // ファイル名
   char file_name[256];
   sprintf(file_name, "%d-%s.txt", StepKeeper::Instance().step(), fname);
-  std::ofstream agent_map_ofs(file_name);
 
-  // マップの全ての位置を0で初期化する。
-  int agent_map[HEIGHT][WIDTH] = {};
+  // エージェントのいるタイルだけで数える。
+  TiledGrid<int> agent_map;
   EACH(it_agent, agents) {
     T& agent = **it_agent;
-    agent_map[agent.y()][agent.x()]++;
-  }
-  FOR(i, HEIGHT) {
-    FOR(j, WIDTH) {
-      agent_map_ofs << i << SEPARATOR;
-      agent_map_ofs << j << SEPARATOR;
-      agent_map_ofs << agent_map[i][j];
-      agent_map_ofs << std::endl;
-    }
-    agent_map_ofs << std::endl;
+    agent_map.ref(agent.x(), agent.y(), agent.z())++;
   }
+  output_tiled_map(file_name, agent_map);
 }
 
 void output_normalcell_map_with_value( const char *fname,  VECTOR(Cell *)& cells ) {
   // ファイル名
   char file_name[256];
   sprintf(file_name, "%d-%s.txt", StepKeeper::Instance().step(), fname);
-  std::ofstream agent_map_ofs(file_name);
 
-  // マップの全ての位置を0で初期化する。
-  int agent_map[HEIGHT][WIDTH] = {};
+  // 細胞のいるタイルだけで数える。
+  TiledGrid<int> agent_map;
   EACH(it_cell, cells) {
     Cell& cell = **it_cell;
     if( cell.isNormalCell() == false ) continue;
-    agent_map[cell.y()][cell.x()]++;
-  }
-  FOR(i, HEIGHT) {
-    FOR(j, WIDTH) {
-      agent_map_ofs << i << SEPARATOR;
-      agent_map_ofs << j << SEPARATOR;
-      agent_map_ofs << agent_map[i][j];
-      agent_map_ofs << std::endl;
-    }
-    agent_map_ofs << std::endl;
+    agent_map.ref(cell.x(), cell.y(), cell.z())++;
   }
+  output_tiled_map(file_name, agent_map);
 }
 void output_cancercell_map_with_value( const char *fname,  VECTOR(Cell *)& cells ) {
   // ファイル名
   char file_name[256];
   sprintf(file_name, "%d-%s.txt", StepKeeper::Instance().step(), fname);
-  std::ofstream agent_map_ofs(file_name);
 
-  // マップの全ての位置を0で初期化する。
-  int agent_map[HEIGHT][WIDTH] = {};
+  // 細胞のいるタイルだけで数える。
+  TiledGrid<int> agent_map;
   EACH(it_cell, cells) {
     Cell& cell = **it_cell;
     if( cell.isCancerCell() == false ) continue;
-    agent_map[cell.y()][cell.x()]++;
-  }
-  FOR(i, HEIGHT) {
-    FOR(j, WIDTH) {
-      agent_map_ofs << i << SEPARATOR;
-      agent_map_ofs << j << SEPARATOR;
-      agent_map_ofs << agent_map[i][j];
-      agent_map_ofs << std::endl;
-    }
-    agent_map_ofs << std::endl;
+    agent_map.ref(cell.x(), cell.y(), cell.z())++;
   }
+  output_tiled_map(file_name, agent_map);
 }
 
-void output_cell_energy_average( VECTOR(Cell *)& cells ) {
-  int sum = 0;
-  int normalsum = 0;
-  int cancersum = 0;
-  int normalsize = 0;
-  int cancersize = 0;
-  EACH(it_cell, cells) {
-    Cell& cell = **it_cell;
-    sum += cell.energy();
-    if(cell.isNormalCell()) {
-      normalsum += cell.energy();
-      normalsize++;
-    }
-    else { 
-      cancersum += cell.energy(); 
-      cancersize++;
+void output_tcell_map_with_value( const char *fname,  TcellRing& tcells ) {
+  // ファイル名
+  char file_name[256];
+  sprintf(file_name, "%d-%s.txt", StepKeeper::Instance().step(), fname);
+
+  // T細胞のいるタイルだけで数える。
+  TiledGrid<int> agent_map;
+  FOR( k, TCELL_LIFESPAN ) {
+    EACH(it_tcell, tcells.bucket(k)) {
+      Tcell& tcell = **it_tcell;
+      agent_map.ref(tcell.x(), tcell.y(), tcell.z())++;
     }
   }
+  output_tiled_map(file_name, agent_map);
+}
+
+void output_cell_energy_average( CellStatistics& statistics ) {
   double average = 0;
   double normalave = 0;
   double cancerave = 0;
-  if( cells.size() > 0 ) average = (double)sum/cells.size();
-  if( normalsize > 0 ) normalave = (double)normalsum/normalsize;
-  if( cancersize > 0 ) cancerave = (double)cancersum/cancersize;
+  if( statistics.size() > 0 ) average = statistics.energySum()/statistics.size();
+  if( statistics.normalSize() > 0 ) normalave = statistics.normalEnergySum()/statistics.normalSize();
+  if( statistics.cancerSize() > 0 ) cancerave = statistics.cancerEnergySum()/statistics.cancerSize();
 
   output_value_with_step("cell-energy-average.txt", average);
   output_value_with_step("normal-energy-average.txt", normalave);
@@ -940,44 +2625,32 @@ void output_cell_energy_average( VECTOR(Cell *)& cells ) {
 void output_glucose_map( GlucoseScape& gs ) {
   char file_name[256];
   sprintf(file_name, "%d-glucose.txt", StepKeeper::Instance().step());
-  std::ofstream glucose_map_ofs(file_name);
-
-  FOR(i, HEIGHT) {
-    FOR(j, WIDTH) {
-      glucose_map_ofs << i << SEPARATOR;
-      glucose_map_ofs << j << SEPARATOR;
-      glucose_map_ofs << gs.glucose(j, i);
-      glucose_map_ofs << std::endl;
-    }
-    glucose_map_ofs << std::endl;
-  }
+  output_tiled_map(file_name, gs.map());
 }
 
 void output_oxygen_map( OxygenScape& os ) {
   char file_name[256];
   sprintf(file_name, "%d-oxygen.txt", StepKeeper::Instance().step());
-  std::ofstream oxygen_map_ofs(file_name);
+  output_tiled_map(file_name, os.map());
+}
 
-  FOR(i, HEIGHT) {
-    FOR(j, WIDTH) {
-      oxygen_map_ofs << i << SEPARATOR;
-      oxygen_map_ofs << j << SEPARATOR;
-      oxygen_map_ofs << os.oxygen(j, i);
-      oxygen_map_ofs << std::endl;
-    }
-    oxygen_map_ofs << std::endl;
-  }
+void output_chemokine_map( ChemokineScape& chemokine ) {
+  char file_name[256];
+  sprintf(file_name, "%d-chemokine.txt", StepKeeper::Instance().step());
+  output_tiled_map(file_name, chemokine.field());
 }
 
 /*
  * Landscape
  */
 
-bool __Landscape::isExistingPoint(int x, int y) {
+bool __Landscape::isExistingPoint(int x, int y, int z) {
   if( x < 0 ) return false;
   if( y < 0 ) return false;
   if( x > WIDTH-1 ) return false;
   if( y > HEIGHT-1 ) return false;
+  if( z < 0 ) return false;
+  if( z > LAYERS-1 ) return false;
   return true;
 }
 
@@ -1000,51 +2673,386 @@ bool StepKeeper::isInterval( int interval ) {
 }
 
 /*
- * GlucoseScape
+ * Tcell
+ */
+Tcell::Tcell() : target_(-1), kills_(0), slot_(-1) {
+  initAge();
+}
+int Tcell::age() { return StepKeeper::Instance().step() - born_step_; }
+void Tcell::setAge( int age ) { born_step_ = StepKeeper::Instance().step() - age; }
+void Tcell::initAge() { born_step_ = StepKeeper::Instance().step(); }
+
+/*
+ * TcellRing
  */
-GlucoseScape::GlucoseScape() {
-  // 全てのマップに初期グルコース量を配置する。
-  FOR(i, HEIGHT) {
-    FOR(j, WIDTH) {
-      glucose_map_[i][j] = 5;
+int TcellRing::bucketOf( int born_step ) const {
+  int k = born_step%TCELL_LIFESPAN;
+  return k < 0 ? k + TCELL_LIFESPAN : k;
+}
+
+void TcellRing::push( Tcell *tcell ) {
+  if( tcell->id() < 0 ) tcell->assignId();
+  // 寿命以上の年齢は、次のステップで寿命を迎えるバケットに入れる。
+  if( tcell->age() > TCELL_LIFESPAN-1 ) tcell->setAge( TCELL_LIFESPAN-1 );
+  buckets_[ bucketOf( tcell->bornStep() ) ].push_back( tcell );
+  size_++;
+}
+
+void TcellRing::reserveNewborn( int n ) {
+  VECTOR(Tcell *)& current = buckets_[ bucketOf( StepKeeper::Instance().step() ) ];
+  current.reserve( current.size() + n );
+}
+
+size_t TcellRing::allocatedBytes() const {
+  size_t bytes = 0;
+  FOR( k, TCELL_LIFESPAN ) { bytes += MemoryGovernor::agentBytes( buckets_[k] ); }
+  FOR( k, WHEEL_SIZE ) {
+    bytes += wheel_[k].capacity()*sizeof(Parked) + wheel_[k].size()*( sizeof(Tcell) + MemoryGovernor::HEAP_OVERHEAD );
+  }
+  return bytes + leaving_.capacity()*sizeof(Slot);
+}
+
+void TcellRing::park( Tcell *tcell, int completion_step ) {
+  wheel_[ completion_step%WHEEL_SIZE ].push_back( std::make_pair( completion_step, tcell ) );
+  leaving_.push_back( std::make_pair( bucketOf( tcell->bornStep() ), tcell->slot() ) );
+}
+
+void TcellRing::removeParked() {
+  // 殺傷を始めたT細胞だけを、バケットの末尾と入れ替えて外す。
+  // 後ろの位置から外せば、まだ外していない位置は動かない。
+  // バケットの中の順は変わるが、マップへの登録ではIDの順に並べ直す。
+  std::sort( leaving_.begin(), leaving_.end(), std::greater<Slot>() );
+  EACH( it_slot, leaving_ ) {
+    VECTOR(Tcell *)& bucket = buckets_[ it_slot->first ];
+    bucket[ it_slot->second ] = bucket.back();
+    bucket.pop_back();
+  }
+  engaged_size_ += leaving_.size();
+  size_ -= leaving_.size();
+  leaving_.clear();
+}
+
+void TcellRing::unpark( int step, VECTOR(Tcell *)& due ) {
+  // スロットには WHEEL_SIZE ステップ先のT細胞も入っているので、残しておく。
+  VECTOR(Parked)& slot = wheel_[ step%WHEEL_SIZE ];
+  size_t rest = 0;
+  size_t first = due.size();
+  FOR( i, (int)slot.size() ) {
+    if( slot[i].first == step ) due.push_back( slot[i].second );
+    else slot[rest++] = slot[i];
+  }
+  slot.resize( rest );
+  engaged_size_ -= due.size() - first;
+  std::sort( due.begin() + first, due.end(), lessTarget );
+}
+
+void TcellRing::collectEngaged( VECTOR(Tcell *)& engaged ) const {
+  FOR( k, WHEEL_SIZE ) {
+    EACH( it_parked, wheel_[k] ) { engaged.push_back( it_parked->second ); }
+  }
+}
+
+void TcellRing::releaseAll() {
+  FOR( k, WHEEL_SIZE ) {
+    EACH( it_parked, wheel_[k] ) {
+      it_parked->second->release();
+      engaged_size_--;
+      push( it_parked->second );
     }
+    wheel_[k].clear();
   }
 }
-void GlucoseScape::generate() {
-  FOR(i, HEIGHT) {
-    FOR(j, WIDTH) {
-      if(glucose(j, i) <= MAX_GLUCOSE - GLUCOSE_GENERATE) {
-        glucose_map_[i][j] += GLUCOSE_GENERATE;
+
+int TcellRing::expire() {
+  // 現在のステップで寿命を迎えるのは、
+  // TCELL_LIFESPANステップ前に生まれたバケット。
+  VECTOR(Tcell *)& expired = buckets_[ bucketOf( StepKeeper::Instance().step() ) ];
+  int n = expired.size();
+  EACH( it_tcell, expired ) { SAFE_DELETE( *it_tcell ); }
+  expired.clear();
+  size_ -= n;
+  return n;
+}
+
+/*
+ * GlucoseScape
+ */
+namespace {
+  /**
+   * 疎なマップを再生する。
+   *
+   * 確保していない位置は、背景値と同じように再生される。
+   * 再生して全ての位置が背景値に戻ったタイルは解放する。
+   */
+  void generate_tiled_map( TiledGrid<MATERIAL>& map, MATERIAL generate, MATERIAL max ) {
+    MATERIAL background = map.background();
+    if( background <= max - generate ) map.setBackground( background + generate );
+    const VECTOR(int)& tiles = map.activeTiles();
+    for( int n = (int)tiles.size() - 1; n >= 0; n-- ) {
+      int t = tiles[n];
+      MATERIAL *tile = map.tile( t );
+      bool same = true;
+      FOR( k, TiledGrid<MATERIAL>::TILE_SITE_SIZE ) {
+        if( tile[k] <= max - generate ) tile[k] += generate;
+        same = same && tile[k] == map.background();
       }
+      if( same ) map.release( t );
     }
   }
 }
 
-MATERIAL GlucoseScape::glucose(int x, int y) const { return glucose_map_[y][x]; }
-MATERIAL GlucoseScape::material(int x, int y) const { return glucose(x, y); }
-void GlucoseScape::setGlucose(int x, int y, MATERIAL value) { glucose_map_[y][x] = value; }
+// 全てのマップに初期グルコース量を配置する。
+GlucoseScape::GlucoseScape() : glucose_map_(5) { }
+void GlucoseScape::generate() {
+  generate_tiled_map( glucose_map_, GLUCOSE_GENERATE, MAX_GLUCOSE );
+}
+
+MATERIAL GlucoseScape::glucose(int x, int y, int z) const { return glucose_map_.at(x, y, z); }
+MATERIAL GlucoseScape::material(int x, int y, int z) const { return glucose(x, y, z); }
+void GlucoseScape::setGlucose(int x, int y, int z, MATERIAL value) { glucose_map_.ref(x, y, z) = value; }
 
 /*
  * OxygenScape
  */
-MATERIAL OxygenScape::oxygen(int x, int y) const { return oxygen_map_[y][x]; }
-MATERIAL OxygenScape::material(int x, int y) const { return oxygen(x, y); }
-void OxygenScape::setOxygen(int x, int y, MATERIAL value) { oxygen_map_[y][x] = value; }
+MATERIAL OxygenScape::oxygen(int x, int y, int z) const { return oxygen_map_.at(x, y, z); }
+MATERIAL OxygenScape::material(int x, int y, int z) const { return oxygen(x, y, z); }
+void OxygenScape::setOxygen(int x, int y, int z, MATERIAL value) { oxygen_map_.ref(x, y, z) = value; }
 void OxygenScape::generate() {
-  FOR(i, HEIGHT) {
-    FOR(j, WIDTH) {
-      if(oxygen(j, i) <= MAX_OXYGEN - OXYGEN_GENERATE) {
-        oxygen_map_[i][j] += OXYGEN_GENERATE;
+  generate_tiled_map( oxygen_map_, OXYGEN_GENERATE, MAX_OXYGEN );
+}
+
+// 全てのマップに初期酸素量を配置する。
+OxygenScape::OxygenScape() : oxygen_map_(5) { }
+
+/*
+ * ChemokineScape
+ */
+ChemokineScape::ChemokineScape()
+  : field_(0), next_(0), table_( 128 | 128<<8 ), depth_table_(128),  // 方向表の背景値は偏りなし
+    x0_(WIDTH), x1_(-1), y0_(HEIGHT), y1_(-1), z0_(LAYERS), z1_(-1),
+    tx0_(WIDTH), tx1_(-1), ty0_(HEIGHT), ty1_(-1), tz0_(LAYERS), tz1_(-1) {
+  if( CHEMOTAXIS == false ) return;
+  zeros_.assign( TILE_SIZE, 0 );
+  layer_box_.assign( 4*LAYERS, 0 );
+}
+
+const float *ChemokineScape::row( const Field& field, int x, int y, int z ) const {
+  const float *tile = field.tile( Field::tileOf( x, y, z ) );
+  return tile != NULL ? tile + Field::siteOf( x, y, z ) : &zeros_[0];
+}
+
+template <class T>
+void ChemokineScape::allocate( TiledGrid<T>& grid, int x0, int x1, int y0, int y1, int z0, int z1 ) {
+  const int depth = TiledGrid<T>::TILE_DEPTH;
+  for( int z = z0 - z0%depth; z <= z1; z += depth ) {
+    for( int y = y0 - y0%TILE_SIZE; y <= y1; y += TILE_SIZE ) {
+      for( int x = x0 - x0%TILE_SIZE; x <= x1; x += TILE_SIZE ) { grid.allocate( TiledGrid<T>::tileOf( x, y, z ) ); }
+    }
+  }
+}
+
+template <class T>
+void ChemokineScape::releaseBackground( TiledGrid<T>& grid ) {
+  const VECTOR(int)& tiles = grid.activeTiles();
+  for( int n = (int)tiles.size() - 1; n >= 0; n-- ) {
+    const T *tile = grid.tile( tiles[n] );
+    int k = 0;
+    while( k < TiledGrid<T>::TILE_SITE_SIZE and tile[k] == grid.background() ) k++;
+    if( k == TiledGrid<T>::TILE_SITE_SIZE ) grid.release( tiles[n] );
+  }
+}
+
+/**
+ * 層ごとの仕事を分担する。層の中の計算は層の外に書き込まないので、
+ * 分担の仕方によらず同じ値になる。
+ */
+struct ChemokineScape::SlabTask : public ParallelTask {
+  enum Phase { DIFFUSE, STORE, TABLE };
+  ChemokineScape *scape;
+  Phase phase;
+  int x0, x1, y0, y1, z0;
+  virtual void run( int begin, int end, int thread ) {
+    for( int z = z0 + begin; z < z0 + end; z++ ) {
+      if( phase == DIFFUSE ) scape->diffuse( x0, x1, y0, y1, z );
+      else if( phase == STORE ) scape->store( x0, x1, y0, y1, z );
+      else scape->rebuildTable( x0, x1, y0, y1, z );
+    }
+  }
+};
+
+void ChemokineScape::addSource( int x, int y, int z, double amount ) {
+  field_.ref( x, y, z ) += amount;
+  x0_ = std::min( x0_, x ); x1_ = std::max( x1_, x );
+  y0_ = std::min( y0_, y ); y1_ = std::max( y1_, y );
+  z0_ = std::min( z0_, z ); z1_ = std::max( z1_, z );
+}
+
+void ChemokineScape::secrete( VECTOR(Cell *)& cells ) {
+  // 同じ量を足すだけなので、細胞の順によらず同じ値になる。
+  EACH( it_cell, cells ) {
+    Cell& cell = **it_cell;
+    if( cell.isCancerCell() ) addSource( cell.x(), cell.y(), cell.z(), CHEMOKINE_SECRETION );
+  }
+}
+
+float ChemokineScape::neighbor( int x, int y, int z, int dx, int dy, int dz ) const {
+  int nx = x + dx, ny = y + dy, nz = z + dz;
+  if( BOUNDARY_CONDITION == 1 ) {
+    nx = ( nx + WIDTH )%WIDTH;
+    ny = ( ny + HEIGHT )%HEIGHT;
+    nz = ( nz + LAYERS )%LAYERS;
+  } else if( nx < 0 || nx >= WIDTH || ny < 0 || ny >= HEIGHT || nz < 0 || nz >= LAYERS ) {
+    nx = x; ny = y; nz = z;  // 壁を通して流れ出ない
+  }
+  return field_.at( nx, ny, nz );
+}
+
+void ChemokineScape::diffuse( int x0, int x1, int y0, int y1, int z ) {
+  const float keep = ( 1 - CHEMOKINE_DECAY )*( 1 - CHEMOKINE_DIFFUSION );
+  const float spread = ( 1 - CHEMOKINE_DECAY )*CHEMOKINE_DIFFUSION/( 2*DIMENSION );
+  // 立体で手前と奥の層がなければ、全て境界条件に従って計算する。
+  const bool inner_layer = DIMENSION != 3 || ( z > 0 && z < LAYERS-1 );
+  for( int y = y0; y <= y1; y++ ) {
+    const bool inner_row = y > 0 && y < HEIGHT-1 && inner_layer;
+    // タイルの行ごとに、内側の列は隣の行をそのまま読む。
+    // タイルの端の列は隣のタイルを、格子の端の列は境界条件に従って読む。
+    // 内側のループは分岐がないので、ベクトル化される。
+    for( int origin = x0 - x0%TILE_SIZE; origin <= x1; origin += TILE_SIZE ) {
+      int s0 = std::max( x0, origin ), s1 = std::min( x1, origin + TILE_SIZE-1 );
+      int inner0 = std::max( std::max( s0, origin + 1 ), 1 ) - origin;
+      int inner1 = std::min( std::min( s1, origin + TILE_SIZE-2 ), WIDTH-2 ) - origin;
+      float *out = next_.tile( Field::tileOf( origin, y, z ) ) + Field::siteOf( origin, y, z );
+      const float *mid = row( field_, origin, y, z );
+      if( inner_row ) {
+        const float *up = row( field_, origin, y-1, z );
+        const float *down = row( field_, origin, y+1, z );
+        if( DIMENSION == 3 ) {
+          const float *front = row( field_, origin, y, z-1 );
+          const float *back = row( field_, origin, y, z+1 );
+          for( int i = inner0; i <= inner1; i++ ) {
+            out[i] = keep*mid[i] + spread*( mid[i-1] + mid[i+1] + up[i] + down[i] + front[i] + back[i] );
+          }
+        } else {
+          for( int i = inner0; i <= inner1; i++ ) {
+            out[i] = keep*mid[i] + spread*( mid[i-1] + mid[i+1] + up[i] + down[i] );
+          }
+        }
+      } else {
+        for( int i = inner0; i <= inner1; i++ ) { out[i] = stencil( origin + i, y, z, keep, spread ); }
+      }
+      for( int x = s0; x <= s1; x++ ) {
+        if( x - origin < inner0 || x - origin > inner1 ) out[ x - origin ] = stencil( x, y, z, keep, spread );
+      }
+    }
+  }
+}
+
+float ChemokineScape::stencil( int x, int y, int z, float keep, float spread ) const {
+  float sum = neighbor( x, y, z, -1, 0, 0 ) + neighbor( x, y, z, 1, 0, 0 )
+    + neighbor( x, y, z, 0, -1, 0 ) + neighbor( x, y, z, 0, 1, 0 );
+  if( DIMENSION == 3 ) sum += neighbor( x, y, z, 0, 0, -1 ) + neighbor( x, y, z, 0, 0, 1 );
+  return keep*field_.at( x, y, z ) + spread*sum;
+}
+
+void ChemokineScape::store( int x0, int x1, int y0, int y1, int z ) {
+  // 書き戻しながら、小さな値を０にして、値のある範囲を求め直す。
+  int *box = &layer_box_[ 4*z ];
+  box[0] = WIDTH; box[1] = -1; box[2] = HEIGHT; box[3] = -1;
+  for( int y = y0; y <= y1; y++ ) {
+    for( int origin = x0 - x0%TILE_SIZE; origin <= x1; origin += TILE_SIZE ) {
+      const float *out = next_.tile( Field::tileOf( origin, y, z ) ) + Field::siteOf( origin, y, z );
+      float *mid = field_.tile( Field::tileOf( origin, y, z ) ) + Field::siteOf( origin, y, z );
+      for( int x = std::max( x0, origin ); x <= std::min( x1, origin + TILE_SIZE-1 ); x++ ) {
+        float value = out[ x - origin ] < CHEMOKINE_CUTOFF ? 0 : out[ x - origin ];
+        mid[ x - origin ] = value;
+        if( value > 0 ) {
+          box[0] = std::min( box[0], x ); box[1] = std::max( box[1], x );
+          box[2] = std::min( box[2], y ); box[3] = std::max( box[3], y );
+        }
       }
     }
   }
 }
 
-OxygenScape::OxygenScape() {
-  // 全てのマップに初期酸素量を配置する。
-  FOR(i, HEIGHT) {
-    FOR(j, WIDTH) {
-      oxygen_map_[i][j] = 5;
+void ChemokineScape::update( ThreadPool& pool ) {
+  if( x0_ > x1_ && tx0_ > tx1_ ) return;
+  SlabTask task;
+  task.scape = this;
+  int x0 = WIDTH, x1 = -1, y0 = HEIGHT, y1 = -1, z0 = LAYERS, z1 = -1;
+  if( x0_ <= x1_ ) {
+    // 値のある範囲から１つ外までが変わる。周期境界で端に届いたら、その軸は全体にする。
+    int sx0 = x0_ - 1, sx1 = x1_ + 1, sy0 = y0_ - 1, sy1 = y1_ + 1, sz0 = z0_ - 1, sz1 = z1_ + 1;
+    if( BOUNDARY_CONDITION == 1 and ( sx0 < 0 or sx1 >= WIDTH ) ) { sx0 = 0; sx1 = WIDTH-1; }
+    if( BOUNDARY_CONDITION == 1 and ( sy0 < 0 or sy1 >= HEIGHT ) ) { sy0 = 0; sy1 = HEIGHT-1; }
+    if( BOUNDARY_CONDITION == 1 and ( sz0 < 0 or sz1 >= LAYERS ) ) { sz0 = 0; sz1 = LAYERS-1; }
+    sx0 = std::max( sx0, 0 ); sx1 = std::min( sx1, WIDTH-1 );
+    sy0 = std::max( sy0, 0 ); sy1 = std::min( sy1, HEIGHT-1 );
+    sz0 = std::max( sz0, 0 ); sz1 = std::min( sz1, LAYERS-1 );
+    task.x0 = sx0; task.x1 = sx1; task.y0 = sy0; task.y1 = sy1; task.z0 = sz0;
+    allocate( field_, sx0, sx1, sy0, sy1, sz0, sz1 );
+    allocate( next_, sx0, sx1, sy0, sy1, sz0, sz1 );
+    task.phase = SlabTask::DIFFUSE;
+    pool.run( task, sz1 - sz0 + 1, 2 );
+    task.phase = SlabTask::STORE;
+    pool.run( task, sz1 - sz0 + 1, 2 );
+    // ０に戻ったタイルを解放する。書き込み先のタイルは、濃度のタイルと同じ所だけ残す。
+    releaseBackground( field_ );
+    const VECTOR(int)& scratch = next_.activeTiles();
+    for( int n = (int)scratch.size() - 1; n >= 0; n-- ) {
+      if( field_.tile( scratch[n] ) == NULL ) next_.release( scratch[n] );
+    }
+    for( int z = sz0; z <= sz1; z++ ) {
+      const int *box = &layer_box_[ 4*z ];
+      if( box[0] > box[1] ) continue;
+      x0 = std::min( x0, box[0] ); x1 = std::max( x1, box[1] );
+      y0 = std::min( y0, box[2] ); y1 = std::max( y1, box[3] );
+      z0 = std::min( z0, z ); z1 = std::max( z1, z );
+    }
+  }
+  x0_ = x0; x1_ = x1; y0_ = y0; y1_ = y1; z0_ = z0; z1_ = z1;
+
+  // 値のある範囲の１つ外までは勾配がある。前に偏っていた範囲も作り直す。
+  int tx0 = WIDTH, tx1 = -1, ty0 = HEIGHT, ty1 = -1, tz0 = LAYERS, tz1 = -1;
+  if( x0 <= x1 ) {
+    tx0 = std::max( x0 - 1, 0 ); tx1 = std::min( x1 + 1, WIDTH-1 );
+    ty0 = std::max( y0 - 1, 0 ); ty1 = std::min( y1 + 1, HEIGHT-1 );
+    tz0 = std::max( z0 - 1, 0 ); tz1 = std::min( z1 + 1, LAYERS-1 );
+    if( BOUNDARY_CONDITION == 1 ) {
+      if( x0 == 0 || x1 == WIDTH-1 ) { tx0 = 0; tx1 = WIDTH-1; }
+      if( y0 == 0 || y1 == HEIGHT-1 ) { ty0 = 0; ty1 = HEIGHT-1; }
+      if( z0 == 0 || z1 == LAYERS-1 ) { tz0 = 0; tz1 = LAYERS-1; }
+    }
+  }
+  task.x0 = std::min( tx0, tx0_ ); task.x1 = std::max( tx1, tx1_ );
+  task.y0 = std::min( ty0, ty0_ ); task.y1 = std::max( ty1, ty1_ );
+  task.z0 = std::min( tz0, tz0_ );
+  int z1_table = std::max( tz1, tz1_ );
+  allocate( table_, task.x0, task.x1, task.y0, task.y1, task.z0, z1_table );
+  if( DIMENSION == 3 ) allocate( depth_table_, task.x0, task.x1, task.y0, task.y1, task.z0, z1_table );
+  task.phase = SlabTask::TABLE;
+  pool.run( task, z1_table - task.z0 + 1, 2 );
+  releaseBackground( table_ );
+  if( DIMENSION == 3 ) releaseBackground( depth_table_ );
+  tx0_ = tx0; tx1_ = tx1; ty0_ = ty0; ty1_ = ty1; tz0_ = tz0; tz1_ = tz1;
+}
+
+void ChemokineScape::rebuildTable( int x0, int x1, int y0, int y1, int z ) {
+  for( int y = y0; y <= y1; y++ ) {
+    for( int x = x0; x <= x1; x++ ) {
+      // 中心差分の勾配の向きに偏らせる。
+      double gx = neighbor( x, y, z, 1, 0, 0 ) - neighbor( x, y, z, -1, 0, 0 );
+      double gy = neighbor( x, y, z, 0, 1, 0 ) - neighbor( x, y, z, 0, -1, 0 );
+      int px = (int)( 256*( 0.5 + 0.5*CHEMOTAXIS_BIAS*gx/( fabs( gx ) + CHEMOTAXIS_SATURATION ) ) );
+      int py = (int)( 256*( 0.5 + 0.5*CHEMOTAXIS_BIAS*gy/( fabs( gy ) + CHEMOTAXIS_SATURATION ) ) );
+      px = std::max( 0, std::min( 255, px ) );
+      py = std::max( 0, std::min( 255, py ) );
+      // タイルは update で確保してある。
+      table_.tile( DirectionTable::tileOf( x, y, z ) )[ DirectionTable::siteOf( x, y, z ) ] = px | py<<8;
+      if( DIMENSION == 3 ) {
+        double gz = neighbor( x, y, z, 0, 0, 1 ) - neighbor( x, y, z, 0, 0, -1 );
+        int pz = (int)( 256*( 0.5 + 0.5*CHEMOTAXIS_BIAS*gz/( fabs( gz ) + CHEMOTAXIS_SATURATION ) ) );
+        depth_table_.tile( DepthTable::tileOf( x, y, z ) )[ DepthTable::siteOf( x, y, z ) ] = std::max( 0, std::min( 255, pz ) );
+      }
     }
   }
 }
@@ -1054,35 +3062,45 @@ OxygenScape::OxygenScape() {
  */
 Cell::Cell() {
   // energy_ = Random::Instance().uniformInt(0, INITIAL_CELL_ENERGY);
+  counted_ = false;
+  lineage_ = -1;
+  engaged_ = false;
   setEnergy( INITIAL_CELL_ENERGY );
   cell_division_count_ = 0;
 
   initiateGene( CELL_GENE_LENGTH );
 }
 
-void Cell::metabolize( GlucoseScape& gs, OxygenScape& os ) {
-  if( isNormalCell() and Random::Instance().probability(NORMALCELL_METABOLIZE_PROB) ) 
+void Cell::setEnergy( ENERGY energy ) {
+  if( isCounted() ) {
+    CellStatistics::Instance().energyChanged( *this, energy_, energy );
+  }
+  energy_ = energy;
+}
+
+void Cell::metabolize( GlucoseScape& gs, OxygenScape& os, RandomStream& random ) {
+  if( isNormalCell() and random.probability(NORMALCELL_METABOLIZE_PROB) ) 
   {
     Cell& cell = *this;
-    MATERIAL g = gs.glucose(cell.x(), cell.y());
-    MATERIAL o = os.oxygen(cell.x(), cell.y());
+    MATERIAL g = gs.glucose(cell.x(), cell.y(), cell.z());
+    MATERIAL o = os.oxygen(cell.x(), cell.y(), cell.z());
     MATERIAL use_glucose = NORMALCELL_METABOLIZE_GLUCOSE;
     MATERIAL use_oxygen = NORMALCELL_METABOLIZE_OXYGEN;
     if( g >= use_glucose && o >= use_oxygen ) {
       cell.gainEnergy( NORMAL_CELL_GAIN_ENERGY );
-      gs.setGlucose( cell.x(), cell.y(), g - use_glucose );
-      os.setOxygen( cell.x(), cell.y(), o - use_oxygen );
+      gs.setGlucose( cell.x(), cell.y(), cell.z(), g - use_glucose );
+      os.setOxygen( cell.x(), cell.y(), cell.z(), o - use_oxygen );
     }
     return;
   }
-  if( isCancerCell() and Random::Instance().probability(CANCERCELL_METABOLIZE_PROB) )
+  if( isCancerCell() and random.probability(CANCERCELL_METABOLIZE_PROB) )
   {
     Cell& cell = *this;
-    MATERIAL g = gs.glucose(cell.x(), cell.y());
+    MATERIAL g = gs.glucose(cell.x(), cell.y(), cell.z());
     MATERIAL use_glucose = CANCER_CELL_METABOLIZE_GLUCOSE;
     if( g >= use_glucose ) {
       cell.gainEnergy( CANCER_CELL_GAIN_ENERGY );
-      gs.setGlucose( cell.x(), cell.y(), g-use_glucose );
+      gs.setGlucose( cell.x(), cell.y(), cell.z(), g-use_glucose );
     }
     return;
   }
@@ -1108,10 +3126,10 @@ double Cell::move( __Landscape& landscape ) {
  *
  * @return 真偽値
  */
-bool Cell::willDvision() {
+bool Cell::willDvision( RandomStream& random ) {
   // がん細胞なら無条件で分裂可能にする。
-  if( isCancerCell() and Random::Instance().probability(CANCERCELL_DIVISION_PROB) ) return true;
-  if( isNormalCell() and Random::Instance().probability(NORMALCELL_DIVISION_PROB) ) {
+  if( isCancerCell() and random.probability(CANCERCELL_DIVISION_PROB) ) return true;
+  if( isNormalCell() and random.probability(NORMALCELL_DIVISION_PROB) ) {
     if( divisionCount() < MAX_CELL_DIVISION_COUNT ) {
       return true;
     } else {
@@ -1128,69 +3146,2080 @@ bool Cell::willDvision() {
 double __Mobile::move( __Landscape& landscape ) {
   Random& random = Random::Instance();
   double distance = 0;
-  int from_x = x(); int from_y = y();
-  int to_x = from_x; int to_y = from_y;
+  int from_x = x(); int from_y = y(); int from_z = z();
+  int to_x = from_x; int to_y = from_y; int to_z = from_z;
   if( random.randomBool() ) { to_x += random.randomSign(); }
   if( random.randomBool() ) { to_y += random.randomSign(); }
+  if( DIMENSION == 3 and random.randomBool() ) { to_z += random.randomSign(); }
+
+  // 周期境界なら反対側に移る。
+  if( BOUNDARY_CONDITION == 1 ) {
+    distance = abs(from_x-to_x) + abs(from_y-to_y) + abs(from_z-to_z);
+    setX( (to_x + landscape.width())%landscape.width() );
+    setY( (to_y + landscape.height())%landscape.height() );
+    setZ( (to_z + landscape.depth())%landscape.depth() );
+    return distance;
+  }
 
-  if( landscape.isExistingPoint( to_x, to_y ) ) {
-    setX( to_x ); setY( to_y );
-    distance = abs(from_x-to_x) + abs(from_y-to_y);
+  if( landscape.isExistingPoint( to_x, to_y, to_z ) ) {
+    setX( to_x ); setY( to_y ); setZ( to_z );
+    distance = abs(from_x-to_x) + abs(from_y-to_y) + abs(from_z-to_z);
   }
   return distance;
 }
 
 /*
- * __Life
+ * CellStatistics
+ */
+CellStatistics& CellStatistics::Instance() {
+  static CellStatistics singleton;
+  return singleton;
+}
+
+CellStatistics::CellStatistics() : normal_size_(0), cancer_size_(0), hidden_cancer_size_(0),
+  gene_value_sum_(0), killed_size_(0) {
+  memset( energy_sum_, 0, sizeof(energy_sum_) );
+}
+
+ENERGY CellStatistics::energySum( int kind ) const {
+  long long sum = 0;
+  FOR( t, THREAD_SIZE ) { sum += energy_sum_[t][kind]; }
+  return sum/1048576.0;
+}
+
+void CellStatistics::add( Cell& cell, int sign ) {
+  if( cell.isNormalCell() ) {
+    normal_size_ += sign;
+    energy_sum_[0][NORMAL] += sign*quantize( cell.energy() );
+  } else {
+    cancer_size_ += sign;
+    energy_sum_[0][CANCER] += sign*quantize( cell.energy() );
+    if( cell.isHiddenCancer() ) hidden_cancer_size_ += sign;
+  }
+  gene_value_sum_ += sign*cell.geneValue();
+}
+
+void CellStatistics::clear() {
+  normal_size_ = cancer_size_ = hidden_cancer_size_ = gene_value_sum_ = 0;
+  memset( energy_sum_, 0, sizeof(energy_sum_) );
+}
+
+void CellStatistics::born( Cell& cell ) {
+  if( cell.isCounted() ) return;
+  add( cell, 1 );
+  cell.setCounted( true );
+}
+
+void CellStatistics::died( Cell& cell ) {
+  if( cell.isCounted() == false ) return;
+  add( cell, -1 );
+  cell.setCounted( false );
+}
+
+void CellStatistics::killed( Cell& cell ) {
+  died( cell );
+  killed_size_++;
+}
+
+void CellStatistics::mutated( Cell& cell, GENE old_gene ) {
+  if( cell.isCounted() == false ) return;
+  // 変異前の分類で除いて、変異後の分類で加え直す。
+  GENE new_gene = cell.gene();
+  cell.setGene( old_gene );
+  add( cell, -1 );
+  cell.setGene( new_gene );
+  add( cell, 1 );
+}
+
+void CellStatistics::energyChanged( Cell& cell, ENERGY from, ENERGY to ) {
+  // 並列処理中はスレッドごとの和に足す。
+  energy_sum_[ ThreadPool::threadId() ][ cell.isNormalCell() ? NORMAL : CANCER ]
+    += quantize( to ) - quantize( from );
+}
+
+bool CellStatistics::verify( VECTOR(Cell *)& cells ) {
+  CellStatistics recount;
+  EACH( it_cell, cells ) { recount.add( **it_cell, 1 ); }
+  bool ok = normal_size_ == recount.normal_size_
+    && cancer_size_ == recount.cancer_size_
+    && hidden_cancer_size_ == recount.hidden_cancer_size_
+    && gene_value_sum_ == recount.gene_value_sum_
+    && normalEnergySum() == recount.normalEnergySum()
+    && cancerEnergySum() == recount.cancerEnergySum();
+  if( ok == false ) {
+    std::cerr<<RED<<"[ STATISTICS ] "<<CLR_ST<<"drift at step "
+      <<StepKeeper::Instance().step()<<std::endl;
+    recount.killed_size_ = killed_size_;
+    *this = recount;
+  }
+  return ok;
+}
+
+/*
+ * LineageTracker
  */
-GENE __Life::gene() { return gene_; }
-int __Life::geneValue() {
-  int ret = 0;
-  FOR( i, CELL_GENE_LENGTH ) {
-    if( gene_[i] == '1' ) {
-      ret++;
+LineageTracker& LineageTracker::Instance() {
+  static LineageTracker instance;
+  return instance;
+}
+
+int LineageTracker::allocate( int parent, const GENE& gene ) {
+  int node;
+  if( free_.empty() ) {
+    node = nodes_.size();
+    nodes_.push_back( Node() );
+  } else {
+    node = free_.back();
+    free_.pop_back();
+  }
+  Node& n = nodes_[node];
+  n.id = next_id_++;
+  n.parent = parent;
+  n.born_step = StepKeeper::Instance().step();
+  n.size = 0;
+  n.children = 0;
+  n.births = 0;
+  n.gene = gene;
+  if( parent >= 0 ) nodes_[parent].children++;
+  node_size_++;
+  return node;
+}
+
+void LineageTracker::release( int node ) {
+  // 子孫のいなくなった祖先も、続けて解放する。
+  while( node >= 0 and nodes_[node].size == 0 and nodes_[node].children == 0 ) {
+    int parent = nodes_[node].parent;
+    nodes_[node].gene.clear();
+    free_.push_back( node );
+    node_size_--;
+    if( parent >= 0 ) nodes_[parent].children--;
+    node = parent;
+  }
+}
+
+void LineageTracker::founded( Cell& cell ) {
+  int node = allocate( -1, cell.gene() );
+  nodes_[node].size++;
+  cell.setLineage( node );
+}
+
+void LineageTracker::born( Cell& cell ) {
+  int node = cell.lineage();
+  ASSERT( (node >= 0) );
+  nodes_[node].births++;
+  if( cell.gene() != nodes_[node].gene ) {
+    // 突然変異したので、新しいクローンを作る。
+    node = allocate( node, cell.gene() );
+    cell.setLineage( node );
+  }
+  nodes_[node].size++;
+}
+
+void LineageTracker::died( Cell& cell ) {
+  int node = cell.lineage();
+  if( node < 0 ) return;
+  nodes_[node].size--;
+  cell.setLineage( -1 );
+  release( node );
+}
+
+namespace {
+  // 遺伝子配列をビット列に詰める。
+  void pack_gene( const GENE& gene, VECTOR(unsigned char)& bytes ) {
+    bytes.assign( ( CELL_GENE_LENGTH + 7 )/8, 0 );
+    FOR( k, CELL_GENE_LENGTH ) {
+      if( gene[k] == '1' ) bytes[k/8] |= 1<<( k%8 );
     }
   }
-  return ret;
 }
-void __Life::randomSetGene( int length ) {
-  gene_ = "";
-  FOR( i, length ) {
-    gene_ += Random::Instance().probability(50) ? '0' : '1';
+
+void LineageTracker::outputCloneSizes( const char *fname ) {
+  // [step:i32][count:u32] のあとに、[id:u32][size:i32] を count 個並べる。
+  VECTOR(int) record;
+  EACH( it_node, nodes_ ) {
+    if( it_node->size > 0 ) {
+      record.push_back( it_node->id );
+      record.push_back( it_node->size );
+    }
   }
+  int header[2] = { StepKeeper::Instance().step(), (int)record.size()/2 };
+  std::ofstream ofs( fname, std::ios_base::out | std::ios_base::app | std::ios_base::binary );
+  ofs.write( (const char *)header, sizeof(header) );
+  if( record.size() > 0 ) ofs.write( (const char *)&record[0], record.size()*sizeof(int) );
 }
 
-void __Life::initiateGene( int length ) {
-  gene_ = "";
-  FOR( i, length ) {
-    gene_ += '0';
+void LineageTracker::outputTree( const char *fname ) {
+  // ヘッダ: "LNG1" [gene_length:i32][count:u32]
+  // ノード: [id:u32][parent_id:u32 (根は 0xffffffff)][born_step:i32][size:i32][births:i32][gene:ceil(L/8)]
+  std::ofstream ofs( fname, std::ios_base::out | std::ios_base::binary );
+  int header[2] = { CELL_GENE_LENGTH, node_size_ };
+  ofs.write( "LNG1", 4 );
+  ofs.write( (const char *)header, sizeof(header) );
+  VECTOR(char) used( nodes_.size(), 1 );
+  EACH( it_free, free_ ) { used[*it_free] = 0; }
+  VECTOR(unsigned char) bytes;
+  FOR( k, (int)nodes_.size() ) {
+    if( used[k] == 0 ) continue;
+    const Node& n = nodes_[k];
+    unsigned int fields[5] = { n.id, n.parent >= 0 ? nodes_[n.parent].id : 0xffffffffu,
+      (unsigned int)n.born_step, (unsigned int)n.size, (unsigned int)n.births };
+    ofs.write( (const char *)fields, sizeof(fields) );
+    pack_gene( n.gene, bytes );
+    ofs.write( (const char *)&bytes[0], bytes.size() );
   }
 }
-void __Life::flip( int pos ) {
-  pos = pos%CELL_GENE_LENGTH;
-  if( gene_[pos] == '0' ) {
-    gene_[pos] = '1';
-  } else {
-    gene_[pos] = '0';
+
+/*
+ * EventLog
+ */
+EventLog& EventLog::Instance() {
+  static EventLog instance;
+  return instance;
+}
+
+bool EventLog::open( const char *fname ) {
+  if( CELL_GENE_LENGTH > 32 ) {
+    std::cerr<<RED<<"[ EVENT LOG ] "<<CLR_ST<<"gene length must be <= 32"<<std::endl;
+    return false;
+  }
+  if( DIMENSION == 3 ) {
+    // レコードに z座標の場所がない。
+    std::cerr<<RED<<"[ EVENT LOG ] "<<CLR_ST<<"3D lattices are not supported"<<std::endl;
+    return false;
   }
+  // ヘッダ: "EVL1" [record_size][seed][width][height][boundary][gene_length][lifespan][checkpoint_interval]（各 i32）
+  ofs_.open( fname, std::ios_base::out | std::ios_base::binary );
+  if( ofs_.is_open() == false ) {
+    std::cerr<<RED<<"[ EVENT LOG ] "<<CLR_ST<<"cannot open "<<fname<<std::endl;
+    return false;
+  }
+  int header[8] = { (int)sizeof(Record), (int)Random::Instance().seed(), WIDTH, HEIGHT,
+    BOUNDARY_CONDITION, CELL_GENE_LENGTH, TCELL_LIFESPAN, EVENT_CHECKPOINT_INTERVAL };
+  ofs_.write( "EVL1", 4 );
+  ofs_.write( (const char *)header, sizeof(header) );
+  buffer_.reserve( BUFFER_SIZE );
+  last_step_ = StepKeeper::Instance().step();
+  last_id_ = 0;
+  return true;
 }
 
-bool __Life::mutateGene( double prob ) {
-  // 突然変異をしたら、真を返す
-  // 0の時だけ1にする
-  bool changed = false;
-  if( Random::Instance().probability(prob) ) {
-    int pos = Random::Instance().uniformInt( 0, CELL_GENE_LENGTH-1 );
-    // flip(pos);
-    pos = pos%CELL_GENE_LENGTH;
-    if( gene_[pos] == '0' ) {
-      gene_[pos] = '1';
-      changed = true;
+void EventLog::close() {
+  if( ofs_.is_open() == false ) return;
+  flush();
+  ofs_.close();
+}
+
+void EventLog::flush() {
+  if( buffer_.empty() ) return;
+  ofs_.write( (const char *)&buffer_[0], buffer_.size()*sizeof(Record) );
+  buffer_.clear();
+}
+
+void EventLog::write( int type, int aux, long long id, long long other, int x, int y ) {
+  int step = StepKeeper::Instance().step();
+  if( step - last_step_ > 0xffff ) {
+    // ステップの差が 16 ビットに収まらなければ、区切りを入れる。
+    Record mark = { STEP, 0, 0, 0, step, 0, 0 };
+    buffer_.push_back( mark );
+    last_step_ = step;
+  }
+  Record record;
+  record.type = type;
+  record.aux = aux;
+  record.step_delta = step - last_step_;
+  record.id_delta = (int)( id - last_id_ );
+  record.other = (int)other;
+  record.x = x;
+  record.y = y;
+  buffer_.push_back( record );
+  last_step_ = step;
+  last_id_ = id;
+  if( (int)buffer_.size() >= BUFFER_SIZE ) flush();
+}
+
+int EventLog::packGene( const GENE& gene ) {
+  unsigned int bits = 0;
+  FOR( k, CELL_GENE_LENGTH ) {
+    if( gene[k] == '1' ) bits |= 1u<<k;
+  }
+  return (int)bits;
+}
+
+void EventLog::checkpoint( VECTOR(Cell *)& cells, TcellRing& tcells ) {
+  if( ofs_.is_open() == false ) return;
+  // 殺傷中のT細胞は、T細胞のレコードのあとに殺傷の始まりを続ける。
+  write( CHECKPOINT, 0, last_id_, cells.size() + tcells.freeSize() + 2*tcells.engagedSize(), 0, 0 );
+  EACH( it_cell, cells ) {
+    Cell& cell = **it_cell;
+    write( CELL, 0, cell.id(), packGene( cell.gene() ), cell.x(), cell.y() );
+  }
+  FOR( k, TCELL_LIFESPAN ) {
+    EACH( it_tcell, tcells.bucket(k) ) {
+      Tcell& tcell = **it_tcell;
+      write( TCELL, tcell.age(), tcell.id(), packGene( tcell.gene() ), tcell.x(), tcell.y() );
     }
   }
-  return changed;
+  VECTOR(Tcell *) engaged;
+  tcells.collectEngaged( engaged );
+  EACH( it_tcell, engaged ) {
+    Tcell& tcell = **it_tcell;
+    // 殺傷中は寿命を過ぎることがあるが、そのときは殺傷を終えると除かれる。
+    write( TCELL, std::min( tcell.age(), 255 ), tcell.id(), packGene( tcell.gene() ), tcell.x(), tcell.y() );
+    write( ENGAGE, 0, tcell.id(), tcell.target() - tcell.id(), tcell.x(), tcell.y() );
+  }
 }
-bool __Life::match( __Life& life ) {
-  if( gene() == life.gene() ) { return true; }
-  else { return false; }
+
+void EventLog::divided( long long parent_id, Cell& cell ) {
+  if( ofs_.is_open() == false ) return;
+  write( DIVISION, 0, cell.id(), parent_id - cell.id(), cell.x(), cell.y() );
+}
+
+void EventLog::mutated( Cell& cell, int locus ) {
+  if( ofs_.is_open() == false ) return;
+  write( MUTATION, locus, cell.id(), 0, cell.x(), cell.y() );
+}
+
+void EventLog::died( Cell& cell ) {
+  if( ofs_.is_open() == false ) return;
+  write( DEATH, 0, cell.id(), 0, cell.x(), cell.y() );
+}
+
+void EventLog::killed( long long cell_id, Tcell& tcell ) {
+  if( ofs_.is_open() == false ) return;
+  // がん細胞はT細胞と同じ位置にいる。
+  write( KILL, 0, cell_id, tcell.id() - cell_id, tcell.x(), tcell.y() );
+  killers_.push_back( tcell.id() );
+}
+
+void EventLog::tcellBorn( Tcell& tcell ) {
+  if( ofs_.is_open() == false ) return;
+  write( TCELL_BORN, 0, tcell.id(), packGene( tcell.gene() ), tcell.x(), tcell.y() );
+}
+
+void EventLog::tcellCloned( Tcell& tcell ) {
+  if( ofs_.is_open() == false ) return;
+  ASSERT( (next_killer_ < killers_.size()) );
+  write( TCELL_CLONE, 0, tcell.id(), killers_[next_killer_++] - tcell.id(), tcell.x(), tcell.y() );
+  if( next_killer_ == killers_.size() ) {
+    killers_.clear();
+    next_killer_ = 0;
+  }
 }
+
+void EventLog::engaged( Tcell& tcell ) {
+  if( ofs_.is_open() == false ) return;
+  write( ENGAGE, 0, tcell.id(), tcell.target() - tcell.id(), tcell.x(), tcell.y() );
+}
+
+void EventLog::released( Tcell& tcell, bool removed ) {
+  if( ofs_.is_open() == false ) return;
+  write( RELEASE, removed ? 1 : 0, tcell.id(), 0, tcell.x(), tcell.y() );
+}
+
+/*
+ * Telemetry
+ */
+Telemetry::Telemetry() : header_(NULL), records_(NULL), length_(0) {
+  name_[0] = '\0';
+}
+Telemetry::~Telemetry() { close(); }
+
+bool Telemetry::open() {
+  sprintf( name_, "/cancer-immunoediting-%d", (int)getpid() );
+  int fd = shm_open( name_, O_CREAT | O_RDWR | O_TRUNC, 0644 );
+  if( fd < 0 ) {
+    std::cerr<<RED<<"[ TELEMETRY ] "<<CLR_ST<<"cannot open "<<name_<<std::endl;
+    name_[0] = '\0';
+    return false;
+  }
+  length_ = sizeof(Header) + SLOT_SIZE*sizeof(Record);
+  void *memory = MAP_FAILED;
+  if( ftruncate( fd, length_ ) == 0 ) {
+    memory = mmap( NULL, length_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  }
+  ::close( fd );
+  if( memory == MAP_FAILED ) {
+    std::cerr<<RED<<"[ TELEMETRY ] "<<CLR_ST<<"cannot map "<<name_<<std::endl;
+    shm_unlink( name_ );
+    name_[0] = '\0';
+    return false;
+  }
+  memset( memory, 0, length_ );
+  header_ = (Header *)memory;
+  records_ = (Record *)( (char *)memory + sizeof(Header) );
+  header_->version = VERSION;
+  header_->slot_size = SLOT_SIZE;
+  header_->record_size = sizeof(Record);
+  header_->map_width = MAP_SIZE;
+  header_->map_height = MAP_SIZE;
+  header_->pid = getpid();
+  header_->max_step = StepKeeper::Instance().maxStep();
+  __sync_synchronize();
+  header_->magic = MAGIC;  // 最後に書いて、準備完了を知らせる
+  ECHO( "telemetry: /dev/shm" << name_ );
+  return true;
+}
+
+void Telemetry::close() {
+  if( header_ == NULL ) return;
+  header_->finished = 1;
+  __sync_synchronize();
+  munmap( header_, length_ );
+  shm_unlink( name_ );
+  header_ = NULL;
+  records_ = NULL;
+}
+
+void Telemetry::publish( CellStatistics& statistics, int mutationcount,
+    VECTOR(Cell *)& cells, TcellRing& tcells ) {
+  if( header_ == NULL ) return;
+  // マップを縮小して数える。
+  int normal_map[MAP_SIZE*MAP_SIZE] = {};
+  int cancer_map[MAP_SIZE*MAP_SIZE] = {};
+  EACH( it_cell, cells ) {
+    Cell& cell = **it_cell;
+    int k = ( cell.y()*MAP_SIZE/HEIGHT )*MAP_SIZE + cell.x()*MAP_SIZE/WIDTH;
+    if( cell.isNormalCell() ) normal_map[k]++;
+    else cancer_map[k]++;
+  }
+  publish( statistics, mutationcount, normal_map, cancer_map, tcells );
+}
+
+void Telemetry::publish( CellStatistics& statistics, int mutationcount,
+    CellPopulation& population, TcellRing& tcells ) {
+  if( header_ == NULL ) return;
+  TiledGrid<int> all, normal, cancer;
+  population.siteCounts( all, normal, cancer );
+  // 細胞のいるタイルだけを縮小して数える。
+  int normal_map[MAP_SIZE*MAP_SIZE] = {};
+  int cancer_map[MAP_SIZE*MAP_SIZE] = {};
+  TiledGrid<int> *grids[] = { &normal, &cancer };
+  int *maps[] = { normal_map, cancer_map };
+  FOR( g, 2 ) {
+    EACH( it_tile, grids[g]->activeTiles() ) {
+      const int *tile = grids[g]->tile( *it_tile );
+      int x0 = TiledGrid<int>::originX( *it_tile );
+      int y0 = TiledGrid<int>::originY( *it_tile );
+      FOR( k, TiledGrid<int>::TILE_SITE_SIZE ) {
+        int x = x0 + k%TILE_SIZE, y = y0 + k/TILE_SIZE%TILE_SIZE;
+        if( tile[k] > 0 ) maps[g][ ( y*MAP_SIZE/HEIGHT )*MAP_SIZE + x*MAP_SIZE/WIDTH ] += tile[k];
+      }
+    }
+  }
+  publish( statistics, mutationcount, normal_map, cancer_map, tcells );
+}
+
+void Telemetry::publish( CellStatistics& statistics, int mutationcount,
+    const int *normal_map, const int *cancer_map, TcellRing& tcells ) {
+  unsigned long long n = header_->published;
+  Record& record = records_[ n%SLOT_SIZE ];
+
+  record.sequence = 2*n + 1;  // 書き込み中
+  __sync_synchronize();
+
+  record.step = StepKeeper::Instance().step();
+  record.normal_size = statistics.normalSize();
+  record.cancer_size = statistics.cancerSize();
+  record.hidden_cancer_size = statistics.hiddenCancerSize();
+  record.standard_cancer_size = statistics.standardCancerSize();
+  record.tcell_size = tcells.size();
+  record.killed_size = statistics.killedSize();
+  record.mutation_count = mutationcount;
+  record.genevalue_ave = statistics.cancerSize() > 0
+    ? (double)statistics.geneValueSum()/statistics.cancerSize() : 0;
+  record.energy_ave = statistics.size() > 0
+    ? statistics.energySum()/statistics.size() : 0;
+  record.normal_energy_ave = statistics.normalSize() > 0
+    ? statistics.normalEnergySum()/statistics.normalSize() : 0;
+  record.cancer_energy_ave = statistics.cancerSize() > 0
+    ? statistics.cancerEnergySum()/statistics.cancerSize() : 0;
+
+  int tcell_map[MAP_SIZE*MAP_SIZE] = {};
+  FOR( b, TCELL_LIFESPAN ) {
+    EACH( it_tcell, tcells.bucket(b) ) {
+      Tcell& tcell = **it_tcell;
+      tcell_map[ ( tcell.y()*MAP_SIZE/HEIGHT )*MAP_SIZE + tcell.x()*MAP_SIZE/WIDTH ]++;
+    }
+  }
+  FOR( k, MAP_SIZE*MAP_SIZE ) {
+    record.normal_map[k] = std::min( normal_map[k], 255 );
+    record.cancer_map[k] = std::min( cancer_map[k], 255 );
+    record.tcell_map[k] = std::min( tcell_map[k], 255 );
+  }
+
+  __sync_synchronize();
+  record.sequence = 2*n + 2;  // 書き込み完了
+  header_->published = n + 1;
+}
+
+/*
+ * RunSummary
+ */
+RunSummary::RunSummary() : steps_(0), stop_reason_("max_step"), stop_step_(MAX_STEP), coarsened_step_(-1), peak_memory_(0),
+  final_normal_size_(0), final_cancer_size_(0),
+  final_hidden_cancer_size_(0), final_tcell_size_(0), final_genevalue_ave_(0),
+  max_cancer_size_(0), max_cancer_step_(0), first_cancer_step_(-1), first_hidden_step_(-1),
+  normal_size_sum_(0), cancer_size_sum_(0), hidden_cancer_size_sum_(0),
+  killed_sum_(0), mutation_sum_(0) {
+  struct timeval now;
+  gettimeofday( &now, NULL );
+  start_time_ = now.tv_sec + now.tv_usec*1e-6;
+}
+
+void RunSummary::update( CellStatistics& statistics, int tcellsize, int mutationcount ) {
+  int step = StepKeeper::Instance().step();
+  steps_ = step;
+  final_normal_size_ = statistics.normalSize();
+  final_cancer_size_ = statistics.cancerSize();
+  final_hidden_cancer_size_ = statistics.hiddenCancerSize();
+  final_tcell_size_ = tcellsize;
+  final_genevalue_ave_ = statistics.cancerSize() > 0
+    ? (double)statistics.geneValueSum()/statistics.cancerSize() : 0;
+  if( statistics.cancerSize() > max_cancer_size_ ) {
+    max_cancer_size_ = statistics.cancerSize();
+    max_cancer_step_ = step;
+  }
+  if( first_cancer_step_ < 0 and statistics.cancerSize() > 0 ) first_cancer_step_ = step;
+  if( first_hidden_step_ < 0 and statistics.hiddenCancerSize() > 0 ) first_hidden_step_ = step;
+  normal_size_sum_ += statistics.normalSize();
+  cancer_size_sum_ += statistics.cancerSize();
+  hidden_cancer_size_sum_ += statistics.hiddenCancerSize();
+  killed_sum_ += statistics.killedSize();
+  mutation_sum_ += mutationcount;
+}
+
+void RunSummary::output( const char *fname ) {
+  std::ofstream ofs( fname );
+  double steps = std::max( steps_, 1 );
+  ofs << "seed" << SEPARATOR << Random::Instance().seed() << std::endl;
+  struct timeval now;
+  gettimeofday( &now, NULL );
+  ofs << "wall_time" << SEPARATOR << now.tv_sec + now.tv_usec*1e-6 - start_time_ << std::endl;
+  ofs << "steps" << SEPARATOR << steps_ << std::endl;
+  ofs << "stop_reason" << SEPARATOR << stop_reason_ << std::endl;
+  ofs << "stop_step" << SEPARATOR << stop_step_ << std::endl;
+  ofs << "coarsened_step" << SEPARATOR << coarsened_step_ << std::endl;
+  ofs << "peak_memory_mb" << SEPARATOR << peak_memory_/1048576.0 << std::endl;
+  ofs << "final_normal_size" << SEPARATOR << final_normal_size_ << std::endl;
+  ofs << "final_cancer_size" << SEPARATOR << final_cancer_size_ << std::endl;
+  ofs << "final_hidden_cancer_size" << SEPARATOR << final_hidden_cancer_size_ << std::endl;
+  ofs << "final_tcell_size" << SEPARATOR << final_tcell_size_ << std::endl;
+  ofs << "final_genevalue_ave" << SEPARATOR << final_genevalue_ave_ << std::endl;
+  ofs << "max_cancer_size" << SEPARATOR << max_cancer_size_ << std::endl;
+  ofs << "max_cancer_step" << SEPARATOR << max_cancer_step_ << std::endl;
+  ofs << "first_cancer_step" << SEPARATOR << first_cancer_step_ << std::endl;
+  ofs << "first_hidden_step" << SEPARATOR << first_hidden_step_ << std::endl;
+  ofs << "mean_normal_size" << SEPARATOR << normal_size_sum_/steps << std::endl;
+  ofs << "mean_cancer_size" << SEPARATOR << cancer_size_sum_/steps << std::endl;
+  ofs << "mean_hidden_cancer_size" << SEPARATOR << hidden_cancer_size_sum_/steps << std::endl;
+  ofs << "total_killed" << SEPARATOR << killed_sum_ << std::endl;
+  ofs << "total_mutation" << SEPARATOR << mutation_sum_ << std::endl;
+}
+
+/*
+ * MemoryGovernor
+ */
+MemoryGovernor::MemoryGovernor() : budget_( (long long)MEMORY_BUDGET*1048576 ),
+  bytes_(0), peak_bytes_(0), growth_(1), acted_(false), resident_(true), snapshot_interval_(1), throttled_bytes_(0) {
+}
+
+long long MemoryGovernor::residentBytes() {
+  std::ifstream ifs( "/proc/self/statm" );
+  long long size = 0, resident = 0;
+  if( !( ifs >> size >> resident ) ) return 0;
+  return resident*sysconf( _SC_PAGESIZE );
+}
+
+bool MemoryGovernor::reserve( VECTOR(Cell *)& cells, ParallelStepEngine& engine, RandomWalkKernel& walker ) {
+  // 全ての細胞が分裂した場合の大きさまで、細胞の数に比例する配列をまとめて確保する。
+  // 配列ごとに倍々に確保し直させると、使用量が予告なく跳ね上がる。
+  double prob = std::max( NORMALCELL_DIVISION_PROB, CANCERCELL_DIVISION_PROB )/100;
+  size_t projected = cells.size() + (size_t)( cells.size()*prob ) + 1;
+  if( projected <= cells.capacity() ) return true;
+  projected += projected/8;
+  if( budget_ > 0 ) {
+    size_t per_cell = sizeof(Cell *) + ParallelStepEngine::bytesPerCell() + RandomWalkKernel::bytesPerAgent();
+    if( bytes_ + (long long)( ( projected - cells.capacity() )*per_cell ) > budget_ ) return false;
+  }
+  cells.reserve( projected );
+  engine.reserve( projected );
+  walker.reserve( projected );
+  return true;
+}
+
+MemoryGovernor::Action MemoryGovernor::check( size_t bytes ) {
+  // 配列は倍々に確保されて段階的に増えるので、増加率はならして使う。
+  if( resident_ ) bytes = std::max( (long long)bytes, residentBytes() );
+  if( bytes_ > 0 ) growth_ = 0.8*growth_ + 0.2*( (double)bytes/bytes_ );
+  bytes_ = bytes;
+  peak_bytes_ = std::max( peak_bytes_, bytes_ );
+  if( budget_ <= 0 ) return NONE;
+  bool soft = bytes_ >= budget_*MEMORY_SOFT_LIMIT;
+
+  // 集約表現に切り替えれば減るかもしれないので、停止より先に試す。
+  if( soft and MEMORY_POLICY == 1 and acted_ == false and bytes_ >= throttled_bytes_ ) {
+    acted_ = true;
+    return COARSEN;
+  }
+  // 次のステップも同じ割合で増えると予算を超えるなら、停止する。
+  if( bytes_*std::max( growth_, 1.0 ) > budget_ ) return ESCAPE;
+  if( soft == false ) return NONE;
+
+  if( MEMORY_POLICY == 2 ) {
+    // 使用量が前回より１割増えるごとに、マップの出力間隔を倍にする。
+    if( bytes_ < throttled_bytes_ ) return NONE;
+    if( snapshot_interval_ < MAX_STEP ) snapshot_interval_ *= 2;
+    throttled_bytes_ = bytes_ + bytes_/10;
+    acted_ = true;
+    return THROTTLE;
+  }
+  return NONE;
+}
+
+/*
+ * StopCondition
+ */
+StopCondition::StopCondition() : reason_(NULL), cancer_appeared_(false), count_(0) {
+  normal_.assign( 2*STEADY_STATE_WINDOW, 0 );
+  cancer_.assign( 2*STEADY_STATE_WINDOW, 0 );
+  normal_sum_[0] = normal_sum_[1] = 0;
+  cancer_sum_[0] = cancer_sum_[1] = 0;
+}
+
+bool StopCondition::check( CellStatistics& statistics ) {
+  int normalsize = statistics.normalSize();
+  int cancersize = statistics.cancerSize();
+  if( cancersize > 0 ) cancer_appeared_ = true;
+
+  if( STOP_ON_EXTINCTION and normalsize + cancersize == 0 ) {
+    reason_ = "extinction"; return true;
+  }
+  if( STOP_ON_CANCER_EXTINCTION and cancer_appeared_ and cancersize == 0 ) {
+    reason_ = "cancer_extinction"; return true;
+  }
+  if( STOP_CELL_SIZE_CAP > 0 and normalsize + cancersize > STOP_CELL_SIZE_CAP ) {
+    reason_ = "cell_size_cap"; return true;
+  }
+
+  if( STEADY_STATE_WINDOW <= 0 ) return false;
+  if( StepKeeper::Instance().step() < MUTATION_START_STEP ) return false;
+
+  // リングバッファで、２つの窓の和をずらしていく。
+  // 位置 k に直近の値を書くと、k の古い値は１つ前の窓から抜け、
+  // k+窓幅 の値は直近の窓から１つ前の窓に移る。
+  const int W = std::max( STEADY_STATE_WINDOW, 1 );
+  int k = count_%( 2*W );
+  int m = ( k + W )%( 2*W );
+  normal_sum_[0] += normal_[m] - normal_[k];
+  cancer_sum_[0] += cancer_[m] - cancer_[k];
+  normal_sum_[1] += normalsize - normal_[m];
+  cancer_sum_[1] += cancersize - cancer_[m];
+  normal_[k] = normalsize;
+  cancer_[k] = cancersize;
+  count_++;
+
+  if( count_ >= 2*W and isSteady() ) {
+    reason_ = "steady_state"; return true;
+  }
+  return false;
+}
+
+bool StopCondition::isSteady() const {
+  const double W = std::max( STEADY_STATE_WINDOW, 1 );
+  double normal_prev = normal_sum_[0]/W, normal_last = normal_sum_[1]/W;
+  double cancer_prev = cancer_sum_[0]/W, cancer_last = cancer_sum_[1]/W;
+  return std::abs( normal_last - normal_prev )
+      <= STEADY_STATE_TOLERANCE*std::max( 1.0, ( normal_last + normal_prev )/2 )
+    && std::abs( cancer_last - cancer_prev )
+      <= STEADY_STATE_TOLERANCE*std::max( 1.0, ( cancer_last + cancer_prev )/2 );
+}
+
+/*
+ * GifWriter
+ */
+GifWriter::GifWriter() : width_(0), height_(0), delay_(0) { }
+GifWriter::~GifWriter() { close(); }
+
+void GifWriter::color( int index, unsigned char rgb[3] ) {
+  // rgbformulae 7,5,15 (sqrt(x), x^3, sin(360x))
+  double x = index/255.0;
+  double b = sin( 2*M_PI*x );
+  rgb[0] = (unsigned char)( 255*sqrt(x) );
+  rgb[1] = (unsigned char)( 255*x*x*x );
+  rgb[2] = (unsigned char)( b > 0 ? 255*b : 0 );
+}
+
+bool GifWriter::open( const char *fname, int width, int height, int delay ) {
+  ofs_.open( fname, std::ios_base::out | std::ios_base::binary );
+  if( !ofs_ ) return false;
+  width_ = width; height_ = height; delay_ = delay;
+
+  unsigned char screen[] = {
+    'G', 'I', 'F', '8', '9', 'a',
+    (unsigned char)(width&0xff), (unsigned char)(width>>8),
+    (unsigned char)(height&0xff), (unsigned char)(height>>8),
+    0xf7, 0, 0 };  // 256色のグローバルパレット
+  ofs_.write( (const char *)screen, sizeof(screen) );
+  FOR( i, 256 ) {
+    unsigned char rgb[3];
+    color( i, rgb );
+    ofs_.write( (const char *)rgb, 3 );
+  }
+  // 繰り返し再生する
+  unsigned char loop[] = { 0x21, 0xff, 0x0b,
+    'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0',
+    0x03, 0x01, 0, 0, 0 };
+  ofs_.write( (const char *)loop, sizeof(loop) );
+  return true;
+}
+
+void GifWriter::writeFrame( const VECTOR(unsigned char)& compressed ) {
+  unsigned char control[] = { 0x21, 0xf9, 0x04, 0x00,
+    (unsigned char)(delay_&0xff), (unsigned char)(delay_>>8), 0, 0 };
+  ofs_.write( (const char *)control, sizeof(control) );
+  unsigned char descriptor[] = { 0x2c, 0, 0, 0, 0,
+    (unsigned char)(width_&0xff), (unsigned char)(width_>>8),
+    (unsigned char)(height_&0xff), (unsigned char)(height_>>8), 0,
+    8 };  // LZWの最小コード長
+  ofs_.write( (const char *)descriptor, sizeof(descriptor) );
+  ofs_.write( (const char *)&compressed[0], compressed.size() );
+}
+
+void GifWriter::close() {
+  if( ofs_.is_open() == false ) return;
+  ofs_.put( 0x3b );
+  ofs_.close();
+}
+
+void GifWriter::compress( const unsigned char *pixels, int size, Dictionary& dictionary,
+    VECTOR(unsigned char)& out ) {
+  const int MIN_CODE_SIZE = 8;
+  const int CLEAR_CODE = 1<<MIN_CODE_SIZE;
+  const int MAX_CODE = 4095;
+
+  VECTOR(unsigned char) data;
+  unsigned int bits = 0;
+  int bit_size = 0;
+  int code_size = MIN_CODE_SIZE + 1;
+  int max_code = CLEAR_CODE + 1;
+
+  // LSBから詰めていく
+  #define GIF_WRITE_CODE(code, length) do { \
+    bits |= (unsigned int)(code) << bit_size; bit_size += (length); \
+    while( bit_size >= 8 ) { data.push_back( bits&0xff ); bits >>= 8; bit_size -= 8; } \
+  } while(0)
+
+  GIF_WRITE_CODE( CLEAR_CODE, code_size );
+  int current = -1;
+  FOR( i, size ) {
+    int value = pixels[i];
+    if( current < 0 ) { current = value; continue; }
+    int next = dictionary.child( current, value );
+    if( next ) { current = next; continue; }
+
+    GIF_WRITE_CODE( current, code_size );
+    dictionary.add( current, value, ++max_code );
+    if( max_code >= (1<<code_size) ) code_size++;
+    if( max_code == MAX_CODE ) {
+      GIF_WRITE_CODE( CLEAR_CODE, code_size );
+      dictionary.clear();
+      code_size = MIN_CODE_SIZE + 1;
+      max_code = CLEAR_CODE + 1;
+    }
+    current = value;
+  }
+  GIF_WRITE_CODE( current, code_size );
+  // 復号側は最後のコードを読んだ時点で辞書を１つ増やすので、コード長を合わせる。
+  if( max_code + 1 >= (1<<code_size) and code_size < 12 ) code_size++;
+  GIF_WRITE_CODE( CLEAR_CODE, code_size );
+  GIF_WRITE_CODE( CLEAR_CODE + 1, MIN_CODE_SIZE + 1 );
+  if( bit_size > 0 ) data.push_back( bits&0xff );
+  dictionary.clear();
+
+  // 255バイトごとのサブブロックに分ける。
+  out.clear();
+  for( size_t k = 0; k < data.size(); k += 255 ) {
+    int length = std::min( (int)( data.size() - k ), 255 );
+    out.push_back( length );
+    out.insert( out.end(), data.begin() + k, data.begin() + k + length );
+  }
+  out.push_back( 0 );
+  #undef GIF_WRITE_CODE
+}
+
+/*
+ * AnimationRenderer
+ */
+AnimationRenderer::AnimationRenderer() : first_size_(0), last_size_(0), last_step_(0) {
+  // gnuplotの出力と同じく、200x200程度の大きさにする。
+  scale_ = std::max( 1, 200/std::max( SNAPSHOT_WIDTH, SNAPSHOT_HEIGHT ) );
+  if( NATIVE_RENDER == false ) return;  // 使わないならフレームを確保しない
+  FOR( k, MAP_KIND_SIZE ) {
+    first_[k].resize( ANIMATION_FRAME_SIZE*SITE_SIZE );
+    last_[k].resize( ANIMATION_FRAME_SIZE*SITE_SIZE );
+  }
+}
+
+size_t AnimationRenderer::allocatedBytes() const {
+  size_t bytes = 0;
+  FOR( k, MAP_KIND_SIZE ) { bytes += first_[k].capacity() + last_[k].capacity(); }
+  return bytes;
+}
+
+unsigned char *AnimationRenderer::frame( MapKind kind ) {
+  // 最初のフレームを埋めてから、最後のフレームのリングに入れる。
+  int step = StepKeeper::Instance().step();
+  if( step <= ANIMATION_FRAME_SIZE ) {
+    return &first_[kind][ (step-1)*SITE_SIZE ];
+  }
+  return &last_[kind][ (step%ANIMATION_FRAME_SIZE)*SITE_SIZE ];
+}
+
+void AnimationRenderer::record( MapKind kind, const double *values ) {
+  int step = StepKeeper::Instance().step();
+  if( step <= 0 ) return;
+  unsigned char *grid = frame( kind );
+  FOR( k, SITE_SIZE ) {
+    double v = std::min( std::max( values[k], 0.0 ), (double)MAX_VALUE );
+    grid[k] = (unsigned char)( 255*v/MAX_VALUE );
+  }
+  if( step != last_step_ ) {
+    last_step_ = step;
+    if( step <= ANIMATION_FRAME_SIZE ) first_size_ = step;
+    else last_size_ = std::min( last_size_ + 1, ANIMATION_FRAME_SIZE );
+  }
+}
+
+void AnimationRenderer::recordCounts( MapKind kind, VECTOR(double)& counts ) {
+  if( SNAPSHOT_SHRINK > 1 ) {
+    FOR( k, SITE_SIZE ) { counts[k] /= snapshot_area( k ); }
+  }
+  record( kind, &counts[0] );
+}
+
+void AnimationRenderer::recordCells( VECTOR(Cell *)& cells ) {
+  VECTOR(double) normal( SITE_SIZE, 0 ), cancer( SITE_SIZE, 0 ), all( SITE_SIZE, 0 );
+  EACH( it_cell, cells ) {
+    Cell& cell = **it_cell;
+    int k = ( cell.y()/SNAPSHOT_SHRINK )*SNAPSHOT_WIDTH + cell.x()/SNAPSHOT_SHRINK;
+    all[k]++;
+    if( cell.isNormalCell() ) normal[k]++;
+    else cancer[k]++;
+  }
+  recordCounts( CELL, all );
+  recordCounts( NORMALCELL, normal );
+  recordCounts( CANCERCELL, cancer );
+}
+
+void AnimationRenderer::recordCells( CellPopulation& population ) {
+  TiledGrid<int> all, normal, cancer;
+  population.siteCounts( all, normal, cancer );
+  VECTOR(double) values;
+  shrink_tiled_map( all, values, false );
+  record( CELL, &values[0] );
+  shrink_tiled_map( normal, values, false );
+  record( NORMALCELL, &values[0] );
+  shrink_tiled_map( cancer, values, false );
+  record( CANCERCELL, &values[0] );
+}
+
+void AnimationRenderer::recordTcells( TcellRing& tcells ) {
+  VECTOR(double) counts( SITE_SIZE, 0 );
+  FOR( b, TCELL_LIFESPAN ) {
+    EACH( it_tcell, tcells.bucket(b) ) {
+      counts[ ( (*it_tcell)->y()/SNAPSHOT_SHRINK )*SNAPSHOT_WIDTH + (*it_tcell)->x()/SNAPSHOT_SHRINK ]++;
+    }
+  }
+  recordCounts( TCELL, counts );
+}
+
+void AnimationRenderer::recordScapes( GlucoseScape& gs, OxygenScape& os ) {
+  // 立体では層の平均を描く。
+  VECTOR(double) layers, glucose( SITE_SIZE, 0 ), oxygen( SITE_SIZE, 0 );
+  shrink_tiled_map( gs.map(), layers, true );
+  FOR( k, LAYERS*SITE_SIZE ) { glucose[ k%SITE_SIZE ] += layers[k]/LAYERS; }
+  shrink_tiled_map( os.map(), layers, true );
+  FOR( k, LAYERS*SITE_SIZE ) { oxygen[ k%SITE_SIZE ] += layers[k]/LAYERS; }
+  record( GLUCOSE, &glucose[0] );
+  record( OXYGEN, &oxygen[0] );
+}
+
+namespace {
+  // フレームの圧縮を分担するスレッドの引数
+  struct CompressJob {
+    const VECTOR(unsigned char) *grids;  // グリッドのフレーム
+    VECTOR(VECTOR(unsigned char)) *outputs;
+    VECTOR(int) *order;  // 書き出す順のフレーム番号
+    int thread_id;
+    int scale;
+  };
+
+  void *compress_frames( void *arg ) {
+    CompressJob& job = *(CompressJob *)arg;
+    const int width = SNAPSHOT_WIDTH*job.scale;
+    const int height = SNAPSHOT_HEIGHT*job.scale;
+    VECTOR(unsigned char) image( width*height );
+    GifWriter::Dictionary dictionary;  // フレームをまたいで使い回す
+    for( size_t n = job.thread_id; n < job.order->size(); n += THREAD_SIZE ) {
+      // グリッドを拡大して、上下を反転する（gnuplotのview mapと同じ向き）
+      const unsigned char *grid = &(*job.grids)[ (*job.order)[n]*SNAPSHOT_WIDTH*SNAPSHOT_HEIGHT ];
+      FOR( y, height ) {
+        const unsigned char *row = grid + ( SNAPSHOT_HEIGHT - 1 - y/job.scale )*SNAPSHOT_WIDTH;
+        FOR( x, width ) { image[ y*width + x ] = row[ x/job.scale ]; }
+      }
+      GifWriter::compress( &image[0], width*height, dictionary, (*job.outputs)[n] );
+    }
+    return NULL;
+  }
+}
+
+void AnimationRenderer::renderAnimation( MapKind kind, const char *prefix,
+    VECTOR(unsigned char)& frames, int size, int first ) {
+  static const char *TITLES[MAP_KIND_SIZE] = {
+    "cell", "normalcell", "cancercell", "tcell", "glucose", "oxygen" };
+  if( size <= 0 ) return;
+
+  VECTOR(int) order;
+  FOR( n, size ) { order.push_back( ( first + n )%ANIMATION_FRAME_SIZE ); }
+  VECTOR(VECTOR(unsigned char)) outputs( size );
+
+  // フレームを並列に圧縮する。
+  pthread_t threads[THREAD_SIZE];
+  CompressJob jobs[THREAD_SIZE];
+  FOR( t, THREAD_SIZE ) {
+    jobs[t].grids = &frames; jobs[t].outputs = &outputs; jobs[t].order = &order;
+    jobs[t].thread_id = t; jobs[t].scale = scale_;
+    pthread_create( &threads[t], NULL, compress_frames, &jobs[t] );
+  }
+  FOR( t, THREAD_SIZE ) { pthread_join( threads[t], NULL ); }
+
+  char file_name[256];
+  sprintf( file_name, "%s%s-animation.gif", prefix, TITLES[kind] );
+  GifWriter gif;
+  if( gif.open( file_name, SNAPSHOT_WIDTH*scale_, SNAPSHOT_HEIGHT*scale_, 5 ) == false ) return;
+  EACH( it_output, outputs ) { gif.writeFrame( *it_output ); }
+  gif.close();
+
+  // 最後のフレームは静止画にもする。
+  if( *prefix ) {
+    renderImage( kind, &frames[ order.back()*SITE_SIZE ] );
+  }
+}
+
+void AnimationRenderer::renderImage( MapKind kind, const unsigned char *grid ) {
+  static const char *TITLES[MAP_KIND_SIZE] = {
+    "cell", "normalcell", "cancercell", "tcell", "glucose", "oxygen" };
+  char file_name[256];
+  sprintf( file_name, "last-%s.ppm", TITLES[kind] );
+  std::ofstream ofs( file_name, std::ios_base::out | std::ios_base::binary );
+  const int width = SNAPSHOT_WIDTH*scale_;
+  const int height = SNAPSHOT_HEIGHT*scale_;
+  ofs << "P6\n" << width << SEPARATOR << height << "\n255\n";
+  FOR( y, height ) {
+    const unsigned char *row = grid + ( SNAPSHOT_HEIGHT - 1 - y/scale_ )*SNAPSHOT_WIDTH;
+    FOR( x, width ) {
+      unsigned char rgb[3];
+      GifWriter::color( row[ x/scale_ ], rgb );
+      ofs.write( (const char *)rgb, 3 );
+    }
+  }
+}
+
+void AnimationRenderer::render() {
+  // 最後のフレームのリングは、最も古いフレームから書き出す。
+  int step = last_step_;
+  int last_first = ( step - last_size_ + 1 )%ANIMATION_FRAME_SIZE;
+  FOR( k, MAP_KIND_SIZE ) {
+    MapKind kind = (MapKind)k;
+    renderAnimation( kind, "", first_[k], first_size_, 0 );
+    renderAnimation( kind, "last-", last_[k], last_size_, last_first );
+  }
+}
+
+/*
+ * ThreadPool
+ */
+namespace {
+  __thread int thread_id = 0;  // スレッド番号
+}
+
+int ThreadPool::threadId() { return thread_id; }
+
+ThreadPool::ThreadPool() : task_(NULL), size_(0), generation_(0), running_(0), quit_(false) {
+  pthread_mutex_init( &mutex_, NULL );
+  pthread_cond_init( &start_, NULL );
+  pthread_cond_init( &done_, NULL );
+  REP( t, 1, THREAD_SIZE-1 ) {
+    workers_[t].pool = this;
+    workers_[t].id = t;
+    pthread_create( &threads_[t], NULL, work, &workers_[t] );
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock( &mutex_ );
+  quit_ = true;
+  pthread_cond_broadcast( &start_ );
+  pthread_mutex_unlock( &mutex_ );
+  REP( t, 1, THREAD_SIZE-1 ) { pthread_join( threads_[t], NULL ); }
+  pthread_cond_destroy( &done_ );
+  pthread_cond_destroy( &start_ );
+  pthread_mutex_destroy( &mutex_ );
+}
+
+void ThreadPool::run( ParallelTask& task, int n, int grain ) {
+  // 小さな仕事は分担しない。分担の仕方で結果は変わらない。
+  if( THREAD_SIZE == 1 || n < grain ) {
+    task.run( 0, n, 0 );
+    return;
+  }
+  pthread_mutex_lock( &mutex_ );
+  task_ = &task;
+  size_ = n;
+  running_ = THREAD_SIZE-1;
+  generation_++;
+  pthread_cond_broadcast( &start_ );
+  pthread_mutex_unlock( &mutex_ );
+
+  task.run( 0, n/THREAD_SIZE, 0 );
+
+  pthread_mutex_lock( &mutex_ );
+  while( running_ > 0 ) pthread_cond_wait( &done_, &mutex_ );
+  pthread_mutex_unlock( &mutex_ );
+}
+
+void *ThreadPool::work( void *arg ) {
+  Worker& worker = *(Worker *)arg;
+  ThreadPool& pool = *worker.pool;
+  thread_id = worker.id;
+  int generation = 0;
+  while( true ) {
+    pthread_mutex_lock( &pool.mutex_ );
+    while( pool.generation_ == generation && pool.quit_ == false ) {
+      pthread_cond_wait( &pool.start_, &pool.mutex_ );
+    }
+    if( pool.quit_ ) { pthread_mutex_unlock( &pool.mutex_ ); return NULL; }
+    generation = pool.generation_;
+    ParallelTask *task = pool.task_;
+    int n = pool.size_;
+    pthread_mutex_unlock( &pool.mutex_ );
+
+    long long begin = (long long)n*worker.id/THREAD_SIZE;
+    long long end = (long long)n*( worker.id + 1 )/THREAD_SIZE;
+    task->run( begin, end, worker.id );
+
+    pthread_mutex_lock( &pool.mutex_ );
+    if( --pool.running_ == 0 ) pthread_cond_signal( &pool.done_ );
+    pthread_mutex_unlock( &pool.mutex_ );
+  }
+}
+
+/*
+ * ParallelStepEngine
+ */
+namespace {
+  // 細胞分裂を分担する仕事
+  struct DivisionTask : public ParallelTask {
+    VECTOR(Cell *) *cells;
+    VECTOR(Cell *) new_cells[THREAD_SIZE];  // スレッドごとの娘細胞
+    VECTOR(long long) parent_ids[THREAD_SIZE];  // 娘細胞ごとの母細胞のID
+    typedef std::pair<long long, int> Mutation;  // (母細胞のID, 変わった位置) の組
+    VECTOR(Mutation) mutations[THREAD_SIZE];     // 突然変異した娘細胞（EVENT_LOG）
+    int normaldivisioncount[THREAD_SIZE];
+    int cancerdivisioncount[THREAD_SIZE];
+    int mutationcount[THREAD_SIZE];
+
+    DivisionTask() {
+      FOR( t, THREAD_SIZE ) {
+        normaldivisioncount[t] = cancerdivisioncount[t] = mutationcount[t] = 0;
+      }
+    }
+
+    virtual void run( int begin, int end, int thread ) {
+      int step = StepKeeper::Instance().step();
+      for( int k = begin; k < end; k++ ) {
+        Cell& origincell = *(*cells)[k];
+        RandomStream random( step, origincell.id(), RandomStream::DIVISION );
+
+        // 分裂不可能ならスキップする。
+        if( origincell.willDvision( random ) == false ) {
+          continue;
+        }
+
+        ENERGY origin_energy = origincell.energy();
+        if( origin_energy > CELL_DIVISION_THRESHOLD_ENERGY ) {
+          Cell *newcell = new Cell();
+
+          // 同じ位置に分裂する。
+          int newx = origincell.x(); int newy = origincell.y();
+          newcell->setLocation( newx, newy, origincell.z() );
+
+          // 遺伝子配列を同じにする。
+          // がん細胞からはがん細胞が分裂する。
+          // 正常細胞からは、がん細胞が分裂する可能性がある
+          newcell->setGene( origincell.gene() );
+          newcell->setLineage( origincell.lineage() );
+          if( origincell.isNormalCell() ) {
+            normaldivisioncount[thread]++;
+          } else {
+            cancerdivisioncount[thread]++;
+          }
+
+          // 突然変異する
+          if( step >= MUTATION_START_STEP ) {
+            RandomStream mutation( step, origincell.id(), RandomStream::MUTATION );
+            if( newcell->mutateGene( CELL_MUTATION_RATE, mutation ) ) {
+              mutationcount[thread]++;  // 突然変異をしたらカウントする
+              if( EVENT_LOG ) {
+                const GENE& gene = origincell.gene();
+                int locus = std::mismatch( gene.begin(), gene.end(), newcell->gene().begin() ).first - gene.begin();
+                mutations[thread].push_back( std::make_pair( origincell.id(), locus ) );
+              }
+            }
+          }
+
+          // 半分にエネルギーを分ける。
+          newcell->setEnergy( origin_energy / 2 );
+          origincell.setEnergy( origin_energy / 2 );
+
+          new_cells[thread].push_back( newcell );
+          parent_ids[thread].push_back( origincell.id() );
+          origincell.incrementDivisionCount();  // 分裂回数を増やす。
+        }
+      }
+    }
+  };
+
+  // 代謝を位置ごとに分担する仕事
+  struct MetabolismTask : public ParallelTask {
+    VECTOR(Cell *) *site_order;
+    VECTOR(int) *site_start;
+    GlucoseScape *gs;
+    OxygenScape *os;
+
+    virtual void run( int begin, int end, int thread ) {
+      int step = StepKeeper::Instance().step();
+      for( int k = (*site_start)[begin]; k < (*site_start)[end]; k++ ) {
+        Cell& cell = *(*site_order)[k];
+        RandomStream random( step, cell.id(), RandomStream::METABOLISM );
+        cell.metabolize( *gs, *os, random );
+      }
+    }
+  };
+
+  // 遺伝子の長さを固定した、免疫の認識の判定のループ
+  template < int L >
+  struct ImmuneKernel {
+    static void run( Cell **cells, Tcell **killers, TcellMap& tcellmap,
+        int begin, int end, int step, int gene_length ) {
+      for( int k = begin; k < end; k++ ) {
+        Cell& cell = *cells[k];
+        killers[k] = NULL;
+
+        // がん細胞であれば、
+        // T細胞によって排除されるか判定される
+        // 既に殺傷されている最中なら、他のT細胞は認識しない。
+        const char *gene = cell.gene().data();
+        int value = GeneKernel<L>::value( gene, gene_length );
+        if( value <= 0 or cell.isEngaged() ) continue;
+        const VECTOR(Tcell *)& tcells = tcellmap.tcellsAt( cell.y(), cell.x(), cell.z() );
+        if( tcells.empty() ) continue;
+
+        RandomStream random( step, cell.id(), RandomStream::IMMUNE );
+        double immunogenicity = GeneKernel<L>::immunogenicity( value, gene_length );
+        EACH( it_tcell, tcells ) {
+          Tcell& tcell = **it_tcell;
+
+          // 免疫原性の確率で、
+          // 遺伝子配列が一致していれば、
+          // 除去する。
+          if( random.probability( immunogenicity )
+              and GeneKernel<L>::match( gene, tcell.gene().data(), gene_length ) ) {
+            killers[k] = &tcell;
+            break;
+          }
+        }
+      }
+    }
+  };
+
+  // 免疫による除去の判定を分担する仕事
+  struct ImmuneTask : public ParallelTask {
+    VECTOR(Cell *) *cells;
+    VECTOR(Tcell *) *killers;
+    TcellMap *tcellmap;
+
+    virtual void run( int begin, int end, int thread ) {
+      ModelKernels::Instance().immune( &(*cells)[0], &(*killers)[0], *tcellmap,
+          begin, end, StepKeeper::Instance().step(), CELL_GENE_LENGTH );
+    }
+  };
+}
+
+void ParallelStepEngine::divide( VECTOR(Cell *)& cells, int& normaldivisioncount,
+    int& cancerdivisioncount, int& mutationcount ) {
+  DivisionTask task;
+  task.cells = &cells;
+  pool_.run( task, cells.size() );
+
+  // スレッドの順に結合すれば、元の配列順になる。
+  births_.clear();
+  mutations_.clear();
+  FOR( t, THREAD_SIZE ) {
+    mutations_.insert( mutations_.end(), task.mutations[t].begin(), task.mutations[t].end() );
+    FOR( i, (int)task.new_cells[t].size() ) {
+      births_.push_back( std::make_pair( task.parent_ids[t][i], task.new_cells[t][i] ) );
+    }
+    normaldivisioncount += task.normaldivisioncount[t];
+    cancerdivisioncount += task.cancerdivisioncount[t];
+    mutationcount += task.mutationcount[t];
+  }
+  // IDは母細胞のIDの順に振る。並べ直していなければ、配列順と同じ。
+  inIdOrder( births_ );
+  inIdOrder( mutations_ );
+
+  CellStatistics& statistics = CellStatistics::Instance();
+  size_t m = 0;
+  EACH( it_birth, births_ ) {
+    Cell *newcell = it_birth->second;
+    newcell->assignId();
+    cells.push_back( newcell ); // 配列に加える。
+    statistics.born( *newcell );
+    if( LINEAGE_TRACKING ) { LineageTracker::Instance().born( *newcell ); }
+    if( EVENT_LOG ) {
+      // 母細胞は１ステップに１回しか分裂しないので、母細胞のIDで対応がつく。
+      EventLog::Instance().divided( it_birth->first, *newcell );
+      if( m < mutations_.size() and mutations_[m].first == it_birth->first ) {
+        EventLog::Instance().mutated( *newcell, mutations_[m++].second );
+      }
+    }
+  }
+}
+
+void ParallelStepEngine::metabolize( VECTOR(Cell *)& cells, GlucoseScape& gs, OxygenScape& os ) {
+  // 位置ごとに、配列順を保ったまま並べ替える。
+  // 格子全体ではなく、細胞のいる位置だけを扱う。
+  // 位置の間の順は結果に影響しないので、配列を並べ直したときと同じ空間順にする。
+  int n = cells.size();
+  order_.arrange( cells, site_order_ );
+  site_start_.clear();
+  FOR( k, n ) {
+    if( k == 0 || site_order_[k]->x() != site_order_[k-1]->x()
+        || site_order_[k]->y() != site_order_[k-1]->y()
+        || site_order_[k]->z() != site_order_[k-1]->z() ) {
+      site_start_.push_back( k );
+      // 並列に書き込む前に、タイルを確保しておく。
+      gs.prepare( site_order_[k]->x(), site_order_[k]->y(), site_order_[k]->z() );
+      os.prepare( site_order_[k]->x(), site_order_[k]->y(), site_order_[k]->z() );
+    }
+  }
+  int sites = site_start_.size();
+  site_start_.push_back( n );
+
+  // 位置の中はIDの順にする。並べ直していなければ、配列順と同じ。
+  FOR( s, sites ) {
+    for( int k = site_start_[s] + 1; k < site_start_[s+1]; k++ ) {
+      Cell *cell = site_order_[k];
+      int j = k;
+      for( ; j > site_start_[s] and site_order_[j-1]->id() > cell->id(); j-- ) {
+        site_order_[j] = site_order_[j-1];
+      }
+      site_order_[j] = cell;
+    }
+  }
+
+  MetabolismTask task;
+  task.site_order = &site_order_;
+  task.site_start = &site_start_;
+  task.gs = &gs;
+  task.os = &os;
+  pool_.run( task, sites );
+}
+
+size_t ParallelStepEngine::allocatedBytes() const {
+  return site_order_.capacity()*sizeof(Cell *) + site_start_.capacity()*sizeof(int)
+    + killers_.capacity()*sizeof(Tcell *) + births_.capacity()*sizeof(Birth)
+    + kills_.capacity()*sizeof(Kill) + mutations_.capacity()*sizeof(Mutation)
+    + contacts_.capacity()*sizeof(Contact) + due_.capacity()*sizeof(Tcell *)
+    + order_.allocatedBytes();
+}
+
+void ParallelStepEngine::release() {
+  VECTOR(Cell *)().swap( site_order_ );
+  VECTOR(int)().swap( site_start_ );
+  VECTOR(Tcell *)().swap( killers_ );
+  VECTOR(Birth)().swap( births_ );
+  VECTOR(Kill)().swap( kills_ );
+  VECTOR(Mutation)().swap( mutations_ );
+  VECTOR(Contact)().swap( contacts_ );
+  order_.release();
+}
+
+void ParallelStepEngine::reorder( VECTOR(Cell *)& cells, TcellRing& tcells ) {
+  if( order_.due( cells ) == false ) return;
+  order_.sort( cells );
+  order_.sort( tcells );
+}
+
+void ParallelStepEngine::removeDeadCells( VECTOR(Cell *)& cells ) {
+  CellStatistics& statistics = CellStatistics::Instance();
+  size_t alive = 0;
+  FOR( k, (int)cells.size() ) {
+    Cell& cell = *cells[k];
+    if( cell.willDie() ) {
+      statistics.died( cell );
+      if( LINEAGE_TRACKING ) { LineageTracker::Instance().died( cell ); }
+      if( EVENT_LOG ) { EventLog::Instance().died( cell ); }
+      SAFE_DELETE( cells[k] );
+    } else {
+      cells[alive++] = cells[k];
+    }
+  }
+  cells.resize( alive );
+}
+
+void ParallelStepEngine::removeByImmunity( VECTOR(Cell *)& cells, TcellMap& tcellmap,
+    VECTOR(Tcell *)& newtcells, TcellRing& tcells ) {
+  const bool multihit = CTL_KILLING_RATE > 0;
+  int step = StepKeeper::Instance().step();
+  due_.clear();
+  if( multihit ) tcells.unpark( step, due_ );
+
+  killers_.resize( cells.size() );
+  ImmuneTask task;
+  task.cells = &cells;
+  task.killers = &killers_;
+  task.tcellmap = &tcellmap;
+  pool_.run( task, cells.size() );
+
+  // 配列順に除去する。
+  // 殺傷を終えるT細胞の標的か、即座に殺傷するときは認識された細胞を除く。
+  CellStatistics& statistics = CellStatistics::Instance();
+  kills_.clear();
+  contacts_.clear();
+  size_t alive = 0;
+  FOR( k, (int)cells.size() ) {
+    Tcell *killer = killers_[k];
+    if( multihit and killer != NULL ) {
+      contacts_.push_back( std::make_pair( cells[k]->id(), Conjugate( cells[k], killer ) ) );
+      killer = NULL;
+    }
+    if( due_.empty() == false and cells[k]->isEngaged() ) {
+      VECTOR(Tcell *)::iterator it = std::lower_bound( due_.begin(), due_.end(), cells[k]->id(), lessTarget );
+      if( it != due_.end() and (*it)->target() == cells[k]->id() ) killer = *it;
+    }
+    if( killer != NULL ) {
+      kills_.push_back( std::make_pair( cells[k]->id(), killer ) );
+      statistics.killed( *cells[k] );
+      if( LINEAGE_TRACKING ) { LineageTracker::Instance().died( *cells[k] ); }
+      SAFE_DELETE( cells[k] );
+    } else {
+      cells[alive++] = cells[k];
+    }
+  }
+  cells.resize( alive );
+
+  // 除去された細胞のIDの順に、除去したT細胞を増やす。
+  inIdOrder( kills_ );
+  EACH( it_kill, kills_ ) {
+    if( EVENT_LOG ) { EventLog::Instance().killed( it_kill->first, *it_kill->second ); }
+    newtcells.push_back( &it_kill->second->clone() );
+    it_kill->second->addKill();
+  }
+  if( multihit == false ) return;
+
+  // 殺傷を終えたT細胞は自由に戻る。疲弊したか、寿命を過ぎていれば除く。
+  // 標的が先に死んでいたら、殺傷の回数には数えない。
+  EACH( it_tcell, due_ ) {
+    Tcell *tcell = *it_tcell;
+    tcell->release();
+    bool removed = tcell->kills() >= CTL_MAX_KILLS or tcell->age() >= TCELL_LIFESPAN;
+    if( EVENT_LOG ) { EventLog::Instance().released( *tcell, removed ); }
+    if( removed ) {
+      SAFE_DELETE( tcell );
+    } else {
+      tcells.push( tcell );
+    }
+  }
+
+  // 認識された細胞のIDの順に、殺傷を始める。
+  // 同じT細胞が同じステップに２つの細胞を認識したら、IDの小さい方だけを殺傷する。
+  // 殺傷にかかるステップ数は、確率 CTL_KILLING_RATE の幾何分布にする。
+  inIdOrder( contacts_ );
+  EACH( it_contact, contacts_ ) {
+    Cell *cell = it_contact->second.first;
+    Tcell *tcell = it_contact->second.second;
+    if( tcell->isEngaged() ) continue;
+    int duration = 1;
+    if( CTL_KILLING_RATE < 1 ) {
+      double u = RandomStream( step, tcell->id(), RandomStream::IMMUNE ).randomDouble();
+      duration += (int)( log( u )/log( 1 - CTL_KILLING_RATE ) );
+    }
+    tcell->engage( cell->id() );
+    cell->setEngaged( true );
+    if( EVENT_LOG ) { EventLog::Instance().engaged( *tcell ); }
+    tcells.park( tcell, step + duration );
+  }
+  tcells.removeParked();
+}
+
+/*
+ * SpatialOrder
+ */
+SpatialOrder::SpatialOrder() {
+  side_ = 1; key_bits_ = 0;
+  while( side_ < std::max( std::max( WIDTH, HEIGHT ), LAYERS ) ) { side_ *= 2; key_bits_ += DIMENSION; }
+  block_shift_ = 0;
+  for( int s = 1; s < TILE_SIZE and block_shift_ < key_bits_; s *= 2 ) { block_shift_ += DIMENSION; }
+}
+
+unsigned int SpatialOrder::key( int x, int y, int z ) const {
+  if( DIMENSION == 3 ) {
+    // 立体の Morton 順。x, y, z のビットを２つおきに並べる。（一辺 1024 まで）
+    unsigned int b[3] = { (unsigned int)x, (unsigned int)y, (unsigned int)z };
+    FOR( a, 3 ) {
+      b[a] = ( b[a] | ( b[a]<<16 ) )&0x030000ff;
+      b[a] = ( b[a] | ( b[a]<<8 ) )&0x0300f00f;
+      b[a] = ( b[a] | ( b[a]<<4 ) )&0x030c30c3;
+      b[a] = ( b[a] | ( b[a]<<2 ) )&0x09249249;
+    }
+    return b[0] | ( b[1]<<1 ) | ( b[2]<<2 );
+  }
+  if( SPACE_FILLING_CURVE == 1 ) {
+    // Hilbert 順。象限ごとに向きを回しながら降りていく。
+    unsigned int d = 0;
+    for( int s = side_/2; s > 0; s /= 2 ) {
+      int rx = ( x&s ) > 0;
+      int ry = ( y&s ) > 0;
+      d += (unsigned int)s*s*( ( 3*rx )^ry );
+      if( ry == 0 ) {
+        if( rx == 1 ) { x = side_-1 - x; y = side_-1 - y; }
+        std::swap( x, y );
+      }
+    }
+    return d;
+  }
+  // Morton 順。x と y のビットを交互に並べる。
+  unsigned int bx = x, by = y;
+  bx = ( bx | ( bx<<8 ) )&0x00ff00ff; by = ( by | ( by<<8 ) )&0x00ff00ff;
+  bx = ( bx | ( bx<<4 ) )&0x0f0f0f0f; by = ( by | ( by<<4 ) )&0x0f0f0f0f;
+  bx = ( bx | ( bx<<2 ) )&0x33333333; by = ( by | ( by<<2 ) )&0x33333333;
+  bx = ( bx | ( bx<<1 ) )&0x55555555; by = ( by | ( by<<1 ) )&0x55555555;
+  return bx | ( by<<1 );
+}
+
+bool SpatialOrder::due( VECTOR(Cell *)& cells ) {
+  int step = StepKeeper::Instance().step();
+  if( REORDER_INTERVAL > 0 and step%REORDER_INTERVAL == 0 ) return true;
+  if( REORDER_DISORDER > 0 and disorder( cells ) > REORDER_DISORDER ) return true;
+  return false;
+}
+
+void SpatialOrder::sort( TcellRing& tcells ) {
+  FOR( k, TCELL_LIFESPAN ) { sort( tcells.bucket(k) ); }
+}
+
+void SpatialOrder::arrange( const VECTOR(Cell *)& cells, VECTOR(Cell *)& sorted ) {
+  int n = cells.size();
+  keys_.resize( n ); items_.resize( n );
+  FOR( i, n ) {
+    keys_[i] = key( cells[i]->x(), cells[i]->y(), cells[i]->z() );
+    items_[i] = cells[i];
+  }
+  radixSort();
+  sorted.resize( n );
+  FOR( i, n ) { sorted[i] = static_cast<Cell *>( items_[i] ); }
+}
+
+bool SpatialOrder::radixSort() {
+  int n = keys_.size();
+  bool sorted = true;
+  for( int i = 1; i < n and sorted; i++ ) { sorted = keys_[i-1] <= keys_[i]; }
+  if( sorted ) return false;
+
+  key_buffer_.resize( n ); item_buffer_.resize( n );
+  for( int shift = 0; shift < key_bits_; shift += 8 ) {
+    int count[257] = {};
+    FOR( i, n ) { count[ ( ( keys_[i]>>shift )&0xff ) + 1 ]++; }
+    // 全て同じ桁なら、この回は順が変わらない。
+    if( count[ ( ( keys_[0]>>shift )&0xff ) + 1 ] == n ) continue;
+    FOR( b, 256 ) { count[b+1] += count[b]; }
+    FOR( i, n ) {
+      int to = count[ ( keys_[i]>>shift )&0xff ]++;
+      key_buffer_[to] = keys_[i];
+      item_buffer_[to] = items_[i];
+    }
+    keys_.swap( key_buffer_ );
+    items_.swap( item_buffer_ );
+  }
+  return true;
+}
+
+/*
+ * CellPopulation
+ */
+bool CellPopulation::less( const CellClass& a, const CellClass& b ) {
+  if( a.z != b.z ) return a.z < b.z;
+  if( a.y != b.y ) return a.y < b.y;
+  if( a.x != b.x ) return a.x < b.x;
+  if( a.birth != b.birth ) return a.birth < b.birth;
+  if( a.gene != b.gene ) return a.gene < b.gene;
+  if( a.energy != b.energy ) return a.energy < b.energy;
+  return a.division < b.division;
+}
+
+bool CellPopulation::same( const CellClass& a, const CellClass& b ) {
+  return a.x == b.x and a.y == b.y and a.z == b.z and a.gene == b.gene
+    and a.energy == b.energy and a.division == b.division and a.birth == b.birth;
+}
+
+bool CellPopulation::lessCell( Cell *a, Cell *b ) {
+  if( a->z() != b->z() ) return a->z() < b->z();
+  if( a->y() != b->y() ) return a->y() < b->y();
+  if( a->x() != b->x() ) return a->x() < b->x();
+  if( a->gene() != b->gene() ) return a->gene() < b->gene();
+  if( a->energy() != b->energy() ) return a->energy() < b->energy();
+  return a->divisionCount() < b->divisionCount();
+}
+
+size_t CellPopulation::estimateBytes( const VECTOR(Cell *)& cells ) {
+  // 細胞の組の比べ方は absorb で分類をまとめるときと同じ。
+  VECTOR(Cell *) sorted( cells.begin(), cells.end() );
+  std::sort( sorted.begin(), sorted.end(), lessCell );
+  size_t classes = 0;
+  FOR( k, (int)sorted.size() ) {
+    if( k > 0 and lessCell( sorted[k-1], sorted[k] ) == false ) continue;
+    classes++;
+  }
+  return classes*sizeof(CellClass)*( 1 + ( DIMENSION == 3 ? 9 : 3 ) );
+}
+
+void CellPopulation::merge( size_t sorted ) {
+  // 先頭の sorted 個は並んでいるので、後から加えた分類だけを並べて併合する。
+  std::sort( classes_.begin() + sorted, classes_.end(), less );
+  std::inplace_merge( classes_.begin(), classes_.begin() + sorted, classes_.end(), less );
+  size_t n = 0;
+  FOR( k, (int)classes_.size() ) {
+    if( classes_[k].count <= 0 ) continue;
+    if( n > 0 and same( classes_[n-1], classes_[k] ) ) {
+      classes_[n-1].count += classes_[k].count;
+    } else {
+      classes_[n++] = classes_[k];
+    }
+  }
+  classes_.resize( n );
+}
+
+Cell& CellPopulation::prototype( const CellClass& c ) {
+  prototype_.setGene( c.gene );
+  prototype_.setEnergy( c.energy );
+  return prototype_;
+}
+
+int CellPopulation::binomial( int n, double p ) {
+  if( n <= 0 or p <= 0 ) return 0;
+  if( p >= 1 ) return n;
+  std::binomial_distribution<int> distribution( n, p );
+  return distribution( engine_ );
+}
+
+void CellPopulation::absorb( VECTOR(Cell *)& cells ) {
+  // 乱数の種から、集約表現用の乱数列を作る。
+  engine_.seed( RandomStream( 0, -1, RandomStream::MOVE ).next() );
+  EACH( it_cell, cells ) {
+    Cell& cell = **it_cell;
+    CellClass c = { cell.x(), cell.y(), cell.z(), cell.gene(), cell.energy(), cell.divisionCount(), 0, 1 };
+    classes_.push_back( c );
+    SAFE_DELETE( *it_cell );
+  }
+  cells.clear();
+  merge();
+  classes_.shrink_to_fit();
+}
+
+void CellPopulation::move() {
+  // 各軸は、1/4 で -1、1/2 で 0、1/4 で +1 動く。（RandomWalkKernel と同じ）
+  // 平面では z方向には分けないので、乱数の引き方は変わらない。
+  VECTOR(CellClass) moved;
+  moved.reserve( classes_.size()*( DIMENSION == 3 ? 9 : 3 ) );
+  EACH( it_class, classes_ ) {
+    int rest_x = it_class->count;
+    FOR( a, 3 ) {
+      // x方向の移動量ごとに分ける。
+      int nx = a == 0 ? binomial( rest_x, 0.25 ) : a == 1 ? binomial( rest_x, 1.0/3 ) : rest_x;
+      rest_x -= nx;
+      int dx = a == 0 ? -1 : a == 1 ? 1 : 0;
+      int rest_y = nx;
+      FOR( b, 3 ) {
+        int ny = b == 0 ? binomial( rest_y, 0.25 ) : b == 1 ? binomial( rest_y, 1.0/3 ) : rest_y;
+        rest_y -= ny;
+        if( ny == 0 ) continue;
+        int dy = b == 0 ? -1 : b == 1 ? 1 : 0;
+        int rest_z = ny;
+        FOR( e, DIMENSION == 3 ? 3 : 1 ) {
+          int nz = DIMENSION != 3 || e == 2 ? rest_z : e == 0 ? binomial( rest_z, 0.25 ) : binomial( rest_z, 1.0/3 );
+          rest_z -= nz;
+          if( nz == 0 ) continue;
+          int dz = DIMENSION != 3 ? 0 : e == 0 ? -1 : e == 1 ? 1 : 0;
+          CellClass c = *it_class;
+          c.count = nz;
+          int to_x = c.x + dx; int to_y = c.y + dy; int to_z = c.z + dz;
+          int distance = abs( dx ) + abs( dy ) + abs( dz );
+          if( BOUNDARY_CONDITION == 1 ) {
+            c.x = ( to_x + WIDTH )%WIDTH;
+            c.y = ( to_y + HEIGHT )%HEIGHT;
+            c.z = ( to_z + LAYERS )%LAYERS;
+          } else if( 0 <= to_x and to_x < WIDTH and 0 <= to_y and to_y < HEIGHT
+              and 0 <= to_z and to_z < LAYERS ) {
+            c.x = to_x; c.y = to_y; c.z = to_z;
+          } else {
+            distance = 0;  // 壁の外に出る場合は移動しない。
+          }
+          c.energy -= distance * MOTILITY_WEIGHT;
+          moved.push_back( c );
+        }
+      }
+    }
+  }
+  classes_.swap( moved );
+  merge();
+}
+
+void CellPopulation::divide( int& normaldivisioncount, int& cancerdivisioncount, int& mutationcount ) {
+  const int step = StepKeeper::Instance().step();
+  const bool mutation = step >= MUTATION_START_STEP;
+  int size = classes_.size();
+  FOR( k, size ) {
+    CellClass origin = classes_[k];
+    if( origin.energy <= CELL_DIVISION_THRESHOLD_ENERGY ) continue;
+    bool normal = prototype( origin ).isNormalCell();
+    double prob = normal ? ( origin.division < MAX_CELL_DIVISION_COUNT ? NORMALCELL_DIVISION_PROB : 0 )
+      : CANCERCELL_DIVISION_PROB;
+    int divided = binomial( origin.count, prob/100 );
+    if( divided == 0 ) continue;
+    if( normal ) normaldivisioncount += divided;
+    else cancerdivisioncount += divided;
+
+    // 分裂した細胞は、分裂回数が増えてエネルギーが半分になる。
+    classes_[k].count -= divided;
+    CellClass parent = origin;
+    parent.count = divided;
+    parent.energy = origin.energy/2;
+    parent.division++;
+    classes_.push_back( parent );
+
+    // 娘細胞は、突然変異する位置ごとに分ける。
+    CellClass daughter = origin;
+    daughter.energy = origin.energy/2;
+    daughter.division = 0;
+    daughter.birth = step;
+    int rest = divided;
+    if( mutation ) {
+      int mutated = binomial( divided, CELL_MUTATION_RATE/100 );
+      rest -= mutated;
+      FOR( pos, CELL_GENE_LENGTH ) {
+        int n = pos == CELL_GENE_LENGTH-1 ? mutated : binomial( mutated, 1.0/( CELL_GENE_LENGTH - pos ) );
+        mutated -= n;
+        if( n == 0 ) continue;
+        CellClass c = daughter;
+        c.count = n;
+        if( c.gene[pos] == '0' ) {  // 0の時だけ1にする
+          c.gene[pos] = '1';
+          mutationcount += n;
+        }
+        classes_.push_back( c );
+      }
+    }
+    if( rest > 0 ) {
+      daughter.count = rest;
+      classes_.push_back( daughter );
+    }
+  }
+  merge( size );
+}
+
+void CellPopulation::metabolize( GlucoseScape& gs, OxygenScape& os ) {
+  // 位置ごとに、代謝を試みる細胞数を引いてから、古い順に資源を使わせる。
+  // 同じステップに生まれた細胞の中では、無作為な順にする。
+  VECTOR(CellClass) gained;
+  VECTOR(int) attempts;
+  VECTOR(int) successes;
+  VECTOR(char) normal;
+  size_t begin = 0;
+  while( begin < classes_.size() ) {
+    size_t end = begin;
+    while( end < classes_.size() and classes_[end].x == classes_[begin].x
+        and classes_[end].y == classes_[begin].y and classes_[end].z == classes_[begin].z ) end++;
+    int x = classes_[begin].x; int y = classes_[begin].y; int z = classes_[begin].z;
+
+    attempts.assign( end - begin, 0 );
+    successes.assign( end - begin, 0 );
+    normal.assign( end - begin, 0 );
+    for( size_t k = begin; k < end; k++ ) {
+      normal[k-begin] = prototype( classes_[k] ).isNormalCell();
+      double prob = normal[k-begin] ? NORMALCELL_METABOLIZE_PROB : CANCERCELL_METABOLIZE_PROB;
+      attempts[k-begin] = binomial( classes_[k].count, prob/100 );
+    }
+
+    MATERIAL g = gs.glucose( x, y, z );
+    MATERIAL o = os.oxygen( x, y, z );
+    bool changed = false;
+    // 分類は位置の中で生まれた順に並んでいるので、同じステップに生まれた組ごとに進める。
+    size_t group = 0;
+    while( group < end - begin ) {
+      size_t group_end = group;
+      long long normal_attempts = 0, cancer_attempts = 0;
+      while( group_end < end - begin and classes_[begin + group_end].birth == classes_[begin + group].birth ) {
+        ( normal[group_end] ? normal_attempts : cancer_attempts ) += attempts[group_end];
+        group_end++;
+      }
+      while( true ) {
+        // 資源が足りずに失敗する種類の試行は、順番を飛ばしても結果は変わらない。
+        bool normal_can = normal_attempts > 0
+          and g >= NORMALCELL_METABOLIZE_GLUCOSE and o >= NORMALCELL_METABOLIZE_OXYGEN;
+        bool cancer_can = cancer_attempts > 0 and g >= CANCER_CELL_METABOLIZE_GLUCOSE;
+        if( normal_can == false and cancer_can == false ) break;
+        bool pick_normal = normal_can;
+        if( normal_can and cancer_can ) {
+          std::uniform_int_distribution<long long> distribution( 0, normal_attempts + cancer_attempts - 1 );
+          pick_normal = distribution( engine_ ) < normal_attempts;
+        }
+        // 選んだ種類の中で、試行数に比例して分類を選ぶ。
+        long long total = pick_normal ? normal_attempts : cancer_attempts;
+        std::uniform_int_distribution<long long> distribution( 0, total - 1 );
+        long long r = distribution( engine_ );
+        size_t k = group;
+        for( ; k < group_end; k++ ) {
+          if( normal[k] != pick_normal ) continue;
+          if( r < attempts[k] ) break;
+          r -= attempts[k];
+        }
+        attempts[k]--;
+        successes[k]++;
+        if( pick_normal ) {
+          normal_attempts--;
+          g -= NORMALCELL_METABOLIZE_GLUCOSE;
+          o -= NORMALCELL_METABOLIZE_OXYGEN;
+        } else {
+          cancer_attempts--;
+          g -= CANCER_CELL_METABOLIZE_GLUCOSE;
+        }
+        changed = true;
+      }
+      group = group_end;
+    }
+    // 代謝できた細胞は、エネルギーの増えた分類に移す。
+    for( size_t k = begin; k < end; k++ ) {
+      if( successes[k-begin] == 0 ) continue;
+      CellClass c = classes_[k];
+      classes_[k].count -= successes[k-begin];
+      c.count = successes[k-begin];
+      c.energy += normal[k-begin] ? NORMAL_CELL_GAIN_ENERGY : CANCER_CELL_GAIN_ENERGY;
+      gained.push_back( c );
+    }
+    if( changed ) {
+      gs.setGlucose( x, y, z, g );
+      os.setOxygen( x, y, z, o );
+    }
+    begin = end;
+  }
+  size_t sorted = classes_.size();
+  classes_.insert( classes_.end(), gained.begin(), gained.end() );
+  merge( sorted );
+}
+
+void CellPopulation::removeDeadCells() {
+  size_t n = 0;
+  FOR( k, (int)classes_.size() ) {
+    const CellClass& c = classes_[k];
+    if( c.energy <= CELL_DEATH_THRESHOLD_ENERGY ) continue;
+    if( c.division >= MAX_CELL_DIVISION_COUNT ) continue;
+    classes_[n++] = c;
+  }
+  classes_.resize( n );
+}
+
+void CellPopulation::removeByImmunity( TcellMap& tcellmap, VECTOR(Tcell *)& newtcells ) {
+  CellStatistics& statistics = CellStatistics::Instance();
+  size_t n = 0;
+  FOR( k, (int)classes_.size() ) {
+    CellClass& c = classes_[k];
+    Cell& cell = prototype( c );
+    if( cell.isCancerCell() ) {
+      // 位置にいるT細胞のうち、遺伝子配列が一致するものが順に判定する。
+      // 細胞を除去するのは、最初に免疫原性の確率で当たったT細胞になる。
+      const VECTOR(Tcell *)& tcells = tcellmap.tcellsAt( c.y, c.x, c.z );
+      double prob = std::min( cell.immunogenicity(), 100.0 )/100;
+      VECTOR(Tcell *) matching;
+      EACH( it_tcell, tcells ) {
+        if( cell.match( **it_tcell ) ) matching.push_back( *it_tcell );
+      }
+      int m = matching.size();
+      if( m == 0 or prob <= 0 ) { classes_[n++] = c; continue; }
+      int killed = binomial( c.count, 1 - pow( 1 - prob, m ) );
+      c.count -= killed;
+      statistics.killedCells( killed );
+      // 除去した細胞を、どのT細胞が除去したかで分ける。
+      FOR( i, m ) {
+        // 残りのT細胞のどれかが除去した条件で、このT細胞が除去した確率
+        int by = i == m-1 ? killed : binomial( killed, prob/( 1 - pow( 1 - prob, m - i ) ) );
+        killed -= by;
+        FOR( j, by ) { newtcells.push_back( &matching[i]->clone() ); }
+      }
+    }
+    if( c.count > 0 ) classes_[n++] = c;
+  }
+  classes_.resize( n );
+}
+
+void CellPopulation::count( CellStatistics& statistics ) {
+  statistics.clear();
+  EACH( it_class, classes_ ) {
+    statistics.addCells( prototype( *it_class ), it_class->count );
+  }
+}
+
+void CellPopulation::siteCounts( TiledGrid<int>& all, TiledGrid<int>& normal, TiledGrid<int>& cancer ) {
+  EACH( it_class, classes_ ) {
+    all.ref( it_class->x, it_class->y, it_class->z ) += it_class->count;
+    if( prototype( *it_class ).isNormalCell() ) normal.ref( it_class->x, it_class->y, it_class->z ) += it_class->count;
+    else cancer.ref( it_class->x, it_class->y, it_class->z ) += it_class->count;
+  }
+}
+
+void CellPopulation::secrete( ChemokineScape& chemokine ) {
+  EACH( it_class, classes_ ) {
+    if( prototype( *it_class ).isCancerCell() ) {
+      chemokine.addSource( it_class->x, it_class->y, it_class->z, CHEMOKINE_SECRETION*it_class->count );
+    }
+  }
+}
+
+void CellPopulation::outputMaps() {
+  TiledGrid<int> all, normal, cancer;
+  siteCounts( all, normal, cancer );
+  const char *names[] = { "cell", "normalcell", "cancercell" };
+  TiledGrid<int> *grids[] = { &all, &normal, &cancer };
+  FOR( k, 3 ) {
+    char file_name[256];
+    sprintf( file_name, "%d-%s.txt", StepKeeper::Instance().step(), names[k] );
+    output_tiled_map( file_name, *grids[k] );
+  }
+}
+
+/*
+ * ModelKernels
+ */
+ModelKernels& ModelKernels::Instance() {
+  static ModelKernels instance;
+  return instance;
+}
+
+namespace {
+  struct GeneKernelEntry {
+    int length;
+    ModelKernels::ImmuneFunc immune;
+    const char *name;
+  };
+#define GENE_KERNEL(L) { L, ImmuneKernel<L>::run, "gene" #L }
+  const GeneKernelEntry gene_kernels[] = {
+    GENE_KERNEL(8), GENE_KERNEL(16), GENE_KERNEL(32), GENE_KERNEL(64),
+    { CELL_GENE_LENGTH, ImmuneKernel<CELL_GENE_LENGTH>::run, "gene-configured" },
+  };
+#undef GENE_KERNEL
+
+  struct WalkKernelEntry {
+    int width, height, boundary;
+    ModelKernels::WalkFunc walk;
+    ModelKernels::WalkSpaceFunc walkSpace;
+    ModelKernels::WalkBiasedFunc walkBiased;
+    const char *name;
+  };
+#define WALK_ENTRY(W, H, B, PERIODIC, NAME) \
+  { W, H, B, WalkKernel<W, H, PERIODIC>::walk, WalkKernel<W, H, PERIODIC>::walkSpace, \
+    WalkKernel<W, H, PERIODIC>::walkBiased, NAME }
+#define WALK_KERNEL(W, H) \
+  WALK_ENTRY(W, H, 0, false, "walk" #W "x" #H "-wall"), \
+  WALK_ENTRY(W, H, 1, true, "walk" #W "x" #H "-periodic")
+  const WalkKernelEntry walk_kernels[] = {
+    WALK_KERNEL(16, 16), WALK_KERNEL(32, 32), WALK_KERNEL(64, 64),
+    WALK_KERNEL(128, 128), WALK_KERNEL(256, 256), WALK_KERNEL(512, 512),
+    WALK_ENTRY(WIDTH, HEIGHT, 0, false, "walk-configured-wall"),
+    WALK_ENTRY(WIDTH, HEIGHT, 1, true, "walk-configured-periodic"),
+  };
+  const WalkKernelEntry generic_walk_kernels[] = {
+    WALK_ENTRY(0, 0, 0, false, "walk-generic-wall"),
+    WALK_ENTRY(0, 0, 1, true, "walk-generic-periodic"),
+  };
+#undef WALK_KERNEL
+#undef WALK_ENTRY
+}
+
+void ModelKernels::select( int gene_length, int width, int height, int boundary ) {
+  immune = ImmuneKernel<0>::run;
+  gene_name_ = "gene-generic";
+  FOR( k, (int)( sizeof(gene_kernels)/sizeof(gene_kernels[0]) ) ) {
+    if( gene_kernels[k].length == gene_length ) {
+      immune = gene_kernels[k].immune;
+      gene_name_ = gene_kernels[k].name;
+      break;
+    }
+  }
+
+  const WalkKernelEntry *chosen = &generic_walk_kernels[ boundary == 1 ? 1 : 0 ];
+  FOR( k, (int)( sizeof(walk_kernels)/sizeof(walk_kernels[0]) ) ) {
+    const WalkKernelEntry& entry = walk_kernels[k];
+    if( entry.width == width and entry.height == height and entry.boundary == boundary ) {
+      chosen = &entry;
+      break;
+    }
+  }
+  walk = chosen->walk;
+  walkSpace = chosen->walkSpace;
+  walkBiased = chosen->walkBiased;
+  walk_name_ = chosen->name;
+}
+
+/*
+ * RandomWalkKernel
+ */
+void RandomWalkKernel::resize( int n ) {
+  if( (int)xs_.size() < n ) {
+    xs_.resize( n ); ys_.resize( n ); distances_.resize( n ); ids_.resize( n ); energies_.resize( n );
+    if( DIMENSION == 3 ) zs_.resize( n );
+  }
+}
+
+namespace {
+  // 座標配列の移動を分担する仕事
+  struct WalkTask : public ParallelTask {
+    int *xs, *ys, *zs, *distances;     // zs は立体のみ
+    const long long *ids;
+    const __Landscape *landscape;
+    const DirectionTable *directions;  // 方向表（なければ NULL）
+    const DepthTable *depth_directions;  // 奥行きの方向表（立体のみ）
+    ENERGY *energies;                  // 移動のコストを引くエネルギー（なければ NULL）
+    WalkTask() : zs(NULL), directions(NULL), depth_directions(NULL), energies(NULL) { }
+    virtual void run( int begin, int end, int thread ) {
+      if( directions != NULL ) {
+        RandomWalkKernel::walkBiased( xs, ys, zs, ids, distances, begin, end, directions, depth_directions );
+      } else if( DIMENSION == 3 ) {
+        RandomWalkKernel::walkSpace( xs, ys, zs, ids, distances, begin, end );
+      } else {
+        RandomWalkKernel::walk( xs, ys, ids, distances, begin, end, *landscape );
+      }
+      if( energies != NULL ) RandomWalkKernel::charge( energies, distances, begin, end );
+    }
+  };
+}
+
+void RandomWalkKernel::walk( int *xs, int *ys, const long long *ids, int *distances,
+    int begin, int end, const __Landscape& landscape ) {
+  ModelKernels::Instance().walk( xs, ys, ids, distances, begin, end,
+      StepKeeper::Instance().step(), landscape.width(), landscape.height() );
+}
+
+void RandomWalkKernel::walkSpace( int *xs, int *ys, int *zs, const long long *ids, int *distances,
+    int begin, int end ) {
+  ModelKernels::Instance().walkSpace( xs, ys, zs, ids, distances, begin, end,
+      StepKeeper::Instance().step(), WIDTH, HEIGHT, LAYERS );
+}
+
+void RandomWalkKernel::walkBiased( int *xs, int *ys, int *zs, const long long *ids, int *distances,
+    int begin, int end, const DirectionTable *directions, const DepthTable *depth_directions ) {
+  ModelKernels::Instance().walkBiased( xs, ys, zs, ids, distances, begin, end,
+      StepKeeper::Instance().step(), WIDTH, HEIGHT, LAYERS, directions, depth_directions );
+}
+
+void RandomWalkKernel::moveCells( VECTOR(Cell *)& cells, const __Landscape& landscape, ThreadPool& pool ) {
+  int n = cells.size();
+  if( n == 0 ) return;
+  resize( n );
+  FOR( i, n ) {
+    xs_[i] = cells[i]->x(); ys_[i] = cells[i]->y(); ids_[i] = cells[i]->id();
+    energies_[i] = cells[i]->energy();
+  }
+  if( DIMENSION == 3 ) { FOR( i, n ) { zs_[i] = cells[i]->z(); } }
+  WalkTask task;
+  task.xs = &xs_[0]; task.ys = &ys_[0]; task.ids = &ids_[0];
+  task.distances = &distances_[0]; task.landscape = &landscape;
+  task.energies = &energies_[0];
+  if( DIMENSION == 3 ) task.zs = &zs_[0];
+  pool.run( task, n );
+  FOR( i, n ) {
+    Cell& cell = *cells[i];
+    cell.setLocation( xs_[i], ys_[i], DIMENSION == 3 ? zs_[i] : 0 );
+    // 動かなかった細胞は、エネルギーも統計も変わらない。
+    if( distances_[i] != 0 ) cell.setEnergy( energies_[i] );
+  }
+}
+
+void RandomWalkKernel::moveTcells( TcellRing& tcells, const __Landscape& landscape, ThreadPool& pool,
+    const DirectionTable *directions, const DepthTable *depth_directions ) {
+  int n = tcells.freeSize();
+  if( n == 0 ) return;
+  resize( n );
+  int i = 0;
+  FOR( k, TCELL_LIFESPAN ) {
+    EACH( it_tcell, tcells.bucket(k) ) {
+      xs_[i] = (*it_tcell)->x(); ys_[i] = (*it_tcell)->y(); ids_[i] = (*it_tcell)->id();
+      if( DIMENSION == 3 ) zs_[i] = (*it_tcell)->z();
+      i++;
+    }
+  }
+  WalkTask task;
+  task.xs = &xs_[0]; task.ys = &ys_[0]; task.ids = &ids_[0];
+  task.distances = &distances_[0]; task.landscape = &landscape;
+  if( DIMENSION == 3 ) task.zs = &zs_[0];
+  task.directions = directions;
+  task.depth_directions = depth_directions;
+  pool.run( task, n );
+  i = 0;
+  FOR( k, TCELL_LIFESPAN ) {
+    EACH( it_tcell, tcells.bucket(k) ) {
+      (*it_tcell)->setLocation( xs_[i], ys_[i], DIMENSION == 3 ? zs_[i] : 0 ); i++;
+    }
+  }
+}
+
+/*
+ * __Life
+ */
+void __Life::randomSetGene( int length ) {
+  gene_ = "";
+  FOR( i, length ) {
+    gene_ += Random::Instance().probability(50) ? '0' : '1';
+  }
+}
+
+void __Life::initiateGene( int length ) {
+  gene_ = "";
+  FOR( i, length ) {
+    gene_ += '0';
+  }
+}
+void __Life::flip( int pos ) {
+  pos = pos%CELL_GENE_LENGTH;
+  if( gene_[pos] == '0' ) {
+    gene_[pos] = '1';
+  } else {
+    gene_[pos] = '0';
+  }
+}
+
+bool __Life::mutateGene( double prob, RandomStream& random ) {
+  // 突然変異をしたら、真を返す
+  // 0の時だけ1にする
+  bool changed = false;
+  if( random.probability(prob) ) {
+    int pos = random.uniformInt( 0, CELL_GENE_LENGTH-1 );
+    // flip(pos);
+    pos = pos%CELL_GENE_LENGTH;
+    if( gene_[pos] == '0' ) {
+      gene_[pos] = '1';
+      changed = true;
+    }
+  }
+  return changed;
+}
+
@@ -0,0 +1,307 @@
+#! /usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# パラメータスイープの作業キュー
+#
+# スイープを一度記述すると、パラメータの組ごとのジョブに展開して
+# sweep/<名前>/ 以下のディレクトリに置く。ジョブの状態はディレクトリで表す。
+#
+#   pending/  未実行（再試行待ちを含む）
+#   running/  実行中。ファイル名に実行しているプロセスを付ける
+#   done/     完了
+#   failed/   再試行回数を使い切った
+#
+# ジョブの取得は rename で行うので、複数のワーカーが同時に取りにいっても
+# 同じジョブを二重に実行することはない。各ジョブは専用のディレクトリで
+# ビルドと実行をして、終わったら master/ に移して索引に加える。
+# ワーカーが落ちた場合は、次に work したときに running/ に残ったジョブを戻す。
+# 並列にするのはワーカーの数なので、ジョブは THREAD_SIZE=1 でビルドする
+# （ジョブで THREAD_SIZE を指定したときは、その値を使う）。
+#
+# --ensemble で系列を指定すると、各ジョブの結果は master/ に移さず、
+# 指定した系列だけを sweep/<名前>/ensemble/ の集計に加えて捨てる（ensemble.py）。
+# 直積ではなく空間を埋める標本点で感度解析をするときは、design.py でジョブを作る。
+#
+# 使い方:
+#   python sweep.py init threshold CELL_DIVISION_THRESHOLD_ENERGY=0.5:100:0.5
+#   python sweep.py init grid TCELL_SIZE=50,100,200 RANDOM_SEED=1,2,3 --retries 2
+#   python sweep.py init replicates RANDOM_SEED=1:1000:1 --ensemble cancercell-size,mutantcancer-size
+#   python sweep.py work threshold -n 8
+#   python sweep.py status threshold
+
+import os
+import re
+import sys
+import shutil
+import socket
+import subprocess
+
+import ensemble
+
+SWEEP_DIR = 'sweep'
+MASTER_DIR = 'master'
+SOURCE_FNAME = 'src/main.cpp'
+EXE_NAME = 'CancerImmunoeditingModel.exe'
+COMPILE = ['g++', '-O2', '-Wall']  # 警告は実行ごとのログ（sweep.log, regress.log）に残る
+LIBS = ['-lpthread']
+
+STATES = ['pending', 'running', 'done', 'failed']
+
+# ワーカー１つがコア１つを使うように、ジョブのスレッド数を決めておく。
+JOB_DEFAULTS = [('THREAD_SIZE', '1')]
+
+def sweep_path(name, *args):
+    return os.path.join(SWEEP_DIR, name, *args)
+
+def write_atomic(fname, text):
+    tmp = '%s.%d.tmp' % (fname, os.getpid())
+    f = open(tmp, 'w')
+    f.write(text)
+    f.close()
+    os.rename(tmp, fname)
+
+# ---------------------------------------------------------------- ジョブ
+
+def frange(start, stop, step):
+    values = []
+    i = 0
+    while True:
+        value = start + i*step
+        if value > stop + step*1e-9: break
+        values.append(value)
+        i += 1
+    return values
+
+def parse_values(text):
+    """ 'a,b,c' か 'start:stop:step' を値の配列にする """
+    if ':' in text:
+        start, stop, step = [float(v) for v in text.split(':')]
+        return ['%g' % v for v in frange(start, stop, step)]
+    return text.split(',')
+
+def expand(axes):
+    """ パラメータの直積をとる """
+    jobs = [[]]
+    for param, values in axes:
+        jobs = [job + [(param, value)] for job in jobs for value in values]
+    return jobs
+
+def read_job(fname):
+    params = []
+    attempts = 0
+    for line in open(fname):
+        line = line.split()
+        if len(line) != 2: continue
+        if line[0] == '#attempts': attempts = int(line[1])
+        else: params.append((line[0], line[1]))
+    return params, attempts
+
+def write_job(fname, params, attempts):
+    text = ''.join(['%s %s\n' % (p, v) for p, v in params])
+    write_atomic(fname, text + '#attempts %d\n' % attempts)
+
+def init(name, args):
+    axes = []
+    retries = 1
+    series = []
+    i = 0
+    while i < len(args):
+        if args[i] == '--retries':
+            retries = int(args[i+1])
+            i += 2
+            continue
+        if args[i] == '--ensemble':
+            series = args[i+1].split(',')
+            i += 2
+            continue
+        param, values = args[i].split('=', 1)
+        axes.append((param, parse_values(values)))
+        i += 1
+    create(name, expand(axes), retries, series)
+
+def create(name, jobs, retries=1, series=[]):
+    """ ジョブの配列からスイープを作る。既にあれば偽を返す """
+    if os.path.exists(sweep_path(name)):
+        print('==> %s already exists' % sweep_path(name))
+        return False
+    source = open(SOURCE_FNAME).read()
+    for param, value in jobs[0]:
+        set_parameters(source, [(param, value)])  # 存在しないパラメータなら例外
+    for state in STATES:
+        os.makedirs(sweep_path(name, state))
+    os.makedirs(sweep_path(name, 'work'))
+    shutil.copy(SOURCE_FNAME, sweep_path(name, 'main.cpp'))
+    write_atomic(sweep_path(name, 'retries'), '%d\n' % retries)
+    if series: write_atomic(sweep_path(name, 'ensemble.series'), '\n'.join(series) + '\n')
+    add_jobs(name, jobs)
+    return True
+
+def job_count(name):
+    """ これまでに作ったジョブの数。番号は 0 から連続している """
+    count = 0
+    for state in STATES:
+        for job in os.listdir(sweep_path(name, state)):
+            if job.endswith('.tmp'): continue
+            count = max(count, int(job.split('@', 1)[0]) + 1)
+    return count
+
+def add_jobs(name, jobs):
+    """ 既存のジョブの続きの番号で、未実行のジョブを加える。最初の番号を返す """
+    first = job_count(name)
+    for n, params in enumerate(jobs):
+        write_job(sweep_path(name, 'pending', '%05d' % (first + n)), params, 0)
+    print('==> %d jobs in %s' % (first + len(jobs), sweep_path(name)))
+    return first
+
+# ---------------------------------------------------------------- 実行
+
+def set_parameters(source, params):
+    """ 'const TYPE NAME = VALUE;' の値を書き換える """
+    for param, value in params:
+        pattern = re.compile(r'^(const\s+\S+\s+%s\s*=\s*)[^;]*;' % re.escape(param), re.M)
+        source, count = pattern.subn(lambda m: m.group(1) + value + ';', source)
+        if count == 0: raise ValueError('unknown parameter: %s' % param)
+    return source
+
+def ensemble_series(name):
+    fname = sweep_path(name, 'ensemble.series')
+    if not os.path.exists(fname): return []
+    return open(fname).read().split()
+
+def run_job(name, job, params):
+    """ ジョブを専用のディレクトリでビルドして実行する。成功したら真を返す """
+    result = 'result-%s-%s' % (name, job)
+    if os.path.exists(os.path.join(MASTER_DIR, result)):
+        return True  # 前回、結果を移した直後に落ちた
+    work = sweep_path(name, 'work', job)
+    if os.path.exists(work): shutil.rmtree(work)
+    os.makedirs(os.path.join(work, 'src'))
+    os.makedirs(os.path.join(work, 'bin'))
+    source = open(sweep_path(name, 'main.cpp')).read()
+    open(os.path.join(work, SOURCE_FNAME), 'w').write(set_parameters(source, JOB_DEFAULTS + params))
+    log = open(os.path.join(work, 'bin', 'sweep.log'), 'w')
+    exe = os.path.join(work, 'bin', EXE_NAME)
+    try:
+        if subprocess.call(COMPILE + [os.path.join(work, SOURCE_FNAME), '-o', exe] + LIBS,
+                           stdout=log, stderr=log) != 0:
+            return False
+        if subprocess.call(['./' + EXE_NAME], cwd=os.path.join(work, 'bin'),
+                           stdout=log, stderr=log) != 0:
+            return False
+    finally:
+        log.close()
+    series = ensemble_series(name)
+    if series:
+        # 集計に加えたら、実行結果は残さない。
+        ensemble.add(sweep_path(name, 'ensemble'), job, os.path.join(work, 'bin'), series)
+        shutil.rmtree(work)
+        return True
+    if not os.path.exists(MASTER_DIR): os.makedirs(MASTER_DIR)
+    os.rename(work, os.path.join(MASTER_DIR, result))
+    return True
+
+def owner():
+    return '%s-%d' % (socket.gethostname(), os.getpid())
+
+def claim(name):
+    """ 未実行のジョブを１つ取る。なければ None を返す """
+    for job in sorted(os.listdir(sweep_path(name, 'pending'))):
+        if job.endswith('.tmp'): continue
+        running = '%s@%s' % (job, owner())
+        try:
+            os.rename(sweep_path(name, 'pending', job), sweep_path(name, 'running', running))
+        except OSError:
+            continue  # 他のワーカーが先に取った
+        return job, running
+    return None
+
+def finish(name, job, running, ok):
+    params, attempts = read_job(sweep_path(name, 'running', running))
+    attempts += 1
+    retries = int(open(sweep_path(name, 'retries')).read())
+    if ok: state = 'done'
+    elif attempts <= retries: state = 'pending'
+    else: state = 'failed'
+    write_job(sweep_path(name, 'running', running), params, attempts)
+    os.rename(sweep_path(name, 'running', running), sweep_path(name, state, job))
+    return state
+
+def worker(name):
+    while True:
+        claimed = claim(name)
+        if claimed is None: return
+        job, running = claimed
+        params, attempts = read_job(sweep_path(name, 'running', running))
+        try:
+            ok = run_job(name, job, params)
+        except Exception as e:
+            sys.stderr.write('%s: %s\n' % (job, e))
+            ok = False
+        state = finish(name, job, running, ok)
+        print('[%s] %s %s -> %s' % (owner(), job,
+              ' '.join(['%s=%s' % p for p in params]), state))
+        sys.stdout.flush()
+
+def alive(pid):
+    try:
+        os.kill(pid, 0)
+    except OSError:
+        return False
+    return True
+
+def recover(name):
+    """ 落ちたワーカーが実行していたジョブを未実行に戻す """
+    host = socket.gethostname()
+    for running in os.listdir(sweep_path(name, 'running')):
+        if running.endswith('.tmp'): continue
+        job, who = running.split('@', 1)
+        who_host, pid = who.rsplit('-', 1)
+        if who_host == host and not alive(int(pid)):
+            try:
+                os.rename(sweep_path(name, 'running', running), sweep_path(name, 'pending', job))
+                print('==> %s requeued' % job)
+            except OSError:
+                pass
+
+def work(name, workers):
+    recover(name)
+    pids = []
+    for n in range(workers):
+        pid = os.fork()
+        if pid == 0:
+            try:
+                worker(name)
+            finally:
+                os._exit(0)
+        pids.append(pid)
+    for pid in pids:
+        os.waitpid(pid, 0)
+    if os.path.exists(MASTER_DIR):
+        subprocess.call([sys.executable, 'catalog.py', 'build'])
+    status(name)
+
+def status(name):
+    counts = ['%s %d' % (state, len([f for f in os.listdir(sweep_path(name, state))
+                                     if not f.endswith('.tmp')]))
+              for state in STATES]
+    print('==> %s: %s' % (name, ', '.join(counts)))
+
+def usage():
+    print('usage: sweep.py init NAME PARAM=a,b,c|start:stop:step ... [--retries K] [--ensemble SERIES,...]')
+    print('       sweep.py work NAME [-n WORKERS]')
+    print('       sweep.py status NAME')
+    sys.exit(1)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3: usage()
+    command, name = sys.argv[1], sys.argv[2]
+    if command == 'init':
+        init(name, sys.argv[3:])
+    elif command == 'work':
+        workers = 1
+        if '-n' in sys.argv: workers = int(sys.argv[sys.argv.index('-n') + 1])
+        work(name, workers)
+    elif command == 'status':
+        status(name)
+    else:
+        usage()